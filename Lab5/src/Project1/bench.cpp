@@ -0,0 +1,188 @@
+// ѹ⣺̲߳Ϸ HEARTBEATͳƷÿ봦 Linux
+// ߳  ģʽ ˮȡģʽ session Ϊÿ߳һӣ
+// connect Ϊÿ½ӣudp Ϊÿ߳һ UDP ׽֣
+// ˮΪÿ߳һͳһȴӦ֡
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "protocol.h"
+
+#define SERVER_IP "127.0.0.1"
+#define PORT 8080
+#define TARGET_RATE 200000 // Ŀ꣺ÿ 20 
+#define LICENSE_KEY "1234567890"
+#define MAX_DEPTH 32 // ÿӵӦ𻺳ܷµ֡
+#define UDP_TIMEOUT_MS 100 // UDP ģʽµȴһӦʱ䣬ʱʧ
+
+std::atomic<long> heartbeats(0);
+std::atomic<long> failures(0);
+std::atomic<long> connections(0);
+bool reconnect = false; // ÿ½
+bool udp = false;
+int depth = 1;
+uint64_t session_id = 0;
+
+int connect_server(int type = SOCK_STREAM) {
+    int fd = socket(AF_INET, type, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(PORT);
+    inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr);
+
+    if (connect(fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    connections++;
+    return fd;
+}
+
+bool recv_all(int fd, char* data, size_t length) {
+    while (length > 0) {
+        ssize_t n = recv(fd, data, length, 0);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+//  count ٰ֡˳Ӧ𣬷״̬Ϊ expect Ӧӳ -1
+int exchange(int fd, license_frame* requests, int count, uint8_t expect) {
+    license_frame replies[MAX_DEPTH];
+    if (send(fd, requests, count * FRAME_SIZE, MSG_NOSIGNAL) != (ssize_t)(count * FRAME_SIZE) ||
+        !recv_all(fd, (char*)replies, count * FRAME_SIZE)) {
+        return -1;
+    }
+    int matched = 0;
+    for (int i = 0; i < count; i++) {
+        if (replies[i].request_id == requests[i].request_id && replies[i].status == expect) {
+            matched++;
+        }
+    }
+    return matched;
+}
+
+// UDP ģʽ count ݱڳʱǰջӦ𣬷յ ALIVE 
+int udp_exchange(int fd, license_frame* requests, int count) {
+    for (int i = 0; i < count; i++) {
+        send(fd, &requests[i], FRAME_SIZE, 0);
+    }
+    uint32_t first = ntohl(requests[0].request_id);
+    int alive = 0;
+    license_frame reply;
+    while (alive < count && recv(fd, &reply, FRAME_SIZE, 0) == FRAME_SIZE) {
+        if (ntohl(reply.request_id) - first < (uint32_t)count && reply.status == STATUS_ALIVE) {
+            alive++;
+        }
+    }
+    return alive;
+}
+
+void run_udp_worker(std::chrono::steady_clock::time_point deadline) {
+    license_frame requests[MAX_DEPTH];
+    uint32_t request_id = 0;
+    int fd = connect_server(SOCK_DGRAM);
+    if (fd < 0) {
+        return;
+    }
+    timeval timeout = { 0, UDP_TIMEOUT_MS * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    while (std::chrono::steady_clock::now() < deadline) {
+        for (int i = 0; i < depth; i++) {
+            requests[i] = make_frame(FRAME_HEARTBEAT, ++request_id, session_id, LICENSE_KEY);
+        }
+        int alive = udp_exchange(fd, requests, depth);
+        heartbeats += alive;
+        failures += depth - alive;
+    }
+    close(fd);
+}
+
+void run_worker(std::chrono::steady_clock::time_point deadline) {
+    license_frame requests[MAX_DEPTH];
+    uint32_t request_id = 0;
+    int fd = -1;
+    while (std::chrono::steady_clock::now() < deadline) {
+        for (int i = 0; i < depth; i++) {
+            requests[i] = make_frame(FRAME_HEARTBEAT, ++request_id, session_id, LICENSE_KEY);
+        }
+        if (fd < 0) {
+            fd = connect_server();
+        }
+        int alive = fd < 0 ? -1 : exchange(fd, requests, depth, STATUS_ALIVE);
+        if (alive < 0 || reconnect) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            fd = -1;
+        }
+        alive = alive < 0 ? 0 : alive;
+        heartbeats += alive;
+        failures += depth - alive;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    int threads = argc > 1 ? atoi(argv[1]) : 8;
+    int seconds = argc > 2 ? atoi(argv[2]) : 5;
+    reconnect = argc > 3 && strcmp(argv[3], "connect") == 0;
+    udp = argc > 3 && strcmp(argv[3], "udp") == 0;
+    depth = argc > 4 ? atoi(argv[4]) : 1;
+    if (depth < 1 || depth > MAX_DEPTH) {
+        std::cerr << "Pipeline depth must be 1-" << MAX_DEPTH << std::endl;
+        return 1;
+    }
+
+    int fd = connect_server();
+    license_frame verify = make_frame(FRAME_VERIFY, 0, 0, LICENSE_KEY);
+    license_frame reply;
+    if (fd < 0 || send(fd, &verify, FRAME_SIZE, MSG_NOSIGNAL) != FRAME_SIZE || !recv_all(fd, (char*)&reply, FRAME_SIZE) ||
+        reply.status != STATUS_AUTHORIZED) {
+        std::cerr << "Verify failed!" << std::endl;
+        return 1;
+    }
+    session_id = frame_session(reply);
+    connections = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::seconds(seconds);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+        workers.emplace_back(udp ? run_udp_worker : run_worker, deadline);
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    license_frame release = make_frame(FRAME_RELEASE, 0, session_id, LICENSE_KEY);
+    exchange(fd, &release, 1, STATUS_RELEASED);
+    close(fd);
+
+    long rate = (long)(heartbeats / elapsed);
+    std::cout << "heartbeats " << heartbeats << " failed " << failures << " connections " << connections
+              << " elapsed_s " << elapsed
+              << " rate " << rate << "/s target " << TARGET_RATE << "/s "
+              << (rate >= TARGET_RATE ? "met" : "missed") << std::endl;
+    return 0;
+}
@@ -1,16 +1,40 @@
 #include <iostream>
 #include <cstring>
 #include <string>
-#include <winsock2.h>
-#include <ws2tcpip.h>
 #include <thread>
 #include <chrono>
+#include <mutex>
+#include <atomic>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
 
 #pragma comment(lib, "Ws2_32.lib") //  WinSock 
+#else
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define closesocket close
+#endif
+#include "protocol.h"
 
 #define SERVER_IP "127.0.0.1"
 #define PORT 8080
+#define HEARTBEAT_INTERVAL 30 // 룩
+#define UDP_TIMEOUT_MS 1000 // UDP ȴӦʱ
 
+SOCKET session_socket = INVALID_SOCKET; // ĳӣVERIFYHEARTBEATRELEASE 
+std::mutex session_mutex;
+uint64_t session_id = 0; // VERIFY ʱ䣬ȻЧ
+std::atomic<uint32_t> next_request_id(1); // Ự̺߳ UDP ̶߳ȡID
+SOCKET heartbeat_socket = INVALID_SOCKET; // UDP ģʽ·׽
+
+#ifdef _WIN32
 void initialize_winsock() {
     WSADATA wsaData;
     if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
@@ -18,80 +42,153 @@ void initialize_winsock() {
         exit(EXIT_FAILURE);
     }
 }
+#endif
 
-void send_heartbeat(const std::string& license_key) {
-    while (true) {
-        std::this_thread::sleep_for(std::chrono::seconds(30));
-        SOCKET client_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (client_socket == INVALID_SOCKET) {
-            std::cerr << "Socket creation failed!" << std::endl;
-            continue;
+//  TCP  UDP ׽
+SOCKET connect_server(int type) {
+    SOCKET s = socket(AF_INET, type, 0);
+    if (s == INVALID_SOCKET) {
+        std::cerr << "Socket creation failed!" << std::endl;
+        return INVALID_SOCKET;
+    }
+
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(PORT);
+    inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr);
+
+    if (connect(s, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        std::cerr << "Connection failed!" << std::endl;
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+}
+
+// Ự
+bool open_session() {
+    session_socket = connect_server(SOCK_STREAM);
+    return session_socket != INVALID_SOCKET;
+}
+
+void close_session() {
+    if (session_socket != INVALID_SOCKET) {
+        closesocket(session_socket);
+        session_socket = INVALID_SOCKET;
+    }
+}
+
+//  length ֽ
+bool recv_all(char* data, size_t length) {
+    while (length > 0) {
+        int n = recv(session_socket, data, (int)length, 0);
+        if (n <= 0) {
+            return false;
         }
+        data += n;
+        length -= n;
+    }
+    return true;
+}
 
-        sockaddr_in server_addr{};
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_port = htons(PORT);
-        inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr);
+// ڻỰϷһ֡ȴӦӶϿӦ𲻶Ӧʱ false
+bool session_request(uint8_t type, const std::string& license_key, license_frame& reply) {
+    std::lock_guard<std::mutex> lock(session_mutex);
+    if (session_socket == INVALID_SOCKET && !open_session()) {
+        return false;
+    }
 
-        if (connect(client_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-            std::cerr << "Connection failed!" << std::endl;
-            closesocket(client_socket);
-            continue;
+    uint32_t request_id = next_request_id++;
+    license_frame request = make_frame(type, request_id, session_id, license_key.c_str());
+    char skip[FRAME_MAX];
+    if (send(session_socket, (const char*)&request, FRAME_SIZE, 0) != FRAME_SIZE ||
+        !recv_all((char*)&reply, FRAME_SIZE) ||
+        ntohs(reply.length) < FRAME_SIZE || ntohs(reply.length) > FRAME_MAX ||
+        !recv_all(skip, ntohs(reply.length) - FRAME_SIZE) ||
+        ntohl(reply.request_id) != request_id) {
+        close_session();
+        return false;
+    }
+    return true;
+}
+
+//  UDP һȴӦһٷʱ false
+bool udp_heartbeat(const std::string& license_key, license_frame& reply) {
+    if (heartbeat_socket == INVALID_SOCKET) {
+        heartbeat_socket = connect_server(SOCK_DGRAM);
+        if (heartbeat_socket == INVALID_SOCKET) {
+            return false;
         }
+#ifdef _WIN32
+        DWORD timeout = UDP_TIMEOUT_MS;
+#else
+        timeval timeout = { UDP_TIMEOUT_MS / 1000, UDP_TIMEOUT_MS % 1000 * 1000 };
+#endif
+        setsockopt(heartbeat_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+    }
 
-        std::string heartbeat_msg = "HEARTBEAT:" + license_key;
-        send(client_socket, heartbeat_msg.c_str(), heartbeat_msg.size(), 0);
+    uint32_t request_id = next_request_id++;
+    license_frame request = make_frame(FRAME_HEARTBEAT, request_id, session_id, license_key.c_str());
+    if (send(heartbeat_socket, (const char*)&request, FRAME_SIZE, 0) != FRAME_SIZE) {
+        return false;
+    }
+    while (recv(heartbeat_socket, (char*)&reply, FRAME_SIZE, 0) == FRAME_SIZE) {
+        if (ntohl(reply.request_id) == request_id) {
+            return true;
+        }
+        // ֮ǰʱٵӦ
+    }
+    return false;
+}
 
-        char buffer[1024] = { 0 };
-        recv(client_socket, buffer, sizeof(buffer), 0);
-        std::cout << "Heartbeat response: " << buffer << std::endl;
-        closesocket(client_socket);
+void send_heartbeat(const std::string& license_key, bool udp) {
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::seconds(HEARTBEAT_INTERVAL));
+        // ӶϿһӣԼԻỰIDڷ
+        license_frame reply;
+        if (udp ? !udp_heartbeat(license_key, reply) : !session_request(FRAME_HEARTBEAT, license_key, reply)) {
+            std::cerr << "Heartbeat failed!" << std::endl;
+            continue;
+        }
+        std::cout << "Heartbeat response: " << status_name(reply.status) << std::endl;
     }
 }
 
-int main() {
+// Ϊ udp ʱ UDPVERIFY  RELEASE ߻Ự
+int main(int argc, char* argv[]) {
+#ifdef _WIN32
     initialize_winsock();
+#endif
+    bool udp = argc > 1 && strcmp(argv[1], "udp") == 0;
 
     std::string license_key;
     std::cout << "Enter license key: ";
     std::cin >> license_key;
 
-    SOCKET client_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (client_socket == INVALID_SOCKET) {
-        std::cerr << "Socket creation failed!" << std::endl;
+    license_frame reply;
+    if (!session_request(FRAME_VERIFY, license_key, reply)) {
+#ifdef _WIN32
         WSACleanup();
+#endif
         return 1;
     }
+    std::cout << "Server response: " << status_name(reply.status) << std::endl;
 
-    sockaddr_in server_addr{};
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);
-    inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr);
-
-    if (connect(client_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        std::cerr << "Connection failed!" << std::endl;
-        WSACleanup();
-        return 1;
-    }
+    if (reply.status == STATUS_AUTHORIZED) {
+        session_id = frame_session(reply);
+        std::thread(send_heartbeat, license_key, udp).detach();
 
-    std::string verify_msg = "VERIFY:" + license_key;
-    send(client_socket, verify_msg.c_str(), verify_msg.size(), 0);
-
-    char buffer[1024] = { 0 };
-    recv(client_socket, buffer, sizeof(buffer), 0);
-    std::string response(buffer);
-    std::cout << "Server response: " << response << std::endl;
-
-    closesocket(client_socket);
-
-    if (response == "AUTHORIZED") {
-        std::thread(send_heartbeat, license_key).detach();
-    }
-
-    while (response == "AUTHORIZED") {
-        std::this_thread::sleep_for(std::chrono::seconds(1));
+        // ݻر黹֤
+        std::string line;
+        std::cin >> line;
+        if (session_request(FRAME_RELEASE, license_key, reply)) {
+            std::cout << "Release response: " << status_name(reply.status) << std::endl;
+        }
     }
 
+    close_session();
+#ifdef _WIN32
     WSACleanup();
+#endif
     return 0;
 }
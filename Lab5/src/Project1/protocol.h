@@ -0,0 +1,80 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <cstdint>
+#include <cstring>
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+#define LICENSE_KEY_SIZE 16 // кŶĲֲ0
+#define FRAME_SIZE 32 // ǰ汾֡
+#define FRAME_MAX 256 // շܵ֡
+
+// ͣӦ֡ type Ϊͼ FRAME_REPLY
+enum frame_type : uint8_t {
+    FRAME_VERIFY = 1,
+    FRAME_HEARTBEAT = 2,
+    FRAME_RELEASE = 3,
+    FRAME_NO_REPLY = 0x40, //  UDP Ӧ
+    FRAME_REPLY = 0x80
+};
+
+enum frame_status : uint8_t {
+    STATUS_AUTHORIZED,
+    STATUS_DENIED, // кŵ
+    STATUS_INVALID_LICENSE,
+    STATUS_ALIVE,
+    STATUS_NOT_FOUND, // ûỰỰк
+    STATUS_RELEASED,
+    STATUS_BAD_REQUEST
+};
+
+// Ӧʹͬ֡Ϊֽ򣬽շ length ֡ʶβֶΡ
+// session_id  VERIFY ӦзΪϯλƾ֤UDP ݱֻ HEARTBEAT
+struct license_frame {
+    uint16_t length;
+    uint8_t type;
+    uint8_t status; // Ӧ״̬Ϊ0
+    uint32_t request_id;
+    uint8_t session_id[8];
+    char license_key[LICENSE_KEY_SIZE];
+};
+
+static_assert(sizeof(license_frame) == FRAME_SIZE, "license frame size");
+
+inline uint64_t frame_session(const license_frame& frame) {
+    uint64_t id = 0;
+    for (int i = 0; i < 8; i++) {
+        id = id << 8 | frame.session_id[i];
+    }
+    return id;
+}
+
+inline void frame_set_session(license_frame& frame, uint64_t id) {
+    for (int i = 7; i >= 0; i--) {
+        frame.session_id[i] = (uint8_t)id;
+        id >>= 8;
+    }
+}
+
+// һ֡кųĲֱص
+inline license_frame make_frame(uint8_t type, uint32_t request_id, uint64_t session_id, const char* license_key) {
+    license_frame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.length = htons(FRAME_SIZE);
+    frame.type = type;
+    frame.request_id = htonl(request_id);
+    frame_set_session(frame, session_id);
+    memcpy(frame.license_key, license_key, strnlen(license_key, LICENSE_KEY_SIZE));
+    return frame;
+}
+
+inline const char* status_name(uint8_t status) {
+    static const char* names[] = { "AUTHORIZED", "DENIED", "INVALID_LICENSE", "ALIVE", "NOT_FOUND", "RELEASED", "BAD_REQUEST" };
+    return status <= STATUS_BAD_REQUEST ? names[status] : "UNKNOWN";
+}
+
+#endif
@@ -5,19 +5,62 @@
 #include <mutex>
 #include <chrono>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <random>
+#ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
 
 #pragma comment(lib, "Ws2_32.lib") //  WinSock 
+#else
+#include <unistd.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#endif
+#include "protocol.h"
 
 #define PORT 8080
 #define HEARTBEAT_TIMEOUT 60 // ʱʱ䣨룩
+#define EXPIRY_PRECISION_MS 1000 // Ĭϵĵڼ龫ȣ룩Լôñջ
+#define MAX_EVENTS 256 // ÿ epoll_wait ȡص¼
+#define SESSION_TIMEOUT 90 // Ựгʱʱ䣨룩ͻÿ30뷢һ
+#define REQUEST_SIZE 1024 // ÿӵ󻺳Сܷһ֡
+#define REPLY_SIZE 1024 // ÿӵӦ𻺳С
+#define UDP_BATCH 64 // һ recvmmsg ȡݱ
+#define UDP_ROUNDS 4 // ÿ¼ȡ֮ȴ
 
-std::map<std::string, int> license_map; // к -> ǰ
-std::set<std::string> valid_licenses = { "1234567890", "0987654321" }; // ʾЧк
+// һȨϯλ VERIFY ĻỰIDʶ
+struct lease {
+    const std::string* license_key; // ָ license_map еļ
+    uint64_t session_id;
+    uint64_t deadline; // ڵʱ
+    lease* prev; // ͬһʱеԼɻ
+    lease* next;
+};
+
+// Լڵһϣʱָ HEARTBEAT_TIMEOUTһֻеڵԼ
+// ڰԼƵµһ񣬵ڼֻѾ߹ĸ
+struct timing_wheel {
+    std::vector<lease> slots; // ÿıͷ
+    uint64_t tick_ms;
+    uint64_t current; // һҪʱ
+};
+
+std::map<std::string, int, std::less<>> license_map; // к -> ǰ
+std::set<std::string, std::less<>> valid_licenses = { "1234567890", "0987654321" }; // ʾЧк
 std::mutex map_mutex;
-std::map<std::string, std::chrono::time_point<std::chrono::system_clock>> heartbeat_map;
+std::unordered_map<uint64_t, lease> heartbeat_map; // ỰID -> ԼԪصĵַݺ󲻱
+std::random_device session_random; // ỰIDȡϵͳԴ÷ map_mutex
+timing_wheel lease_wheel;
 
+#ifdef _WIN32
 // ʼ WinSock
 void initialize_winsock() {
     WSADATA wsaData;
@@ -26,68 +69,243 @@ void initialize_winsock() {
         exit(EXIT_FAILURE);
     }
 }
+#endif
+
+uint64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void wheel_init(uint64_t tick_ms) {
+    lease_wheel.tick_ms = tick_ms;
+    // һȡٶһڴĸ񲻻ᱻµڵԼռ
+    lease_wheel.slots.resize(HEARTBEAT_TIMEOUT * 1000 / tick_ms + 2);
+    for (auto& slot : lease_wheel.slots) {
+        slot.prev = slot.next = &slot;
+    }
+    lease_wheel.current = now_ms() / tick_ms;
+}
 
-// ״̬
+void wheel_unlink(lease* l) {
+    l->prev->next = l->next;
+    l->next->prev = l->prev;
+}
+
+// ڣҵʱӳʱڵĸȡԼǰڣ÷ map_mutex
+void wheel_arm(lease* l, uint64_t now, bool linked) {
+    uint64_t deadline = (now + HEARTBEAT_TIMEOUT * 1000 + lease_wheel.tick_ms - 1) / lease_wheel.tick_ms;
+    if (linked) {
+        if (deadline == l->deadline) {
+            return;
+        }
+        wheel_unlink(l);
+    }
+    lease& slot = lease_wheel.slots[deadline % lease_wheel.slots.size()];
+    l->deadline = deadline;
+    l->prev = slot.prev;
+    l->next = &slot;
+    slot.prev->next = l;
+    slot.prev = l;
+}
+
+// ջһԼռõϯλɾ÷ map_mutex
+void remove_lease(lease* l) {
+    wheel_unlink(l);
+    license_map.find(*l->license_key)->second--;
+    heartbeat_map.erase(l->session_id);
+}
+
+// ÿһһεڵԼʱĳȾ
 void monitor_heartbeats() {
     while (true) {
-        std::this_thread::sleep_for(std::chrono::seconds(10));
-        auto now = std::chrono::system_clock::now();
+        uint64_t next = lease_wheel.current * lease_wheel.tick_ms; // һʼʱԼ
+        std::this_thread::sleep_for(std::chrono::milliseconds(next - std::min(next, now_ms())));
+        uint64_t now = now_ms() / lease_wheel.tick_ms;
         std::unique_lock<std::mutex> lock(map_mutex);
-        for (auto it = heartbeat_map.begin(); it != heartbeat_map.end();) {
-            auto duration = std::chrono::duration_cast<std::chrono::seconds>(now - it->second).count();
-            if (duration > HEARTBEAT_TIMEOUT) {
-                std::cout << "License " << it->first << " timed out. Removing." << std::endl;
-                license_map[it->first]--;
-                it = heartbeat_map.erase(it);
-            }
-            else {
-                ++it;
+        for (; lease_wheel.current <= now; lease_wheel.current++) {
+            lease& slot = lease_wheel.slots[lease_wheel.current % lease_wheel.slots.size()];
+            for (lease* l = slot.next; l != &slot;) {
+                lease* next = l->next;
+                // ʱڵԼƹһȦҽһǻû
+                if (l->deadline <= lease_wheel.current) {
+                    std::cout << "License " << *l->license_key << " session " << l->session_id << " timed out. Removing." << std::endl;
+                    remove_lease(l);
+                }
+                l = next;
             }
         }
     }
 }
 
-// ͻ
-void handle_client(SOCKET client_socket) {
-    char buffer[1024];
-    memset(buffer, 0, sizeof(buffer));
-    recv(client_socket, buffer, sizeof(buffer), 0);
+// һ֡Ӧ֡÷ map_mutexк string_viewڴ
+void apply_frame(const license_frame& request, license_frame& reply, bool datagram, uint64_t now) {
+    uint8_t type = request.type & ~FRAME_NO_REPLY;
+    reply = request;
+    reply.length = htons(FRAME_SIZE);
+    reply.type = type | FRAME_REPLY;
+    std::string_view license_key(request.license_key, strnlen(request.license_key, LICENSE_KEY_SIZE));
+    uint64_t session_id = frame_session(request);
+
+    if (datagram && type != FRAME_HEARTBEAT) {
+        reply.status = STATUS_BAD_REQUEST; // ݱԴα죬ռû黹ϯλ
+        return;
+    }
+    if (type == FRAME_VERIFY) {
+        if (valid_licenses.find(license_key) == valid_licenses.end()) {
+            reply.status = STATUS_INVALID_LICENSE;
+            return;
+        }
+        auto it = license_map.find(license_key);
+        if (it == license_map.end()) {
+            it = license_map.emplace(std::string(license_key), 0).first;
+        }
+        if (it->second >= 10) { // Ϊ10
+            reply.status = STATUS_DENIED;
+            return;
+        }
+        it->second++;
+        do { // ỰIDϯλƾ֤ܱµ0  VERIFY 
+            session_id = (uint64_t)session_random() << 32 | session_random();
+        } while (session_id == 0 || heartbeat_map.count(session_id));
+        lease& l = heartbeat_map[session_id];
+        l.license_key = &it->first;
+        l.session_id = session_id;
+        wheel_arm(&l, now, false);
+        frame_set_session(reply, session_id);
+        reply.status = STATUS_AUTHORIZED;
+        return;
+    }
+    if (type != FRAME_HEARTBEAT && type != FRAME_RELEASE) {
+        reply.status = STATUS_BAD_REQUEST;
+        return;
+    }
+    auto it = heartbeat_map.find(session_id);
+    if (it == heartbeat_map.end() || *it->second.license_key != license_key) {
+        reply.status = STATUS_NOT_FOUND;
+        return;
+    }
+    if (type == FRAME_HEARTBEAT) {
+        wheel_arm(&it->second, now, true);
+        reply.status = STATUS_ALIVE;
+        return;
+    }
+    remove_lease(&it->second);
+    reply.status = STATUS_RELEASED;
+}
 
-    std::string command(buffer);
-    std::string response;
+void handle_frame(const license_frame& request, license_frame& reply) {
+    std::lock_guard<std::mutex> lock(map_mutex);
+    apply_frame(request, reply, false, now_ms());
+}
 
-    std::unique_lock<std::mutex> lock(map_mutex);
+// һݱֻһ
+void handle_heartbeats(const license_frame* requests, license_frame* replies, int count) {
+    uint64_t now = now_ms();
+    std::lock_guard<std::mutex> lock(map_mutex);
+    for (int i = 0; i < count; i++) {
+        apply_frame(requests[i], replies[i], true, now);
+    }
+}
 
-    if (command.find("VERIFY:") == 0) {
-        std::string license_key = command.substr(7);
-        if (valid_licenses.count(license_key) == 0) {
-            response = "INVALID_LICENSE";
+// ݱҪһֶ֡ҲҪϷ֡Ĳǲʶֶ
+bool valid_datagram(const license_frame& request, size_t length) {
+    uint16_t frame_length = ntohs(request.length);
+    return length >= FRAME_SIZE && frame_length >= FRAME_SIZE && frame_length <= FRAME_MAX;
+}
+
+//  data ֡Ӧ׷ӵ replyѴֽ֡ȲϷ -1
+// Ӧ𻺳ʱͣ£ʣ֡Ӧ𷢳ٰ˳
+long handle_frames(const char* data, size_t length, char* reply, size_t* reply_length, size_t reply_size) {
+    size_t used = 0;
+    while (length - used >= sizeof(uint16_t) && *reply_length + FRAME_SIZE <= reply_size) {
+        uint16_t frame_length;
+        memcpy(&frame_length, data + used, sizeof(frame_length));
+        frame_length = ntohs(frame_length);
+        if (frame_length < FRAME_SIZE || frame_length > FRAME_MAX) {
+            return -1;
         }
-        else if (license_map[license_key] >= 10) { // Ϊ10
-            response = "DENIED";
+        if (length - used < frame_length) {
+            break;
         }
-        else {
-            license_map[license_key]++;
-            heartbeat_map[license_key] = std::chrono::system_clock::now();
-            response = "AUTHORIZED";
+        license_frame request, response;
+        memcpy(&request, data + used, FRAME_SIZE); //  FRAME_SIZE Ĳǲʶֶ
+        handle_frame(request, response);
+        memcpy(reply + *reply_length, &response, FRAME_SIZE);
+        *reply_length += FRAME_SIZE;
+        used += frame_length;
+    }
+    return (long)used;
+}
+
+#ifdef _WIN32
+// ȫ
+bool send_all(SOCKET client_socket, const char* data, size_t length) {
+    while (length > 0) {
+        int n = send(client_socket, data, (int)length, 0);
+        if (n <= 0) {
+            return false;
         }
+        data += n;
+        length -= n;
     }
-    else if (command.find("HEARTBEAT:") == 0) {
-        std::string license_key = command.substr(10);
-        if (heartbeat_map.find(license_key) != heartbeat_map.end()) {
-            heartbeat_map[license_key] = std::chrono::system_clock::now();
-            response = "ALIVE";
+    return true;
+}
+
+// ͻ
+void handle_client(SOCKET client_socket) {
+    DWORD timeout = SESSION_TIMEOUT * 1000; // Ựгʱ recv ʧܣӹر
+    setsockopt(client_socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+
+    char buffer[REQUEST_SIZE];
+    char reply[REPLY_SIZE];
+    size_t length = 0;
+    while (true) {
+        int n = recv(client_socket, buffer + length, (int)(sizeof(buffer) - length), 0);
+        if (n <= 0) {
+            break;
         }
-        else {
-            response = "NOT_FOUND";
+        length += n;
+
+        while (true) {
+            size_t reply_length = 0;
+            long used = handle_frames(buffer, length, reply, &reply_length, sizeof(reply));
+            if (used < 0) {
+                closesocket(client_socket);
+                return;
+            }
+            memmove(buffer, buffer + used, length - used);
+            length -= used;
+            if (!send_all(client_socket, reply, reply_length)) {
+                closesocket(client_socket);
+                return;
+            }
+            if (used == 0) {
+                break;
+            }
         }
     }
-
-    lock.unlock();
-    send(client_socket, response.c_str(), response.size(), 0);
     closesocket(client_socket);
 }
 
+// ݱ
+void serve_datagrams(SOCKET udp_socket) {
+    while (true) {
+        license_frame request, reply;
+        sockaddr_in client_addr{};
+        int addr_length = sizeof(client_addr);
+        int n = recvfrom(udp_socket, (char*)&request, FRAME_SIZE, 0, (struct sockaddr*)&client_addr, &addr_length);
+        if (n == SOCKET_ERROR && WSAGetLastError() == WSAEMSGSIZE) {
+            n = FRAME_SIZE; // ֡ݱض
+        }
+        if (n == SOCKET_ERROR || !valid_datagram(request, n)) {
+            continue;
+        }
+        handle_heartbeats(&request, &reply, 1);
+        if (!(request.type & FRAME_NO_REPLY)) {
+            sendto(udp_socket, (const char*)&reply, FRAME_SIZE, 0, (struct sockaddr*)&client_addr, addr_length);
+        }
+    }
+}
+
 int main() {
     initialize_winsock();
 
@@ -117,9 +335,19 @@ int main() {
         return 1;
     }
 
+    SOCKET udp_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (udp_socket == INVALID_SOCKET || bind(udp_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
+        std::cerr << "UDP bind failed!" << std::endl;
+        closesocket(server_socket);
+        WSACleanup();
+        return 1;
+    }
+
     std::cout << "License server is running on port " << PORT << std::endl;
 
+    wheel_init(EXPIRY_PRECISION_MS);
     std::thread(monitor_heartbeats).detach();
+    std::thread(serve_datagrams, udp_socket).detach();
 
     while (true) {
         SOCKET client_socket = accept(server_socket, nullptr, nullptr);
@@ -134,3 +362,303 @@ int main() {
     WSACleanup();
     return 0;
 }
+#else
+// һӵ״̬Ӧûʱͣµ
+// ÿ reactor Ӱʱ䴮ʱֻͷ
+struct connection {
+    int fd;
+    bool closing; // Ӧر
+    bool writing; // ڵȴд
+    size_t length; // Ѷ롢δ󳤶
+    size_t reply_length; // ͵Ӧ𳤶
+    size_t sent; // ѷ͵Ӧ𳤶
+    std::chrono::steady_clock::time_point active; // һյݵʱ
+    connection* prev;
+    connection* next;
+    char request[REQUEST_SIZE];
+    char reply[REPLY_SIZE];
+};
+
+// epoll ¼ data.ptr ָӣָ listen_fdudp_fd ʾ׽
+struct reactor {
+    int epoll_fd;
+    int listen_fd;
+    int udp_fd;
+    connection idle; // ʱĻıͷ
+};
+
+// ÿ reactor һ׽ֺһ UDP ׽֣SO_REUSEPORT ں˰Ӻݱָ reactor
+int open_socket(int type) {
+    int fd = socket(AF_INET, type | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(PORT);
+
+    if (bind(fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0 ||
+        (type == SOCK_STREAM && listen(fd, SOMAXCONN) < 0)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void unlink_connection(connection* conn) {
+    conn->prev->next = conn->next;
+    conn->next->prev = conn->prev;
+}
+
+// Ƶβλ
+void touch_connection(reactor* r, connection* conn, std::chrono::steady_clock::time_point now) {
+    unlink_connection(conn);
+    conn->prev = r->idle.prev;
+    conn->next = &r->idle;
+    r->idle.prev->next = conn;
+    r->idle.prev = conn;
+    conn->active = now;
+}
+
+void close_connection(connection* conn) {
+    unlink_connection(conn);
+    close(conn->fd); // رպԶ epoll Ƴ
+    delete conn;
+}
+
+// Ŷӵ
+void accept_connections(reactor* r, std::chrono::steady_clock::time_point now) {
+    while (true) {
+        int fd = accept4(r->listen_fd, nullptr, nullptr, SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                std::cerr << "Accept failed!" << std::endl;
+            }
+            return;
+        }
+        connection* conn = new connection();
+        conn->fd = fd;
+        conn->prev = conn->next = conn;
+        touch_connection(r, conn, now);
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.ptr = conn;
+        if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            close_connection(conn);
+        }
+    }
+}
+
+// ֡֡ȲϷʱеӦر
+void process_requests(connection* conn) {
+    long used = handle_frames(conn->request, conn->length, conn->reply, &conn->reply_length, sizeof(conn->reply));
+    if (used < 0) {
+        conn->closing = true;
+        return;
+    }
+    memmove(conn->request, conn->request + used, conn->length - used);
+    conn->length -= used;
+}
+
+// 󣬷 false ʾѶϿ
+bool read_requests(connection* conn) {
+    ssize_t n = recv(conn->fd, conn->request + conn->length, sizeof(conn->request) - conn->length, 0);
+    if (n < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    if (n == 0) {
+        return false;
+    }
+    conn->length += n;
+    process_requests(conn);
+    return true;
+}
+
+// Ӧ𣬷 false ʾ
+bool write_replies(connection* conn) {
+    while (conn->sent < conn->reply_length) {
+        ssize_t n = send(conn->fd, conn->reply + conn->sent, conn->reply_length - conn->sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        conn->sent += n;
+    }
+    conn->reply_length = conn->sent = 0;
+    return true;
+}
+
+// һϵ¼ false ʾӦر
+bool serve_connection(reactor* r, connection* conn, uint32_t events, std::chrono::steady_clock::time_point now) {
+    if ((events & EPOLLIN) && !conn->closing) {
+        if (!read_requests(conn)) {
+            return false;
+        }
+        touch_connection(r, conn, now);
+    }
+    while (true) {
+        if (!write_replies(conn)) {
+            return false;
+        }
+        if (conn->reply_length > 0 || conn->closing) {
+            break;
+        }
+        size_t length = conn->length;
+        process_requests(conn); // Ӧ𻺳ʱµ
+        if (conn->length == length) {
+            break;
+        }
+    }
+    if (conn->closing && conn->reply_length == 0) {
+        return false;
+    }
+    bool writing = conn->reply_length > 0;
+    if (writing != conn->writing) {
+        epoll_event event{};
+        event.events = writing ? EPOLLOUT : EPOLLIN; // Ӧ֮ǰٶµ
+        event.data.ptr = conn;
+        epoll_ctl(r->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+        conn->writing = writing;
+    }
+    return true;
+}
+
+//  recvmmsg һݱһμ sendmmsg Ӧ𣻷յݱ
+int serve_datagrams(int udp_fd) {
+    license_frame requests[UDP_BATCH], replies[UDP_BATCH];
+    sockaddr_in addresses[UDP_BATCH];
+    iovec iovs[UDP_BATCH];
+    mmsghdr messages[UDP_BATCH];
+    memset(messages, 0, sizeof(messages));
+    for (int i = 0; i < UDP_BATCH; i++) {
+        iovs[i].iov_base = &requests[i];
+        iovs[i].iov_len = FRAME_SIZE;
+        messages[i].msg_hdr.msg_name = &addresses[i];
+        messages[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+        messages[i].msg_hdr.msg_iov = &iovs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    int count = recvmmsg(udp_fd, messages, UDP_BATCH, MSG_DONTWAIT, nullptr);
+    if (count <= 0) {
+        return 0;
+    }
+
+    int valid = 0; // ϷݱֱӶǰ
+    for (int i = 0; i < count; i++) {
+        if (valid_datagram(requests[i], messages[i].msg_len)) {
+            requests[valid] = requests[i];
+            addresses[valid] = addresses[i];
+            valid++;
+        }
+    }
+    handle_heartbeats(requests, replies, valid);
+
+    int replying = 0;
+    for (int i = 0; i < valid; i++) {
+        if (requests[i].type & FRAME_NO_REPLY) {
+            continue;
+        }
+        iovs[replying].iov_base = &replies[i];
+        messages[replying].msg_hdr.msg_name = &addresses[i];
+        messages[replying].msg_hdr.msg_namelen = sizeof(addresses[i]);
+        replying++;
+    }
+    if (replying > 0) {
+        sendmmsg(udp_fd, messages, replying, MSG_DONTWAIT);
+    }
+    return count;
+}
+
+// رտгʱĻỰ
+void expire_connections(reactor* r, std::chrono::steady_clock::time_point now) {
+    while (r->idle.next != &r->idle && now - r->idle.next->active > std::chrono::seconds(SESSION_TIMEOUT)) {
+        close_connection(r->idle.next);
+    }
+}
+
+// һ߳һ epoll ʵӶǷ
+void run_reactor(int listen_fd, int udp_fd) {
+    reactor r;
+    r.listen_fd = listen_fd;
+    r.udp_fd = udp_fd;
+    r.idle.prev = r.idle.next = &r.idle;
+    r.epoll_fd = epoll_create1(0);
+    if (r.epoll_fd < 0) {
+        std::cerr << "epoll_create1 failed!" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.ptr = &r.listen_fd;
+    epoll_ctl(r.epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+    event.data.ptr = &r.udp_fd;
+    epoll_ctl(r.epoll_fd, EPOLL_CTL_ADD, udp_fd, &event);
+
+    epoll_event events[MAX_EVENTS];
+    while (true) {
+        int count = epoll_wait(r.epoll_fd, events, MAX_EVENTS, 1000);
+        auto now = std::chrono::steady_clock::now();
+        for (int i = 0; i < count; i++) {
+            connection* conn = (connection*)events[i].data.ptr;
+            if (events[i].data.ptr == &r.listen_fd) {
+                accept_connections(&r, now);
+            }
+            else if (events[i].data.ptr == &r.udp_fd) {
+                for (int round = 0; round < UDP_ROUNDS && serve_datagrams(udp_fd) == UDP_BATCH; round++) {
+                }
+            }
+            else if (!serve_connection(&r, conn, events[i].events, now)) {
+                close_connection(conn);
+            }
+        }
+        expire_connections(&r, now);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    int reactors = argc > 1 ? atoi(argv[1]) : (int)std::thread::hardware_concurrency();
+    if (reactors <= 0) {
+        reactors = 1;
+    }
+    int precision = argc > 2 ? atoi(argv[2]) : EXPIRY_PRECISION_MS;
+    if (precision <= 0 || precision > HEARTBEAT_TIMEOUT * 1000) {
+        std::cerr << "Expiry precision must be 1-" << HEARTBEAT_TIMEOUT * 1000 << " ms" << std::endl;
+        return 1;
+    }
+
+    std::vector<std::pair<int, int>> sockets;
+    for (int i = 0; i < reactors; i++) {
+        int listen_fd = open_socket(SOCK_STREAM);
+        int udp_fd = open_socket(SOCK_DGRAM);
+        if (listen_fd < 0 || udp_fd < 0) {
+            std::cerr << "Bind failed!" << std::endl;
+            return 1;
+        }
+        sockets.emplace_back(listen_fd, udp_fd);
+    }
+
+    std::cout << "License server is running on port " << PORT << " with " << reactors << " reactors" << std::endl;
+
+    wheel_init(precision);
+    std::thread(monitor_heartbeats).detach();
+
+    std::vector<std::thread> threads;
+    for (auto& fds : sockets) {
+        threads.emplace_back(run_reactor, fds.first, fds.second);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,58 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <stdint.h>
+
+#define ACCESSLOG_MAGIC 0x474f4c41 //访问日志段文件标识 "ALOG"
+#define ACCESSLOG_VERSION 1
+#define ACCESSLOG_PHASES 8 //记录的连接阶段数，与代理的阶段表一致
+#define ACCESSLOG_SUFFIX ".alog" //日志段文件的扩展名
+
+enum accesslog_reason {
+	ACCESSLOG_CLOSED, //隧道正常结束
+	ACCESSLOG_HANDSHAKE, //握手未完成
+	ACCESSLOG_AUTH, //认证失败
+	ACCESSLOG_DENIED, //被访问控制规则拒绝
+	ACCESSLOG_UNREACHABLE, //无法连接目标
+	ACCESSLOG_QUOTA, //超出流量配额
+	ACCESSLOG_REASONS
+};
+
+enum accesslog_flag {
+	ACCESSLOG_TLS = 1,
+	ACCESSLOG_LZ4 = 2,
+	ACCESSLOG_SOCKMAP = 4,
+	ACCESSLOG_PARENT = 8 //经上级代理转发
+};
+
+// 日志段为这个头部加记录，按批追加、从不改写；崩溃可能在末尾留下不完整的记录，读取时忽略
+struct accesslog_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t phases;
+	uint64_t created_us;
+	uint8_t reserved[40];
+};
+
+// 一条隧道。start_us为accept时的墙上时间，phase_us[i]为从上一个到达的阶段到阶段i的时间，
+// 没有到达的阶段为0；client为IPv6或v4-mapped地址
+struct accesslog_record {
+	uint64_t start_us;
+	uint64_t duration_us;
+	uint64_t bytes_up;
+	uint64_t bytes_down;
+	uint32_t phase_us[ACCESSLOG_PHASES];
+	uint8_t client[16];
+	uint16_t client_port;
+	uint8_t version;
+	uint8_t reason;
+	uint32_t flags;
+	char user[40];
+	char dest[128];
+};
+
+_Static_assert(sizeof(struct accesslog_header) == 64, "accesslog header size");
+_Static_assert(sizeof(struct accesslog_record) == 256, "accesslog record size");
+
+#endif
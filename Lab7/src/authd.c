@@ -0,0 +1,224 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+
+// 外部凭据服务的替身，在Unix套接字上使用代理的校验协议：请求id(4) ulen user plen pass，
+// 应答id(4) 0x01 status（0x00成功，0xff失败）；每个请求由单独的线程在DELAY毫秒后应答，应答可以乱序
+
+char *socket_path = "/tmp/proxy_auth.sock";//监听的Unix套接字路径
+char *user_file;//"用户名:密码"文件，NULL时只接受user:pass
+int delay_ms = 0;//每个应答前等待的毫秒数
+char **users;
+int user_count = 0;
+
+struct client {
+	int fd;
+	int refs;
+	pthread_mutex_t lock;
+};
+
+struct request {
+	struct client *client;
+	unsigned char id[4];
+	char user[256];
+	char pass[256];
+};
+
+int readn(int fd, void *buf, int n)
+{
+	int nread, left = n;
+	while (left > 0) {
+		if ((nread = read(fd, buf, left)) == -1) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			return -1;
+		} else if (nread == 0) {
+			return 0;
+		}
+		left -= nread;
+		buf += nread;
+	}
+	return n;
+}
+
+int read_string(int fd, char *buf)
+{
+	unsigned char len;
+	if (readn(fd, &len, 1) != 1 || (len > 0 && readn(fd, buf, len) != len)) {
+		return -1;
+	}
+	buf[len] = '\0';
+	return 0;
+}
+
+int check(const char *user, const char *pass)
+{
+	if (user_count == 0) {
+		return strcmp(user, "user") == 0 && strcmp(pass, "pass") == 0;
+	}
+	for (int i = 0; i < user_count; i++) {
+		if (strcmp(users[2 * i], user) == 0) {
+			return strcmp(users[2 * i + 1], pass) == 0;
+		}
+	}
+	return 0;
+}
+
+void client_release(struct client *c)
+{
+	pthread_mutex_lock(&c->lock);
+	int last = --c->refs == 0;
+	pthread_mutex_unlock(&c->lock);
+	if (last) {
+		close(c->fd);
+		pthread_mutex_destroy(&c->lock);
+		free(c);
+	}
+}
+
+void *answer(void *arg)
+{
+	struct request *r = (struct request *)arg;
+	unsigned char reply[6];
+
+	if (delay_ms > 0) {
+		usleep(delay_ms * 1000);
+	}
+	memcpy(reply, r->id, 4);
+	reply[4] = 0x01;
+	reply[5] = check(r->user, r->pass) ? 0x00 : 0xff;
+	pthread_mutex_lock(&r->client->lock);
+	write(r->client->fd, reply, sizeof(reply));
+	pthread_mutex_unlock(&r->client->lock);
+	client_release(r->client);
+	free(r);
+	return NULL;
+}
+
+void *serve(void *arg)
+{
+	struct client *c = (struct client *)calloc(1, sizeof(struct client));
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	c->fd = (int)(intptr_t)arg;
+	c->refs = 1;
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	while (1) {
+		struct request *r = (struct request *)calloc(1, sizeof(struct request));
+		r->client = c;
+		if (readn(c->fd, r->id, 4) != 4 || read_string(c->fd, r->user) < 0
+		    || read_string(c->fd, r->pass) < 0) {
+			free(r);
+			break;
+		}
+		pthread_mutex_lock(&c->lock);
+		c->refs++;
+		pthread_mutex_unlock(&c->lock);
+		if (pthread_create(&thread, &attr, &answer, r) != 0) {
+			client_release(c);
+			free(r);
+		}
+	}
+	// 已接收的请求应答完毕后才关闭连接
+	client_release(c);
+	return NULL;
+}
+
+void load_users(const char *path)
+{
+	char line[520];
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		perror("fopen()");
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char *colon = strchr(line, ':');
+		if (colon == NULL) {
+			continue;
+		}
+		line[strcspn(line, "\r\n")] = '\0';
+		*colon = '\0';
+		users = realloc(users, sizeof(char *) * 2 * (user_count + 1));
+		users[2 * user_count] = strdup(line);
+		users[2 * user_count + 1] = strdup(colon + 1);
+		user_count++;
+	}
+	fclose(f);
+}
+
+void usage(char *app)
+{
+	printf("USAGE: %s [-h][-s SOCKET][-f USERFILE][-d DELAY_MS]\n", app);
+	printf("Answers proxy credential checks on a unix socket\n");
+	printf("By default: SOCKET is /tmp/proxy_auth.sock, only user:pass is valid, no delay\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_un addr;
+	pthread_t thread;
+	int ret, sock_fd;
+
+	signal(SIGPIPE, SIG_IGN);
+	while ((ret = getopt(argc, argv, "s:f:d:h")) != -1) {
+		switch (ret) {
+		case 's':{
+				socket_path = optarg;
+				break;
+			}
+		case 'f':{
+				user_file = optarg;
+				break;
+			}
+		case 'd':{
+				delay_ms = atoi(optarg);
+				break;
+			}
+		case 'h':
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (user_file != NULL) {
+		load_users(user_file);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+	unlink(socket_path);
+	sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+	    || listen(sock_fd, 16) < 0) {
+		perror("bind()");
+		return 1;
+	}
+	while (1) {
+		int fd = accept(sock_fd, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+		if (pthread_create(&thread, NULL, &serve, (void *)(intptr_t)fd) == 0) {
+			pthread_detach(thread);
+		} else {
+			close(fd);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,786 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include "accesslog.h"
+#include "workload.h"
+
+#define BUFSIZE 65536 // 数据缓冲区大小
+#define MAX_SAMPLES 1000000 //最多保存的延迟样本数
+#define SINK_SCRIPT 0xffffffffu //sink_header.rounds取此值时，后面跟着回放的收发轮次
+#define REFUSED_PORT 9 //回放连接失败的隧道时使用的本地端口，应无人监听
+
+char *proxy_host = "127.0.0.1";//被测代理地址
+char *proxy_port = "1080";//被测代理端口
+int concurrency = 8;//并发隧道数
+int tunnels = 200;//隧道总数
+uint32_t down_bytes = 1 << 20;//每条隧道下载的字节数
+uint32_t rounds = 0;//每条隧道的请求应答次数
+uint32_t msg_size = 64;//请求应答消息大小
+uint32_t write_size = BUFSIZE;//数据源每次写入的字节数
+int random_data = 0;//数据源发送随机（不可压缩）数据
+char *auth_user;//用户名，NULL为不认证
+char *auth_pass;//密码
+unsigned short int sink_port;//本地数据源端口，0为随机
+int tunnel_family = AF_INET;//隧道目标地址族
+unsigned char tunnel_addr[16];//隧道目标地址，默认为本地数据源
+unsigned short int tunnel_port;//隧道目标端口，0为本地数据源端口
+int tunnel_given = 0;//是否用-t指定了隧道目标
+char sink_data[BUFSIZE];
+char *replay_file;//回放的负载记录文件，NULL为合成负载
+double replay_speed = 1;//回放加速倍数
+struct workload_record *replay_records;
+int replay_count = 0;
+int replay_active = 0;//正在回放的隧道数
+int replay_skipped = 0;//无法回放的隧道数（BIND等）
+
+int next_tunnel = 0;
+int failed = 0;
+uint64_t total_bytes = 0;
+uint64_t *setup_samples;
+uint64_t *rr_samples;
+int setup_count = 0;
+int rr_count = 0;
+pthread_mutex_t lock;
+
+struct sink_header {
+	uint32_t down_bytes;
+	uint32_t rounds;
+	uint32_t msg_size;
+};
+
+uint64_t monotonic_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int readn(int fd, void *buf, int n)
+{
+	int nread, left = n;
+	while (left > 0) {
+		if ((nread = read(fd, buf, left)) == -1) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			return -1;
+		} else if (nread == 0) {
+			return 0;
+		}
+		left -= nread;
+		buf += nread;
+	}
+	return n;
+}
+
+int writen(int fd, void *buf, int n)
+{
+	int nwrite, left = n;
+	while (left > 0) {
+		if ((nwrite = write(fd, buf, left)) == -1) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			return -1;
+		}
+		left -= nwrite;
+		buf += nwrite;
+	}
+	return n;
+}
+
+void sleep_us(uint64_t us)
+{
+	struct timespec ts = { us / 1000000, us % 1000000 * 1000 };
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+	}
+}
+
+int drain(int fd, uint32_t n)
+{
+	char buf[BUFSIZE];
+	while (n > 0) {
+		int nread = readn(fd, buf, n < BUFSIZE ? n : BUFSIZE);
+		if (nread <= 0) {
+			return -1;
+		}
+		n -= nread;
+	}
+	return 0;
+}
+
+int fill(int fd, uint32_t n)
+{
+	while (n > 0) {
+		uint32_t chunk = n < write_size ? n : write_size;
+		if (writen(fd, sink_data, chunk) != chunk) {
+			return -1;
+		}
+		n -= chunk;
+	}
+	return 0;
+}
+
+// 按记录的轮次应答：读完客户端的每一轮，等待间隔后发出下行的每一轮
+void sink_script(int fd, uint32_t count)
+{
+	struct workload_turn turns[WORKLOAD_TURNS];
+	if (count > WORKLOAD_TURNS || readn(fd, turns, count * sizeof(turns[0]))
+	    != count * sizeof(turns[0])) {
+		return;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t bytes = ntohl(turns[i].bytes);
+		if (!(bytes & WORKLOAD_DOWN)) {
+			if (drain(fd, bytes) < 0) {
+				return;
+			}
+			continue;
+		}
+		sleep_us(ntohl(turns[i].gap_us) / replay_speed);
+		if (fill(fd, bytes & ~WORKLOAD_DOWN) < 0) {
+			return;
+		}
+	}
+}
+
+void *sink_process(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	struct sink_header h;
+	char msg[BUFSIZE];
+
+	int ok = readn(fd, &h, sizeof(h)) == sizeof(h);
+	if (ok && ntohl(h.rounds) == SINK_SCRIPT) {
+		sink_script(fd, ntohl(h.msg_size));
+	} else if (ok) {
+		uint32_t left = ntohl(h.down_bytes);
+		uint32_t size = ntohl(h.msg_size);
+		if (size > BUFSIZE) {
+			size = BUFSIZE;
+		}
+		while (left > 0) {
+			uint32_t n = left < write_size ? left : write_size;
+			if (writen(fd, sink_data, n) != n) {
+				break;
+			}
+			left -= n;
+		}
+		for (uint32_t i = 0; i < ntohl(h.rounds); i++) {
+			if (readn(fd, msg, size) != size || writen(fd, msg, size) != size) {
+				break;
+			}
+		}
+	}
+	close(fd);
+	return NULL;
+}
+
+void *sink_loop(void *arg)
+{
+	int sock_fd = (int)(intptr_t)arg;
+	pthread_t worker;
+	while (1) {
+		int fd = accept(sock_fd, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+		if (pthread_create(&worker, NULL, &sink_process,
+				   (void *)(intptr_t)fd) == 0) {
+			pthread_detach(worker);
+		} else {
+			close(fd);
+		}
+	}
+	return NULL;
+}
+
+void sink_start()
+{
+	// 双栈监听，IPv4和IPv6的隧道都能到达
+	int sock_fd = socket(AF_INET6, SOCK_STREAM, 0);
+	int one = 1, zero = 0;
+	struct sockaddr_in6 local;
+	socklen_t len = sizeof(local);
+	pthread_t thread;
+
+	memset(&local, 0, sizeof(local));
+	local.sin6_family = AF_INET6;
+	local.sin6_addr = in6addr_any;
+	local.sin6_port = htons(sink_port);
+	setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	setsockopt(sock_fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+	if (bind(sock_fd, (struct sockaddr *)&local, sizeof(local)) < 0
+	    || listen(sock_fd, 128) < 0
+	    || getsockname(sock_fd, (struct sockaddr *)&local, &len) < 0) {
+		perror("sink");
+		exit(1);
+	}
+	sink_port = ntohs(local.sin6_port);
+	pthread_create(&thread, NULL, &sink_loop, (void *)(intptr_t)sock_fd);
+	pthread_detach(thread);
+}
+
+int proxy_connect()
+{
+	struct addrinfo hints, *res, *r;
+	int fd = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(proxy_host, proxy_port, &hints, &res) != 0) {
+		return -1;
+	}
+	for (r = res; r != NULL; r = r->ai_next) {
+		fd = socket(r->ai_family, r->ai_socktype, r->ai_protocol);
+		if (fd == -1) {
+			continue;
+		}
+		if (connect(fd, r->ai_addr, r->ai_addrlen) == 0) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+int socks5_login(int fd)
+{
+	unsigned char msg[3 + 2 * 255];
+	size_t ulen = strlen(auth_user), plen = strlen(auth_pass);
+	int len = 0;
+
+	msg[len++] = 0x01;
+	msg[len++] = ulen;
+	memcpy(msg + len, auth_user, ulen);
+	len += ulen;
+	msg[len++] = plen;
+	memcpy(msg + len, auth_pass, plen);
+	len += plen;
+	if (writen(fd, msg, len) != len || readn(fd, msg, 2) != 2 || msg[1] != 0x00) {
+		return -1;
+	}
+	return 0;
+}
+
+int socks5_open()
+{
+	unsigned char greeting[3] = { 0x05, 0x01, auth_user ? 0x02 : 0x00 };
+	unsigned char request[22] = { 0x05, 0x01, 0x00, 0x01 };
+	unsigned char reply[22];
+	int addrlen = tunnel_family == AF_INET6 ? 16 : 4;
+	int len = 4 + addrlen + 2;
+	int one = 1;
+	int fd = proxy_connect();
+
+	if (fd < 0) {
+		return -1;
+	}
+	setsockopt(fd, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
+	request[3] = tunnel_family == AF_INET6 ? 0x04 : 0x01;
+	memcpy(request + 4, tunnel_addr, addrlen);
+	request[4 + addrlen] = tunnel_port >> 8;
+	request[5 + addrlen] = tunnel_port & 0xff;
+	if (writen(fd, greeting, sizeof(greeting)) != sizeof(greeting)
+	    || readn(fd, reply, 2) != 2 || reply[1] != greeting[2]
+	    || (auth_user != NULL && socks5_login(fd) < 0)
+	    || writen(fd, request, len) != len
+	    || readn(fd, reply, 4) != 4 || reply[1] != 0x00
+	    || (reply[3] != 0x01 && reply[3] != 0x04)
+	    || readn(fd, reply + 4, (reply[3] == 0x04 ? 16 : 4) + 2)
+	    != (reply[3] == 0x04 ? 16 : 4) + 2) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void sample_add(uint64_t *samples, int *count, uint64_t value)
+{
+	pthread_mutex_lock(&lock);
+	if (*count < MAX_SAMPLES) {
+		samples[(*count)++] = value;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+int run_tunnel()
+{
+	char buf[BUFSIZE];
+	struct sink_header h = { htonl(down_bytes), htonl(rounds), htonl(msg_size) };
+	uint64_t start = monotonic_ns();
+	int fd = socks5_open();
+	uint32_t left = down_bytes;
+
+	if (fd < 0) {
+		return -1;
+	}
+	sample_add(setup_samples, &setup_count, (monotonic_ns() - start) / 1000);
+	if (writen(fd, &h, sizeof(h)) != sizeof(h)) {
+		close(fd);
+		return -1;
+	}
+	while (left > 0) {
+		int n = read(fd, buf, left < BUFSIZE ? left : BUFSIZE);
+		if (n <= 0) {
+			close(fd);
+			return -1;
+		}
+		left -= n;
+	}
+	for (uint32_t i = 0; i < rounds; i++) {
+		uint64_t t = monotonic_ns();
+		if (writen(fd, buf, msg_size) != msg_size
+		    || readn(fd, buf, msg_size) != msg_size) {
+			close(fd);
+			return -1;
+		}
+		sample_add(rr_samples, &rr_count, (monotonic_ns() - t) / 1000);
+	}
+	close(fd);
+	__atomic_fetch_add(&total_bytes, down_bytes + 2ull * rounds * msg_size,
+			   __ATOMIC_RELAXED);
+	return 0;
+}
+
+void *client_loop(void *arg)
+{
+	while (__atomic_fetch_add(&next_tunnel, 1, __ATOMIC_RELAXED) < tunnels) {
+		if (run_tunnel() != 0) {
+			__atomic_fetch_add(&failed, 1, __ATOMIC_RELAXED);
+		}
+	}
+	return NULL;
+}
+
+// 按记录中客户端的方式建立隧道：socks版本、提供的认证方法数和地址类型相同，本次使用的方法放在最前；
+// 连接失败的记录请求一个拒绝连接的端口；只有问候的记录返回0
+int replay_open(const struct workload_record *w, int *fd)
+{
+	unsigned char msg[600];
+	unsigned char ours = auth_user ? 0x02 : 0x00;
+	int failing = w->reason == ACCESSLOG_DENIED || w->reason == ACCESSLOG_UNREACHABLE;
+	unsigned short int port = failing ? REFUSED_PORT : tunnel_port;
+	int family = tunnel_given ? tunnel_family : w->atyp == 0x04 ? AF_INET6 : AF_INET;
+	unsigned char addr[16] = { 0 };
+	char host[INET6_ADDRSTRLEN] = "localhost";
+	int len = 0, one = 1;
+
+	if (tunnel_given) {
+		memcpy(addr, tunnel_addr, sizeof(addr));
+		inet_ntop(tunnel_family, tunnel_addr, host, sizeof(host));
+	} else if (family == AF_INET6) {
+		addr[15] = 1;
+	} else {
+		inet_pton(AF_INET, "127.0.0.1", addr);
+	}
+	if ((*fd = proxy_connect()) < 0) {
+		return -1;
+	}
+	setsockopt(*fd, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	if (w->version == 0x04 && w->atyp == 0) {
+		return 0;
+	} else if (w->version == 0x04) {
+		msg[len++] = 0x04;
+		msg[len++] = 0x01;
+		msg[len++] = port >> 8;
+		msg[len++] = port & 0xff;
+		if (w->atyp == 0x03) {
+			memcpy(msg + len, "\0\0\0\1", 4);
+		} else {
+			memcpy(msg + len, addr, 4);
+		}
+		len += 4;
+		msg[len++] = '\0';
+		if (w->atyp == 0x03) {
+			memcpy(msg + len, host, strlen(host) + 1);
+			len += strlen(host) + 1;
+		}
+		if (writen(*fd, msg, len) != len || readn(*fd, msg, 8) != 8) {
+			return -1;
+		}
+		if (msg[1] != 0x5a) {
+			return failing ? 0 : -1;
+		}
+		return failing ? -1 : 1;
+	}
+
+	int count = w->method_count > 0 ? w->method_count : 1;
+	msg[len++] = 0x05;
+	msg[len++] = count;
+	msg[len++] = ours;
+	for (int i = 1; i < count; i++) {
+		// 压缩方法和本次使用的方法换成代理不支持的GSSAPI
+		unsigned char m = i < WORKLOAD_METHODS ? w->methods[i] : 0x01;
+		msg[len++] = (m & 0x80) || m == ours ? 0x01 : m;
+	}
+	if (writen(*fd, msg, len) != len || readn(*fd, msg, 2) != 2 || msg[1] != ours
+	    || (auth_user != NULL && socks5_login(*fd) < 0)) {
+		return -1;
+	}
+	if (w->atyp == 0) {
+		return 0;
+	}
+
+	len = 0;
+	msg[len++] = 0x05;
+	msg[len++] = 0x01;
+	msg[len++] = 0x00;
+	if (w->atyp == 0x03) {
+		msg[len++] = 0x03;
+		msg[len++] = strlen(host);
+		memcpy(msg + len, host, strlen(host));
+		len += strlen(host);
+	} else {
+		msg[len++] = family == AF_INET6 ? 0x04 : 0x01;
+		memcpy(msg + len, addr, family == AF_INET6 ? 16 : 4);
+		len += family == AF_INET6 ? 16 : 4;
+	}
+	msg[len++] = port >> 8;
+	msg[len++] = port & 0xff;
+	if (writen(*fd, msg, len) != len || readn(*fd, msg, 4) != 4) {
+		return -1;
+	}
+	if (msg[1] != 0x00) {
+		return failing ? 0 : -1;
+	}
+	int skip = msg[3] == 0x04 ? 16 : 4;
+	if (readn(*fd, msg, skip + 2) != skip + 2) {
+		return -1;
+	}
+	return failing ? -1 : 1;
+}
+
+// 上行轮次按记录的间隔发出；上行之后的下行轮次计一次应答延迟，扣除数据源模拟的等待
+int replay_tunnel(const struct workload_record *w)
+{
+	struct sink_header h = { 0, htonl(SINK_SCRIPT), htonl(w->turn_count) };
+	struct workload_turn turns[WORKLOAD_TURNS];
+	uint64_t start = monotonic_ns(), sent = 0, bytes = 0;
+	char c;
+	int fd;
+	int ret = replay_open(w, &fd);
+
+	if (ret <= 0) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return ret;
+	}
+	sample_add(setup_samples, &setup_count, (monotonic_ns() - start) / 1000);
+	for (int i = 0; i < w->turn_count; i++) {
+		turns[i].bytes = htonl(w->turns[i].bytes);
+		turns[i].gap_us = htonl(w->turns[i].gap_us);
+	}
+	int len = w->turn_count * sizeof(turns[0]);
+	if (writen(fd, &h, sizeof(h)) != sizeof(h) || writen(fd, turns, len) != len) {
+		close(fd);
+		return -1;
+	}
+	for (int i = 0; i < w->turn_count; i++) {
+		uint32_t n = w->turns[i].bytes & ~WORKLOAD_DOWN;
+		uint64_t gap = w->turns[i].gap_us / replay_speed;
+		if (!(w->turns[i].bytes & WORKLOAD_DOWN)) {
+			sleep_us(gap);
+			if (fill(fd, n) < 0) {
+				close(fd);
+				return -1;
+			}
+			sent = monotonic_ns();
+		} else {
+			if (n > 0 && (readn(fd, &c, 1) != 1 || drain(fd, n - 1) < 0)) {
+				close(fd);
+				return -1;
+			}
+			if (sent != 0) {
+				uint64_t rr = (monotonic_ns() - sent) / 1000;
+				sample_add(rr_samples, &rr_count, rr > gap ? rr - gap : 0);
+				sent = 0;
+			}
+		}
+		bytes += n;
+	}
+	close(fd);
+	__atomic_fetch_add(&total_bytes, bytes, __ATOMIC_RELAXED);
+	return 0;
+}
+
+void *replay_thread(void *arg)
+{
+	if (replay_tunnel((const struct workload_record *)arg) < 0) {
+		__atomic_fetch_add(&failed, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_fetch_sub(&replay_active, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+int compare_start(const void *a, const void *b)
+{
+	const struct workload_record *x = a, *y = b;
+	return (x->start_us > y->start_us) - (x->start_us < y->start_us);
+}
+
+void replay_load(const char *path)
+{
+	struct workload_header h;
+	struct workload_record w;
+	int cap = 0;
+	FILE *f = fopen(path, "r");
+
+	if (f == NULL) {
+		perror(path);
+		exit(1);
+	}
+	if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != WORKLOAD_MAGIC
+	    || h.version != WORKLOAD_VERSION || h.record_size != sizeof(w)) {
+		fprintf(stderr, "%s is not a workload recording of this version\n", path);
+		exit(1);
+	}
+	while (fread(&w, sizeof(w), 1, f) == 1) {
+		if (w.command != 0 && w.command != 0x01) {
+			replay_skipped++;
+			continue;
+		}
+		if (w.turn_count > WORKLOAD_TURNS) {
+			w.turn_count = WORKLOAD_TURNS;
+		}
+		if (replay_count == cap) {
+			cap = cap ? cap * 2 : 1024;
+			replay_records = realloc(replay_records, cap * sizeof(w));
+		}
+		replay_records[replay_count++] = w;
+	}
+	fclose(f);
+	qsort(replay_records, replay_count, sizeof(w), compare_start);
+	for (int i = replay_count - 1; i >= 0; i--) {
+		replay_records[i].start_us -= replay_records[0].start_us;
+	}
+}
+
+// 开环回放：每条隧道按记录中的开始时间启动，不等前面的隧道结束
+void replay_run()
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	uint64_t start = monotonic_ns();
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (int i = 0; i < replay_count; i++) {
+		uint64_t due = start + replay_records[i].start_us * 1000 / replay_speed;
+		uint64_t now = monotonic_ns();
+		if (due > now) {
+			sleep_us((due - now) / 1000);
+		}
+		__atomic_fetch_add(&replay_active, 1, __ATOMIC_RELAXED);
+		if (pthread_create(&thread, &attr, &replay_thread, &replay_records[i]) != 0) {
+			__atomic_fetch_sub(&replay_active, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&failed, 1, __ATOMIC_RELAXED);
+		}
+	}
+	while (__atomic_load_n(&replay_active, __ATOMIC_ACQUIRE) > 0) {
+		sleep_us(10000);
+	}
+}
+
+int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+uint64_t percentile(uint64_t *samples, int count, double p)
+{
+	if (count == 0) {
+		return 0;
+	}
+	int i = (int)(count * p / 100.0);
+	return samples[i < count ? i : count - 1];
+}
+
+void usage(char *app)
+{
+	printf
+	    ("USAGE: %s [-h][-x HOST:PORT][-c CONCURRENCY][-n TUNNELS][-s BYTES][-r ROUNDS][-m MSGSIZE][-R]\n"
+	     "\t[-u USER:PASS][-w WRITESIZE][-k SINKPORT][-t HOST:PORT][-P FILE][-A SPEED]\n",
+	     app);
+	printf("Opens TUNNELS socks5 tunnels through the proxy to a local sink,\n");
+	printf("downloads BYTES over each, then does ROUNDS request/response exchanges\n");
+	printf("-R sends random instead of highly compressible data\n");
+	printf("-w sets how many bytes the sink writes at a time (default %d)\n", BUFSIZE);
+	printf("-k fixes the sink port, -t opens the tunnels to HOST:PORT instead of the\n");
+	printf("sink, e.g. a proxyshim in front of it; HOST is an IPv4 address or [IPv6]\n");
+	printf("-P replays a workload recorded with proxy --record, starting each tunnel at\n");
+	printf("its recorded time divided by SPEED, instead of -c/-n/-s/-r/-m\n");
+	printf("By default: proxy is 127.0.0.1:1080, 8 x 200 tunnels of 1MB, no rounds\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	pthread_mutex_init(&lock, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	while ((ret = getopt(argc, argv, "x:c:n:s:r:m:Ru:w:k:t:P:A:h")) != -1) {
+		switch (ret) {
+		case 'x':{
+				char *colon = strrchr(optarg, ':');
+				if (colon == NULL) {
+					usage(argv[0]);
+				}
+				*colon = '\0';
+				proxy_host = optarg;
+				proxy_port = colon + 1;
+				if (proxy_host[0] == '[') {
+					proxy_host++;
+					proxy_host[strlen(proxy_host) - 1] = '\0';
+				}
+				break;
+			}
+		case 'c':{
+				concurrency = atoi(optarg);
+				break;
+			}
+		case 'n':{
+				tunnels = atoi(optarg);
+				break;
+			}
+		case 's':{
+				down_bytes = strtoul(optarg, NULL, 10);
+				break;
+			}
+		case 'r':{
+				rounds = strtoul(optarg, NULL, 10);
+				break;
+			}
+		case 'm':{
+				msg_size = strtoul(optarg, NULL, 10);
+				if (msg_size == 0 || msg_size > BUFSIZE) {
+					usage(argv[0]);
+				}
+				break;
+			}
+		case 'u':{
+				char *colon = strchr(optarg, ':');
+				if (colon == NULL) {
+					usage(argv[0]);
+				}
+				*colon = '\0';
+				auth_user = optarg;
+				auth_pass = colon + 1;
+				break;
+			}
+		case 'w':{
+				write_size = strtoul(optarg, NULL, 10);
+				if (write_size == 0 || write_size > BUFSIZE) {
+					usage(argv[0]);
+				}
+				break;
+			}
+		case 'k':{
+				sink_port = atoi(optarg);
+				break;
+			}
+		case 't':{
+				char *colon = strrchr(optarg, ':');
+				if (colon == NULL) {
+					usage(argv[0]);
+				}
+				*colon = '\0';
+				if (optarg[0] == '[' && colon[-1] == ']') {
+					optarg++;
+					colon[-1] = '\0';
+					tunnel_family = AF_INET6;
+				}
+				if (inet_pton(tunnel_family, optarg, tunnel_addr) != 1) {
+					usage(argv[0]);
+				}
+				tunnel_port = atoi(colon + 1);
+				tunnel_given = 1;
+				break;
+			}
+		case 'R':{
+				random_data = 1;
+				break;
+			}
+		case 'P':{
+				replay_file = optarg;
+				break;
+			}
+		case 'A':{
+				replay_speed = atof(optarg);
+				if (replay_speed <= 0) {
+					usage(argv[0]);
+				}
+				break;
+			}
+		case 'h':
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (concurrency <= 0 || tunnels <= 0) {
+		usage(argv[0]);
+	}
+
+	setup_samples = (uint64_t *)malloc(sizeof(uint64_t) * MAX_SAMPLES);
+	rr_samples = (uint64_t *)malloc(sizeof(uint64_t) * MAX_SAMPLES);
+	memset(sink_data, 'x', sizeof(sink_data));
+	if (random_data) {
+		srand(time(NULL));
+		for (int i = 0; i < BUFSIZE; i++) {
+			sink_data[i] = rand();
+		}
+	}
+	sink_start();
+	if (tunnel_port == 0) {
+		inet_pton(AF_INET, "127.0.0.1", tunnel_addr);
+		tunnel_port = sink_port;
+	}
+
+	uint64_t start = monotonic_ns();
+	if (replay_file != NULL) {
+		replay_load(replay_file);
+		start = monotonic_ns();
+		replay_run();
+		tunnels = replay_count;
+		printf("replayed %d skipped %d speed %.1fx\n", replay_count, replay_skipped,
+		       replay_speed);
+	} else {
+		pthread_t *clients = (pthread_t *)malloc(sizeof(pthread_t) * concurrency);
+		for (int i = 0; i < concurrency; i++) {
+			pthread_create(&clients[i], NULL, &client_loop, NULL);
+		}
+		for (int i = 0; i < concurrency; i++) {
+			pthread_join(clients[i], NULL);
+		}
+	}
+	double elapsed = (monotonic_ns() - start) / 1e9;
+
+	qsort(setup_samples, setup_count, sizeof(uint64_t), compare_u64);
+	qsort(rr_samples, rr_count, sizeof(uint64_t), compare_u64);
+	printf("tunnels %d failed %d elapsed_s %.3f throughput_MBps %.1f "
+	       "setup_p50_us %lu setup_p99_us %lu rr_p50_us %lu rr_p99_us %lu\n",
+	       tunnels, failed, elapsed, total_bytes / elapsed / 1e6,
+	       percentile(setup_samples, setup_count, 50.0),
+	       percentile(setup_samples, setup_count, 99.0),
+	       percentile(rr_samples, rr_count, 50.0),
+	       percentile(rr_samples, rr_count, 99.0));
+	return failed != 0;
+}
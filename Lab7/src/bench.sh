@@ -0,0 +1,271 @@
+HOST=127.0.0.1
+PORT=11080
+METRICS=19090
+PARENT_PORT=11081
+SHIM_PORT=12100
+SINK_PORT=12101
+AUTH_SOCKET=/tmp/proxybench_auth.sock
+SERVER_NAME="proxy"
+BENCH_NAME="proxybench"
+OUTLOG=bench_log.txt
+PID=0
+CPUS="0-$(($(nproc) - 1))"
+
+start_server() {
+	"./${SERVER_NAME}" -n $PORT --metrics-port $METRICS "$@" &>>$OUTLOG &
+	PID=$!
+	sleep 0.5
+}
+
+stop_server() {
+	kill -9 $PID
+	wait $PID 2>/dev/null || true
+}
+
+start_parent() {
+	"./${SERVER_NAME}" -n $PARENT_PORT "$@" &>>$OUTLOG &
+	PARENT_PID=$!
+	sleep 0.5
+}
+
+stop_parent() {
+	kill -9 $PARENT_PID
+	wait $PARENT_PID 2>/dev/null || true
+}
+
+start_shim() {
+	./proxyshim -l $SHIM_PORT -t $HOST:$SINK_PORT "$@" &>>$OUTLOG &
+	SHIM_PID=$!
+	sleep 0.2
+}
+
+stop_shim() {
+	kill -9 $SHIM_PID
+	wait $SHIM_PID 2>/dev/null || true
+}
+
+metrics() {
+	exec 3<>/dev/tcp/$HOST/$METRICS
+	cat <&3
+	exec 3<&-
+}
+
+run_bench() {
+	echo "== $1"
+	shift
+	"./${BENCH_NAME}" -x $HOST:$PORT "$@"
+}
+
+bench_default() {
+	start_server
+	run_bench "bulk, unpinned" -c 8 -n 200 -s 1048576
+	run_bench "request/response, unpinned" -c 8 -n 200 -s 0 -r 100
+	stop_server
+}
+
+bench_numa() {
+	start_server --numa-stats
+	run_bench "bulk, unpinned, numa stats" -c 8 -n 200 -s 1048576
+	metrics | grep numa
+	stop_server
+
+	start_server --numa-stats --cpus $CPUS --incoming-cpu
+	run_bench "bulk, pinned to $CPUS, numa stats" -c 8 -n 200 -s 1048576
+	metrics | grep numa
+	stop_server
+}
+
+bench_sockmap() {
+	start_server --sockmap
+	run_bench "bulk, sockmap" -c 8 -n 200 -s 1048576
+	run_bench "request/response, sockmap" -c 8 -n 200 -s 0 -r 100
+	stop_server
+}
+
+bench_profiles() {
+	for profile in default interactive bulk; do
+		start_server --client-profile $profile --upstream-profile $profile
+		run_bench "bulk, $profile profile" -c 8 -n 200 -s 1048576
+		run_bench "request/response, $profile profile" -c 8 -n 200 -s 0 -r 100
+		stop_server
+	done
+}
+
+bench_compress() {
+	start_parent
+	start_server --parent $HOST:$PARENT_PORT
+	run_bench "bulk, chained, plain" -c 8 -n 200 -s 1048576
+	stop_server
+	stop_parent
+
+	start_parent --compress
+	start_server --parent $HOST:$PARENT_PORT --compress
+	run_bench "bulk, chained, lz4, text" -c 8 -n 200 -s 1048576
+	run_bench "bulk, chained, lz4, random" -c 8 -n 200 -s 1048576 -R
+	metrics | grep lz4
+	stop_server
+	stop_parent
+}
+
+bench_auth() {
+	./proxyauthd -s $AUTH_SOCKET -d 20 &>>$OUTLOG &
+	AUTH_PID=$!
+	sleep 0.2
+	start_server -a 2 --auth-backend unix:$AUTH_SOCKET --auth-ttl 0 --auth-negative-ttl 0
+	run_bench "handshakes, 20ms verifier, no cache" -c 8 -n 200 -s 0 -u user:pass
+	stop_server
+	start_server -a 2 --auth-backend unix:$AUTH_SOCKET
+	run_bench "handshakes, 20ms verifier, ttl cache" -c 8 -n 200 -s 0 -u user:pass
+	metrics | grep -A1 "# auth"
+	stop_server
+	kill -9 $AUTH_PID
+	wait $AUTH_PID 2>/dev/null || true
+}
+
+bench_admission() {
+	start_server --max-conns-per-ip 4 --conn-rate 100 --conn-burst 50
+	run_bench "bulk, 8 clients from one address, 4 admitted" -c 8 -n 200 -s 1048576
+	run_bench "request/response, 100 new/s admitted" -c 1 -n 200 -s 0 -r 10
+	metrics | grep -A1 "# admission"
+	stop_server
+}
+
+# 每种写入大小下比较普通发送和固定开启的MSG_ZEROCOPY，报告从哪个大小起零拷贝一直占优
+bench_zerocopy() {
+	crossover=none
+	for size in 4096 8192 16384 32768 65536; do
+		start_server
+		copy=$(run_bench "bulk, ${size}B writes, copy" -c 8 -n 200 -s 1048576 -w $size \
+			| tee /dev/stderr | sed -n 's/.*throughput_MBps \([0-9.]*\).*/\1/p')
+		stop_server
+		start_server --zerocopy 1 --zerocopy-fixed
+		zc=$(run_bench "bulk, ${size}B writes, zerocopy" -c 8 -n 200 -s 1048576 -w $size \
+			| tee /dev/stderr | sed -n 's/.*throughput_MBps \([0-9.]*\).*/\1/p')
+		metrics | grep -A1 "# zerocopy"
+		stop_server
+		if ! awk "BEGIN { exit !($zc > $copy) }"; then
+			crossover=none
+		elif [ $crossover = none ]; then
+			crossover=$size
+		fi
+	done
+	echo "zerocopy crossover: $crossover"
+}
+
+# 代理与数据源之间经过proxyshim，模拟50ms往返、1%丢包、1%乱序、每条连接10MB/s的链路
+bench_wan() {
+	start_shim -d 25 -j 5 -b 10m -L 1 -o 1
+	for relay in "" "--sockmap" "--upstream-profile bulk"; do
+		start_server $relay
+		run_bench "bulk over wan, ${relay:-default}" -c 8 -n 32 -s 1048576 \
+			-k $SINK_PORT -t $HOST:$SHIM_PORT
+		run_bench "request/response over wan, ${relay:-default}" -c 8 -n 32 -s 0 -r 20 \
+			-k $SINK_PORT -t $HOST:$SHIM_PORT
+		stop_server
+	done
+	stop_shim
+}
+
+# 客户端到代理、代理到数据源两段分别走IPv4或IPv6
+bench_ipv6() {
+	start_server
+	for path in "127.0.0.1 127.0.0.1" "[::1] [::1]" "127.0.0.1 [::1]"; do
+		set -- $path
+		"./${BENCH_NAME}" -x $1:$PORT -c 8 -n 200 -s 1048576 \
+			-k $SINK_PORT -t $2:$SINK_PORT | sed "s/^/bulk, $1 -> $2: /"
+		"./${BENCH_NAME}" -x $1:$PORT -c 8 -n 200 -s 0 -r 100 \
+			-k $SINK_PORT -t $2:$SINK_PORT | sed "s/^/request\/response, $1 -> $2: /"
+	done
+	stop_server
+}
+
+# 压测期间每10ms重新加载一次配置，握手延迟应与不重新加载时相同
+bench_reload() {
+	CONFIG=/tmp/proxybench.conf
+	printf 'allow 127.0.0.0/8\nmax-conns-per-ip 1000\n' > $CONFIG
+	start_server --config $CONFIG
+	run_bench "handshakes, no reload" -c 8 -n 2000 -s 0 -r 1
+	(while kill -HUP $PID 2>/dev/null; do sleep 0.01; done) &
+	RELOAD_PID=$!
+	run_bench "handshakes, reload every 10ms" -c 8 -n 2000 -s 0 -r 1
+	kill $RELOAD_PID
+	wait $RELOAD_PID 2>/dev/null || true
+	metrics | grep -A1 "# config"
+	stop_server
+	rm -f $CONFIG
+}
+
+# 全部经上级代理与按路由直连的对比，直连应省去一跳的延迟和带宽
+bench_route() {
+	start_parent
+	start_server --parent $HOST:$PARENT_PORT
+	run_bench "bulk, all through parent" -c 8 -n 200 -s 1048576
+	stop_server
+	start_server --parent $HOST:$PARENT_PORT --route direct:$HOST,profile=bulk
+	run_bench "bulk, routed direct" -c 8 -n 200 -s 1048576
+	metrics | grep -A1 "# route"
+	stop_server
+	stop_parent
+}
+
+# 回放录制的负载；未设置WORKLOAD时先录下一段批量和请求应答混合的负载
+bench_replay() {
+	RECORDING=${WORKLOAD:-/tmp/proxybench.rec}
+	if [ -z "$WORKLOAD" ]; then
+		start_server --record $RECORDING
+		run_bench "recording, bulk" -c 4 -n 100 -s 262144 >/dev/null
+		run_bench "recording, request/response" -c 4 -n 100 -s 0 -r 20 >/dev/null
+		stop_server
+	fi
+	start_server
+	for speed in 1 4; do
+		run_bench "replay at ${speed}x" -P $RECORDING -A $speed
+	done
+	stop_server
+	[ -n "$WORKLOAD" ] || rm -f $RECORDING
+}
+
+# 开启访问日志后的握手延迟，以及proxylog聚合全部记录的速度
+bench_accesslog() {
+	ALOG=/tmp/proxybench_alog
+	rm -rf $ALOG
+	start_server --access-log $ALOG
+	run_bench "handshakes, access log" -c 8 -n 20000 -s 0 -r 1
+	sleep 1.5
+	metrics | grep -A1 "# accesslog"
+	stop_server
+	./proxylog -v -g reason $ALOG
+	rm -rf $ALOG
+}
+
+# 经proxyshim的长距离大流量和请求应答隧道，比较固定64KB缓冲区与按带宽时延积调整
+bench_relay() {
+	start_shim -d 25 -b 10m
+	for relay in "" "--relay-budget 64m" "--relay-budget 1m"; do
+		start_server $relay
+		run_bench "bulk over wan, ${relay:-fixed buffers}" -c 8 -n 16 -s 8388608 \
+			-k $SINK_PORT -t $HOST:$SHIM_PORT
+		run_bench "request/response over wan, ${relay:-fixed buffers}" -c 8 -n 32 -s 0 -r 20 \
+			-k $SINK_PORT -t $HOST:$SHIM_PORT
+		[ -z "$relay" ] || metrics | grep -A1 "# relay"
+		stop_server
+	done
+	stop_shim
+}
+
+rm -f $OUTLOG
+bench_default
+bench_numa
+bench_sockmap
+bench_profiles
+bench_compress
+bench_auth
+bench_admission
+bench_zerocopy
+bench_wan
+bench_ipv6
+bench_reload
+bench_route
+bench_replay
+bench_accesslog
+bench_relay
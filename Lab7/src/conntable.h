@@ -0,0 +1,66 @@
+#ifndef CONNTABLE_H
+#define CONNTABLE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define CONNTABLE_MAGIC 0x534f434b //共享内存段标识 "SOCK"
+#define CONNTABLE_VERSION 2
+#define CONNTABLE_SLOTS 4096 //连接表可容纳的连接数
+#define CONNTABLE_NAME "/socks_proxy" //默认共享内存段名称
+
+// 每个槽位只由拥有连接的线程写。seq为奇数表示正在更新，读者复制槽位后发现seq变了就重试，双方都不加锁
+struct conntable_slot {
+	uint32_t seq;
+	uint32_t in_use;
+	uint64_t start_ns;
+	uint64_t bytes_up;
+	uint64_t bytes_down;
+	char client[56];
+	char dest[262];
+	char user[64];
+} __attribute__((aligned(64)));
+
+struct conntable {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t pid;
+	uint64_t started_ns;
+	uint64_t total_conns;
+	uint64_t active_conns;
+	uint64_t failed_conns;
+	uint64_t bytes_up;
+	uint64_t bytes_down;
+	struct conntable_slot slot[CONNTABLE_SLOTS];
+};
+
+static inline void conntable_write_begin(struct conntable_slot *s)
+{
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void conntable_write_end(struct conntable_slot *s)
+{
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline int conntable_read(const struct conntable_slot *s,
+				 struct conntable_slot *copy)
+{
+	for (int tries = 0; tries < 100; tries++) {
+		uint32_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			continue;
+		}
+		memcpy(copy, (const void *)s, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq) {
+			return copy->in_use;
+		}
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef LEDGER_H
+#define LEDGER_H
+
+#include <stdint.h>
+
+#define LEDGER_MAGIC 0x4c444752 //流量账本文件标识 "LDGR"
+#define LEDGER_VERSION 1
+#define LEDGER_SLOTS 262144 //账本可记录的（用户，日期）条目数
+#define LEDGER_PROBES 64 //一个键最多探测的相邻槽位数
+#define LEDGER_USER_SIZE 64 //用户名最大长度，包括结尾的0
+
+enum ledger_state {
+	LEDGER_EMPTY,
+	LEDGER_CLAIMED,
+	LEDGER_READY,
+	LEDGER_STALE //崩溃时没写完的槽位，探测时跳过，可以复用
+};
+
+// 一个用户在一个UTC日（自纪元起的天数）的流量。槽位从EMPTY（或已过期的READY、STALE）改为CLAIMED占用，
+// 填好后发布为READY，之后只有字节计数器以原子加法变化；读者跳过不是READY的槽位
+struct ledger_entry {
+	uint32_t state;
+	uint32_t day;
+	char user[LEDGER_USER_SIZE];
+	uint64_t bytes_up;
+	uint64_t bytes_down;
+} __attribute__((aligned(32)));
+
+struct ledger {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t entry_size;
+	struct ledger_entry entry[LEDGER_SLOTS];
+};
+
+#endif
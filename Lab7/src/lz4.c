@@ -0,0 +1,168 @@
+#include <stdint.h>
+#include <string.h>
+#include "lz4.h"
+
+#define HASH_BITS 12 //匹配查找表的位数
+#define MIN_MATCH 4 //最短匹配长度
+#define LAST_LITERALS 5 //块末尾必须是字面量的字节数
+#define MF_LIMIT 12 //最后一个匹配必须在块末尾这么多字节之前开始
+
+static uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint8_t *write_length(uint8_t *op, int len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+static int read_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+	unsigned int b;
+	do {
+		if (*ip >= iend) {
+			return -1;
+		}
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+	return 0;
+}
+
+int lz4_compress_block(const char *src, int n, char *dst, int cap)
+{
+	uint32_t table[1 << HASH_BITS];
+	const uint8_t *base = (const uint8_t *)src;
+	const uint8_t *ip = base, *anchor = base, *end = base + n;
+	const uint8_t *mflimit = end - MF_LIMIT, *matchlimit = end - LAST_LITERALS;
+	uint8_t *op = (uint8_t *)dst, *oend = op + cap;
+	int lit;
+
+	if (n > LZ4_MAX_BLOCK) {
+		return 0;
+	}
+	memset(table, 0, sizeof(table));
+	while (n > MF_LIMIT && ip < mflimit) {
+		uint32_t seq = read32(ip);
+		uint32_t h = (seq * 2654435761u) >> (32 - HASH_BITS);
+		const uint8_t *ref = base + table[h];
+		table[h] = ip - base;
+		if (ref >= ip || read32(ref) != seq) {
+			// 长时间找不到匹配时加大步长，不可压缩的数据很快扫完
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+		while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+		const uint8_t *mp = ip + MIN_MATCH, *rp = ref + MIN_MATCH;
+		// 每次比较8字节，小端序下最低的不同位所在字节即第一个不同的字节
+		while (mp + 8 <= matchlimit) {
+			uint64_t a, b;
+			memcpy(&a, mp, sizeof(a));
+			memcpy(&b, rp, sizeof(b));
+			if (a != b) {
+				int same = __builtin_ctzll(a ^ b) >> 3;
+				mp += same;
+				rp += same;
+				break;
+			}
+			mp += 8;
+			rp += 8;
+		}
+		while (mp < matchlimit && *mp == *rp) {
+			mp++;
+			rp++;
+		}
+
+		int mlen = mp - ip - MIN_MATCH;
+		lit = ip - anchor;
+		if (op + 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1 > oend) {
+			return 0;
+		}
+		uint8_t *token = op++;
+		*token = (lit >= 15 ? 15 : lit) << 4;
+		if (lit >= 15) {
+			op = write_length(op, lit - 15);
+		}
+		memcpy(op, anchor, lit);
+		op += lit;
+		*op++ = (ip - ref) & 0xff;
+		*op++ = (ip - ref) >> 8;
+		*token |= mlen >= 15 ? 15 : mlen;
+		if (mlen >= 15) {
+			op = write_length(op, mlen - 15);
+		}
+		ip = anchor = mp;
+	}
+
+	lit = end - anchor;
+	if (op + 1 + lit / 255 + 1 + lit > oend) {
+		return 0;
+	}
+	*op++ = (lit >= 15 ? 15 : lit) << 4;
+	if (lit >= 15) {
+		op = write_length(op, lit - 15);
+	}
+	memcpy(op, anchor, lit);
+	op += lit;
+	return op - (uint8_t *)dst;
+}
+
+int lz4_decompress_block(const char *src, int n, char *dst, int cap)
+{
+	const uint8_t *ip = (const uint8_t *)src, *iend = ip + n;
+	uint8_t *op = (uint8_t *)dst, *oend = op + cap;
+
+	while (ip < iend) {
+		unsigned int token = *ip++;
+		size_t lit = token >> 4;
+		if (lit == 15 && read_length(&ip, iend, &lit) < 0) {
+			return -1;
+		}
+		if ((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit) {
+			return -1;
+		}
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		if (ip == iend) {
+			break;
+		}
+
+		if (iend - ip < 2) {
+			return -1;
+		}
+		size_t offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst)) {
+			return -1;
+		}
+		size_t mlen = token & 15;
+		if (mlen == 15 && read_length(&ip, iend, &mlen) < 0) {
+			return -1;
+		}
+		mlen += MIN_MATCH;
+		if ((size_t)(oend - op) < mlen) {
+			return -1;
+		}
+		// 匹配与输出重叠时数据以offset为周期重复，从同一起点复制，每次可复制的长度翻倍
+		const uint8_t *match = op - offset;
+		while (mlen > 0) {
+			size_t chunk = op - match < mlen ? (size_t)(op - match) : mlen;
+			memcpy(op, match, chunk);
+			op += chunk;
+			mlen -= chunk;
+		}
+	}
+	return op - (uint8_t *)dst;
+}
@@ -0,0 +1,14 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+// LZ4块格式（没有帧头），可以用LZ4_decompress_safe解压；块不超过64KB，匹配偏移才能放进16位
+
+#define LZ4_MAX_BLOCK 65536
+
+// 返回压缩后的长度，结果超过cap时返回0
+int lz4_compress_block(const char *src, int n, char *dst, int cap);
+
+// 返回解压后的长度，数据损坏或超过cap时返回-1
+int lz4_decompress_block(const char *src, int n, char *dst, int cap);
+
+#endif
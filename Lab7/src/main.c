@@ -8,28 +8,187 @@
 #include <signal.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/un.h>
+#include <sys/random.h>
+#include <sys/file.h>
+#include <sched.h>
+#include <dirent.h>
+#include <poll.h>
 #include <netdb.h>
 #include <sys/select.h>
 #include <arpa/inet.h>
-#include <netinet/tcp.h>
+#include <linux/tcp.h>
 #include <pthread.h>
+#include <getopt.h>
+#include <linux/bpf.h>
+#include <linux/sockios.h>
+#include <linux/errqueue.h>
+#include "conntable.h"
+#include "ledger.h"
+#include "accesslog.h"
+#include "workload.h"
+#include "lz4.h"
+#ifdef WITH_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
 
 #define BUFSIZE 65536 // 数据缓冲区大小
 #define IPSIZE 4 //ip地址字符串的长度
+#define IP6SIZE 16 //IPv6地址的长度
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0])) //获取数组的元素数量
 #define ARRAY_INIT    {0} //初始化数组为0
+#define HIST_SUB_BITS 7 //直方图每个数量级的子桶位数，约1%精度
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_HALF_COUNT (HIST_SUB_COUNT / 2)
+#define HIST_MAX_BITS 40 //直方图可记录的最大值（微秒）的位数
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 2) * HIST_HALF_COUNT)
+#define MAX_NODES 64 //支持的NUMA节点数量上限
+#define SOCKMAP_SIZE 65536 //sockmap中可容纳的套接字数量
+#define DEST_SIZE 262 //"域名:端口"字符串的最大长度
+#define MAX_PROFILES 16 //最多可定义的套接字配置数量
+#define TLS_RECORD_SIZE 16384 //TLS记录的最大明文长度
+#define TLS_HANDSHAKE_TIMEOUT 10 //TLS握手超时（秒）
+#define ZIP_BLOCK (BUFSIZE - 4) //压缩链路上每帧最多携带的明文字节数
+#define ZIP_MIN 64 //短于此长度的数据块不压缩
+#define ZIP_SAMPLE 4096 //估计熵时采样的字节数
+#define ZIP_COMPRESSED 0x80000000u //帧头中表示数据已压缩的位
+#define AUTH_CACHE_WAYS 4 //每个键在校验缓存中可占用的相邻槽位数
+#define AUTH_REPLY_SIZE 6 //校验服务应答：4字节编号、版本、状态
+#define AUTH_PENDING -2 //校验请求尚未应答
+#define ADMISSION_PROBES 16 //来源地址表中一个键最多探测的槽位数
+#define ZC_MAX_INFLIGHT 16 //每个方向最多等待内核释放的零拷贝缓冲区数
+#define ZC_DRAIN_MS 200 //隧道结束时等待零拷贝完成通知的毫秒数
+#define ZC_PROBE_EVERY 64 //零拷贝被自动暂停后，每隔多少条隧道重新尝试一次
+#define PROFILE_BUILTIN 3 //内置套接字配置的数量
+#define ACCESSLOG_BATCH 4096 //访问日志一批最多的记录数（1MB）
+#define RELAY_MIN_BUF 4096 //自适应中继缓冲区和套接字缓冲区的下限
+#define RELAY_MAX_BUF (1 << 20) //自适应中继缓冲区的上限
+#define RELAY_MAX_SOCKBUF (4 << 20) //自适应设置的套接字缓冲区上限
+#define RELAY_TUNE_NS 100000000ull //自适应中继重新估算带宽时延积的间隔
+#define SHORT_OPTIONS "n:u:p:l:a:hd" //getopt短选项，重新加载时再次解析
+#define BPF_INSN(c, d, s, o, i) \
+	((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), \
+			    .off = (o), .imm = (i) })
 
 unsigned short int port = 1080;//默认SOCKS代理监听端口
 int daemon_mode = 0; //是否开启进程守护模式
-int auth_type;//SOCKS5认证类型
-char *arg_username;//认证用的用户名
-char *arg_password;//认证用的密码
 FILE *log_file;//日志文件指针
 pthread_mutex_t lock;//全局日志锁，用于线程同步
+unsigned short int metrics_port = 0;//统计信息端口，0为关闭
+FILE *trace_file;//连接跟踪文件指针
+pthread_mutex_t trace_lock;//跟踪文件锁
+unsigned int trace_sample = 1;//每N个连接采样一个
+unsigned int trace_counter = 0;//采样计数
+cpu_set_t worker_cpus;//工作线程可以绑定的CPU集合
+int worker_cpu_list[CPU_SETSIZE];//按顺序排列的可用CPU编号
+int worker_cpu_count = 0;//可用CPU数量，0为不绑定
+unsigned int worker_cpu_next = 0;//轮询分配的下一个CPU
+int incoming_cpu = 0;//按SO_INCOMING_CPU把连接交给网卡队列所在CPU
+int numa_stats = 0;//统计跨NUMA节点的转发流量
+char *shm_name;//共享内存连接表名称，NULL为关闭
+struct conntable *conn_table;//共享内存中的连接表
+int conntable_free[CONNTABLE_SLOTS];//空闲槽位栈
+int conntable_free_count = 0;
+pthread_mutex_t conntable_lock;//空闲槽位锁
+int sockmap_enabled = 0;//是否在内核中用sockmap转发已建立的隧道
+int sockmap_peer_fd = -1;//以套接字cookie为键，值为对端套接字
+int sockmap_attach_fd = -1;//加入此表的套接字由verdict程序接管
+int breaker_failures = 0;//连续失败多少次后熔断目标，0为关闭
+int breaker_cooldown = 10;//熔断后多少秒允许一次探测
+int breaker_size = 1024;//最多记录的失败目标数量
+uint64_t breaker_fast_failed = 0;//熔断直接拒绝的请求数
+char *tls_cert;//TLS证书链文件，NULL为不加密
+char *tls_key;//TLS私钥文件
+uint64_t tls_ktls = 0;//加解密交给内核的TLS连接数
+uint64_t tls_bridged = 0;//由用户态线程加解密的TLS连接数
+uint64_t tls_failed = 0;//握手失败的TLS连接数
+#ifdef WITH_TLS
+SSL_CTX *tls_ctx;//监听端口的TLS上下文
+#endif
+uint64_t zip_tunnels = 0;//使用压缩的隧道数
+uint64_t zip_raw = 0;//压缩链路上的明文字节数
+uint64_t zip_wire = 0;//压缩链路上实际传输的字节数
+uint64_t zip_blocks = 0;//压缩链路上的帧数
+uint64_t zip_bypassed = 0;//因熵过高而未压缩的帧数
+uint64_t zip_cpu_ns = 0;//压缩解压消耗的CPU时间
+char *auth_backend_arg;//校验后端参数：用户文件或校验服务的Unix套接字路径
+int auth_ttl = 60;//校验成功结果的缓存秒数，0为不缓存
+int auth_negative_ttl = 5;//校验失败结果的缓存秒数
+int auth_timeout_ms = 2000;//等待校验服务应答的毫秒数
+unsigned int auth_cache_size = 4096;//校验结果缓存的槽位数
+uint64_t auth_cache_hits = 0;//命中缓存的校验次数
+uint64_t auth_cache_misses = 0;//询问后端的校验次数
+uint64_t auth_backend_errors = 0;//校验服务不可用或超时的次数
+unsigned int admission_size = 16384;//来源地址表的槽位数
+uint64_t admission_rejected_conns = 0;//因并发数超限被拒绝的连接数
+uint64_t admission_rejected_rate = 0;//因速率超限被拒绝的连接数
+uint64_t admission_untracked = 0;//地址表探测范围已满、未受限制放行的连接数
+int zerocopy = 0;//不小于此长度的数据块用MSG_ZEROCOPY发送，0为关闭
+int zerocopy_fixed = 0;//不根据完成通知调整零拷贝阈值
+int zc_threshold;//根据完成通知学到的零拷贝阈值，超过BUFSIZE为暂停使用
+unsigned int zc_probe = 0;//暂停期间新隧道的计数，用于定期重新尝试
+uint64_t zc_sends = 0;//零拷贝发送次数
+uint64_t zc_bytes = 0;//零拷贝发送的字节数
+uint64_t zc_completions = 0;//内核释放的零拷贝发送次数
+uint64_t zc_copied = 0;//内核仍然复制了数据的零拷贝发送次数
+uint64_t zc_disabled = 0;//因零拷贝无收益而改为普通发送的方向数
+long long relay_budget = 0;//自适应中继可占用的内存总量，0为关闭、固定使用BUFSIZE
+uint64_t relay_used = 0;//各隧道已占用的中继缓冲区和套接字缓冲区
+uint64_t relay_grown = 0;//隧道扩大缓冲区的次数
+uint64_t relay_shrunk = 0;//隧道缩小缓冲区的次数
+uint64_t relay_capped = 0;//因预算不足未能扩大的次数
+char *quota_file;//流量账本文件路径，NULL为关闭
+struct ledger *ledger;//按用户和日期记录流量的账本文件映射
+int quota_keep = 90;//账本条目保留的天数，过期后槽位可被复用
+uint64_t quota_closed = 0;//因超出配额被拒绝或断开的隧道数
+uint64_t quota_throttled = 0;//因超出配额被限速的隧道数
+uint64_t ledger_full = 0;//账本探测范围已满、未能记账的次数
+pthread_mutex_t ledger_lock;
+int bind_port_first = 0;//BIND监听端口池的范围，0为每次临时绑定
+int bind_port_last = 0;
+int bind_timeout = 120;//BIND等待对端连入的秒数
+int *bind_pool;//预先绑定并监听的套接字
+int bind_pool_count = 0;
+pthread_mutex_t bind_lock;
+uint64_t bind_requests = 0;//BIND请求数
+uint64_t bind_accepted = 0;//对端成功连入的BIND请求数
+uint64_t bind_timeouts = 0;//等待对端超时的BIND请求数
+uint64_t bind_exhausted = 0;//端口池用尽被拒绝的BIND请求数
+int config_argc;//重新加载时重放的命令行参数
+char **config_argv;
+int config_files = 0;//命令行中--config的个数，为0时不处理SIGHUP
+struct config *config_current;//当前生效的配置快照
+struct config *config_retired;//已被替换、仍有连接在用的旧快照
+uint32_t config_entering = 0;//正在取得快照、尚未登记为读者的线程数
+uint64_t config_generation = 1;//当前快照的代数，每次重新加载加一
+uint64_t config_reload_failed = 0;//因配置有误被拒绝的重新加载次数
+uint64_t acl_denied = 0;//被访问控制规则拒绝的请求数
+uint64_t route_taken[3];//按路由动作（直连、上级代理、拒绝）统计的请求数
+char *accesslog_dir;//二进制访问日志目录，NULL为关闭
+long long accesslog_segment = 64 << 20;//日志段达到此大小后换新文件
+int accesslog_keep = 0;//保留的日志段数，0为全部保留
+struct accesslog_record *accesslog_batch[2];//工作线程填写一个，写入线程写出另一个
+int accesslog_active = 0;//正在填写的批次
+int accesslog_fill = 0;//正在填写的批次中的记录数
+pthread_mutex_t accesslog_lock;
+pthread_cond_t accesslog_cond;//批次过半时唤醒写入线程
+uint64_t accesslog_records = 0;//写入的记录数
+uint64_t accesslog_dropped = 0;//写入线程跟不上、被丢弃的记录数
+uint64_t accesslog_segments = 0;//打开过的日志段数
+FILE *record_file;//采样记录握手和流量形态的负载文件，供proxybench回放
+pthread_mutex_t record_lock;//负载文件锁
+unsigned int record_sample = 1;//每N个连接记录一个
+unsigned int record_counter = 0;//采样计数
+uint64_t record_start_ns;//开始记录的时间，记录中的时间都相对于它
 
 enum socks {
 	RESERVED = 0x00,
@@ -40,7 +199,8 @@ enum socks {
 enum socks_auth_methods {
 	NOAUTH = 0x00,
 	USERPASS = 0x02,
-	NOMETHOD = 0xff
+	NOMETHOD = 0xff,
+	LZ4_METHOD = 0x80 //私有方法位，与认证方法组合表示隧道使用LZ4分帧压缩
 };
 
 enum socks_auth_userpass {
@@ -50,19 +210,267 @@ enum socks_auth_userpass {
 };
 
 enum socks_command {
-	CONNECT = 0x01
+	CONNECT = 0x01,
+	BIND = 0x02
 };
 
 enum socks_command_type {
 	IP = 0x01,
-	DOMAIN = 0x03
+	DOMAIN = 0x03,
+	IPV6 = 0x04
 };
 
 enum socks_status {
 	OK = 0x00,
-	FAILED = 0x05
+	GENERAL_FAILURE = 0x01,
+	NOT_ALLOWED = 0x02,
+	FAILED = 0x05,
+	TTL_EXPIRED = 0x06,
+	COMMAND_NOT_SUPPORTED = 0x07
 };
 
+enum conn_phase {
+	PHASE_ACCEPT,
+	PHASE_START,
+	PHASE_GREETING,
+	PHASE_AUTH,
+	PHASE_REQUEST,
+	PHASE_RESOLVED,
+	PHASE_CONNECTED,
+	PHASE_FIRST_BYTE,
+	PHASE_COUNT
+};
+
+_Static_assert(PHASE_COUNT == ACCESSLOG_PHASES, "access log phases");
+
+const char *phase_names[PHASE_COUNT] = {
+	"accept", "schedule", "greeting", "auth", "request", "dns", "connect",
+	"first_byte"
+};
+
+struct histogram {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t total;
+	uint64_t sum;
+	uint64_t max;
+};
+
+struct conn {
+	int net_fd;
+	struct sockaddr_storage client;
+	int version;
+	int traced;
+	const struct sock_profile *upstream_profile;
+	struct workload_record *workload;
+	uint64_t workload_ns;
+	int last_phase;
+	uint64_t ts[PHASE_COUNT];
+	uint64_t bytes_up;
+	uint64_t bytes_down;
+	int sockmap;
+	int tls;
+	struct admission_entry *admission;
+	int inet_fd;
+	struct ledger_entry *ledger;
+	uint32_t ledger_day;
+	int over_quota;
+	struct config *config;
+	int reason;
+	int route;
+	int zip_net;
+	int zip_inet;
+	uint64_t zip_raw;
+	uint64_t zip_wire;
+	uint64_t zip_blocks;
+	uint64_t zip_bypassed;
+	uint64_t zip_cpu_ns;
+	uint64_t cookie[2];
+	struct conntable_slot *slot;
+	char dest[DEST_SIZE];
+	char user[64];
+};
+
+struct relay_buf {
+	struct relay_buf *next;
+	unsigned int node;
+	uint32_t zc_id;
+	char data[BUFSIZE] __attribute__((aligned(64)));
+};
+
+struct buf_pool {
+	pthread_mutex_t lock;
+	struct relay_buf *free;
+	uint64_t local_bytes;
+	uint64_t remote_bytes;
+};
+
+enum breaker_state {
+	BREAKER_CLOSED,
+	BREAKER_OPEN,
+	BREAKER_HALF_OPEN
+};
+
+struct breaker_entry {
+	struct breaker_entry *prev;
+	struct breaker_entry *next;
+	struct breaker_entry *hnext;
+	uint64_t hash;
+	uint64_t open_until;//OPEN时为冷却结束的时间，HALF_OPEN时为等待探测结果的期限
+	int failures;
+	int state;
+	char dest[DEST_SIZE];
+};
+
+struct breaker {
+	pthread_mutex_t lock;
+	struct breaker_entry **buckets;
+	struct breaker_entry *entries;
+	struct breaker_entry *free;
+	struct breaker_entry lru;
+	unsigned int mask;
+	int open;
+};
+
+struct sock_profile {
+	char name[32];
+	int nodelay;
+	int fastopen;
+	int keepalive;
+	int keepintvl;
+	int keepcnt;
+	int sndbuf;
+	int rcvbuf;
+	int notsent_lowat;
+	char congestion[16];
+};
+
+struct sock_profile profile_builtin[PROFILE_BUILTIN] = {
+	{.name = "default",.nodelay = 1},
+	{.name = "interactive",.nodelay = 1,.fastopen = 256,.keepalive = 60,
+	 .keepintvl = 10,.keepcnt = 6,.notsent_lowat = 16384},
+	{.name = "bulk",.nodelay = 1,.keepalive = 300,.sndbuf = 4 << 20,
+	 .rcvbuf = 4 << 20}
+};//内置的套接字配置
+
+enum acl_kind {
+	ACL_ALL,
+	ACL_CIDR,
+	ACL_DOMAIN
+};
+
+// IPv4网段以v4-mapped形式保存，前缀长度按128位计
+struct acl_rule {
+	int allow;
+	int kind;
+	int prefix;
+	uint8_t addr[16];
+	char domain[256];
+};
+
+enum route_action {
+	ROUTE_DIRECT,
+	ROUTE_PARENT,
+	ROUTE_REJECT
+};
+
+// match借用访问规则的结构，allow不用；port_max为0表示任意端口
+struct route {
+	struct acl_rule match;
+	int action;
+	unsigned short port_min;
+	unsigned short port_max;
+	char user[64];
+	char profile_name[32];
+	struct sock_profile *profile;
+};
+
+// 重新加载能改变的全部设置。快照建好后才发布且不再修改，
+// 连接使用开始时的快照直到隧道结束
+struct config {
+	uint32_t readers;
+	uint64_t generation;
+	struct config *next;
+	int auth_type;
+	char *username;
+	char *password;
+	struct acl_rule *acl;
+	int acl_count;
+	struct route *routes;
+	int route_count;
+	int route_networks;//网段规则的路由数
+	unsigned int max_conns_per_ip;
+	unsigned int conn_rate;
+	unsigned int conn_burst;
+	uint64_t quota_bytes;
+	int quota_throttle;
+	struct sock_profile profiles[MAX_PROFILES];
+	int profile_count;
+	char client_profile_name[32];
+	char upstream_profile_name[32];
+	struct sock_profile *client_profile;
+	struct sock_profile *upstream_profile;
+	struct addrinfo *parent_addr;
+	char *parent_user;
+	char *parent_pass;
+	int compress;
+	int prefer_ipv6;
+};
+
+struct auth_cache_entry {
+	uint64_t key;
+	uint64_t expires;
+	int status;
+};
+
+struct auth_request {
+	struct auth_request *next;
+	uint64_t key;
+	uint64_t deadline;
+	uint32_t id;
+	int status;
+	int waiters;
+	int sent;
+	pthread_cond_t cond;
+	int len;
+	unsigned char msg[4 + 2 + 2 * 255];
+};
+
+struct auth_backend {
+	const char *name;
+	int cacheable;
+	int (*init)(const char *arg);
+	int (*verify)(const char *user, const char *pass, uint64_t key);
+};
+
+// addr和tat只由accept线程写，工作线程只在隧道结束时减少active；
+// 没有隧道且速率额度已满的槽位已经过期，给下一个新地址复用
+struct admission_entry {
+	uint8_t addr[16];
+	uint32_t active;
+	uint32_t used;
+	uint64_t tat;
+};
+
+struct admission_entry *admission_table;//按来源地址限制并发数和新连接速率
+unsigned int admission_mask;
+uint64_t hash_key[2];//SipHash密钥，启动时随机生成
+struct auth_backend *auth_backend;//用户名密码校验后端
+struct auth_cache_entry *auth_cache;//以凭据的SipHash为键的校验结果缓存
+unsigned int auth_cache_mask;
+pthread_mutex_t auth_cache_lock;//缓存锁
+pthread_mutex_t auth_lock;//待应答请求列表锁
+pthread_condattr_t auth_condattr;//等待应答使用单调时钟
+struct auth_request *auth_pending;//尚未应答的校验请求
+uint32_t auth_next_id = 0;//下一个校验请求的编号
+int auth_wake[2];//唤醒校验分发线程的管道
+char **auth_users;//用户文件中的用户名和密码，交替存放
+int auth_user_count = 0;
+struct histogram phase_hist[PHASE_COUNT];//每个阶段的耗时直方图
+struct breaker breaker;//按目标地址记录连接失败的LRU表
+struct buf_pool buf_pools[MAX_NODES];//每个NUMA节点一个转发缓冲池
+__thread struct conn *current_conn;//当前线程处理的连接
+__thread struct config *config;//当前线程使用的配置快照
+
 void log_message(const char *message, ...)
 {
 	if (daemon_mode) {
@@ -94,315 +502,3661 @@ void log_message(const char *message, ...)
 	fflush(log_file);
 }
 
-int readn(int fd, void *buf, int n)
+uint64_t monotonic_ns()
 {
-	int nread, left = n;
-	while (left > 0) {
-		if ((nread = read(fd, buf, left)) == -1) {
-			if (errno == EINTR || errno == EAGAIN) {
-				continue;
-			}
-		} else {
-			if (nread == 0) {
-				return 0;
-			} else {
-				left -= nread;
-				buf += nread;
-			}
-		}
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int hist_index(uint64_t value)
+{
+	if (value >= (1ull << HIST_MAX_BITS)) {
+		value = (1ull << HIST_MAX_BITS) - 1;
 	}
-	return n;
+	if (value < HIST_SUB_COUNT) {
+		return (int)value;
+	}
+	int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS + 1;
+	return shift * HIST_HALF_COUNT + (int)(value >> shift);
 }
 
-int writen(int fd, void *buf, int n)
+uint64_t hist_value(int index)
 {
-	int nwrite, left = n;
-	while (left > 0) {
-		if ((nwrite = write(fd, buf, left)) == -1) {
-			if (errno == EINTR || errno == EAGAIN) {
-				continue;
-			}
-		} else {
-			if (nwrite == n) {
-				return 0;
-			} else {
-				left -= nwrite;
-				buf += nwrite;
-			}
-		}
+	if (index < HIST_SUB_COUNT) {
+		return index;
 	}
-	return n;
+	int shift = index / HIST_HALF_COUNT - 1;
+	return (uint64_t)(index - shift * HIST_HALF_COUNT) << shift;
 }
 
-void app_thread_exit(int ret, int fd)
+void hist_record(struct histogram *h, uint64_t value)
 {
-	close(fd);
-	pthread_exit((void *)&ret);
+	__atomic_fetch_add(&h->counts[hist_index(value)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->total, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	while (value > max
+	       && !__atomic_compare_exchange_n(&h->max, &max, value, 1,
+					       __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
 }
 
-int app_connect(int type, void *buf, unsigned short int portnum)
+uint64_t hist_percentile(uint64_t *counts, uint64_t total, double p)
 {
-	int fd;
-	struct sockaddr_in remote;
-	char address[16];
+	uint64_t rank = (uint64_t)(total * p / 100.0 + 0.5);
+	uint64_t seen = 0;
+	if (rank == 0) {
+		rank = 1;
+	}
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += counts[i];
+		if (seen >= rank) {
+			return hist_value(i);
+		}
+	}
+	return 0;
+}
 
-	memset(address, 0, ARRAY_SIZE(address));
+// 重新加载交换config_current后等config_entering归零，此后看到旧快照的线程
+// 都已计入它的readers，readers归零即可释放
+struct config *config_acquire()
+{
+	__atomic_fetch_add(&config_entering, 1, __ATOMIC_SEQ_CST);
+	struct config *cfg = __atomic_load_n(&config_current, __ATOMIC_SEQ_CST);
+	__atomic_fetch_add(&cfg->readers, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&config_entering, 1, __ATOMIC_RELEASE);
+	return cfg;
+}
 
-	if (type == IP) {
-		char *ip = (char *)buf;
-		snprintf(address, ARRAY_SIZE(address), "%hhu.%hhu.%hhu.%hhu",
-			 ip[0], ip[1], ip[2], ip[3]);
-		memset(&remote, 0, sizeof(remote));
-		remote.sin_family = AF_INET;
-		remote.sin_addr.s_addr = inet_addr(address);
-		remote.sin_port = htons(portnum);
+void config_release(struct config *cfg)
+{
+	if (cfg != NULL) {
+		__atomic_fetch_sub(&cfg->readers, 1, __ATOMIC_RELEASE);
+	}
+}
 
-		fd = socket(AF_INET, SOCK_STREAM, 0);
-		if (connect(fd, (struct sockaddr *)&remote, sizeof(remote)) < 0) {
-			log_message("connect() in app_connect");
-			close(fd);
-			return -1;
-		}
+void stats_dump(FILE *out)
+{
+	static uint64_t counts[HIST_BUCKETS];
+	static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+	struct config *cfg = config_acquire();
+	int zip = cfg->compress, acl = cfg->acl_count, routes = cfg->route_count;
+	config_release(cfg);
 
-		return fd;
-	} else if (type == DOMAIN) {
-		char portaddr[6];
-		struct addrinfo *res;
-		snprintf(portaddr, ARRAY_SIZE(portaddr), "%d", portnum);
-		log_message("getaddrinfo: %s %s", (char *)buf, portaddr);
-		int ret = getaddrinfo((char *)buf, portaddr, NULL, &res);
-		if (ret == EAI_NODATA) {
-			return -1;
-		} else if (ret == 0) {
-			struct addrinfo *r;
-			for (r = res; r != NULL; r = r->ai_next) {
-				fd = socket(r->ai_family, r->ai_socktype,
-					    r->ai_protocol);
-                if (fd == -1) {
-                    continue;
-                }
-				ret = connect(fd, r->ai_addr, r->ai_addrlen);
-				if (ret == 0) {
-					freeaddrinfo(res);
-					return fd;
-                } else {
-                    close(fd);
-                }
+	pthread_mutex_lock(&dump_lock);
+	fprintf(out, "# phase count mean_us p50_us p90_us p99_us p999_us max_us\n");
+	for (int i = PHASE_START; i < PHASE_COUNT; i++) {
+		struct histogram *h = &phase_hist[i];
+		uint64_t total = 0;
+		for (int j = 0; j < HIST_BUCKETS; j++) {
+			counts[j] = __atomic_load_n(&h->counts[j], __ATOMIC_RELAXED);
+			total += counts[j];
+		}
+		uint64_t sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+		fprintf(out, "%s %lu %lu %lu %lu %lu %lu %lu\n", phase_names[i],
+			total, total ? sum / total : 0,
+			hist_percentile(counts, total, 50.0),
+			hist_percentile(counts, total, 90.0),
+			hist_percentile(counts, total, 99.0),
+			hist_percentile(counts, total, 99.9),
+			__atomic_load_n(&h->max, __ATOMIC_RELAXED));
+	}
+	if (breaker_failures > 0) {
+		fprintf(out, "# breaker open_destinations fast_failed\n");
+		fprintf(out, "breaker %d %lu\n", __atomic_load_n(&breaker.open,
+								 __ATOMIC_RELAXED),
+			__atomic_load_n(&breaker_fast_failed, __ATOMIC_RELAXED));
+	}
+	if (config_files > 0 || acl > 0) {
+		fprintf(out, "# config generation reload_failed acl_denied\n");
+		fprintf(out, "config %lu %lu %lu\n",
+			__atomic_load_n(&config_generation, __ATOMIC_RELAXED),
+			__atomic_load_n(&config_reload_failed, __ATOMIC_RELAXED),
+			__atomic_load_n(&acl_denied, __ATOMIC_RELAXED));
+	}
+	if (routes > 0) {
+		fprintf(out, "# route rules direct parent rejected\n");
+		fprintf(out, "route %d %lu %lu %lu\n", routes,
+			__atomic_load_n(&route_taken[ROUTE_DIRECT], __ATOMIC_RELAXED),
+			__atomic_load_n(&route_taken[ROUTE_PARENT], __ATOMIC_RELAXED),
+			__atomic_load_n(&route_taken[ROUTE_REJECT], __ATOMIC_RELAXED));
+	}
+	if (accesslog_dir != NULL) {
+		fprintf(out, "# accesslog records dropped segments\n");
+		fprintf(out, "accesslog %lu %lu %lu\n",
+			__atomic_load_n(&accesslog_records, __ATOMIC_RELAXED),
+			__atomic_load_n(&accesslog_dropped, __ATOMIC_RELAXED),
+			__atomic_load_n(&accesslog_segments, __ATOMIC_RELAXED));
+	}
+	if (tls_cert != NULL) {
+		fprintf(out, "# tls ktls bridged failed\n");
+		fprintf(out, "tls %lu %lu %lu\n",
+			__atomic_load_n(&tls_ktls, __ATOMIC_RELAXED),
+			__atomic_load_n(&tls_bridged, __ATOMIC_RELAXED),
+			__atomic_load_n(&tls_failed, __ATOMIC_RELAXED));
+	}
+	if (auth_cache != NULL && auth_backend->cacheable) {
+		fprintf(out, "# auth cache_hits cache_misses backend_errors\n");
+		fprintf(out, "auth %lu %lu %lu\n",
+			__atomic_load_n(&auth_cache_hits, __ATOMIC_RELAXED),
+			__atomic_load_n(&auth_cache_misses, __ATOMIC_RELAXED),
+			__atomic_load_n(&auth_backend_errors, __ATOMIC_RELAXED));
+	}
+	if (bind_pool != NULL) {
+		fprintf(out, "# bind requests accepted timeouts exhausted free_ports\n");
+		fprintf(out, "bind %lu %lu %lu %lu %d\n",
+			__atomic_load_n(&bind_requests, __ATOMIC_RELAXED),
+			__atomic_load_n(&bind_accepted, __ATOMIC_RELAXED),
+			__atomic_load_n(&bind_timeouts, __ATOMIC_RELAXED),
+			__atomic_load_n(&bind_exhausted, __ATOMIC_RELAXED),
+			__atomic_load_n(&bind_pool_count, __ATOMIC_RELAXED));
+	}
+	if (ledger != NULL) {
+		fprintf(out, "# quota closed throttled ledger_full\n");
+		fprintf(out, "quota %lu %lu %lu\n",
+			__atomic_load_n(&quota_closed, __ATOMIC_RELAXED),
+			__atomic_load_n(&quota_throttled, __ATOMIC_RELAXED),
+			__atomic_load_n(&ledger_full, __ATOMIC_RELAXED));
+	}
+	if (zerocopy > 0) {
+		fprintf(out, "# zerocopy sends bytes completions copied disabled\n");
+		fprintf(out, "zerocopy %lu %lu %lu %lu %lu\n",
+			__atomic_load_n(&zc_sends, __ATOMIC_RELAXED),
+			__atomic_load_n(&zc_bytes, __ATOMIC_RELAXED),
+			__atomic_load_n(&zc_completions, __ATOMIC_RELAXED),
+			__atomic_load_n(&zc_copied, __ATOMIC_RELAXED),
+			__atomic_load_n(&zc_disabled, __ATOMIC_RELAXED));
+	}
+	if (relay_budget > 0) {
+		fprintf(out, "# relay budget used grown shrunk capped\n");
+		fprintf(out, "relay %lld %lu %lu %lu %lu\n", relay_budget,
+			__atomic_load_n(&relay_used, __ATOMIC_RELAXED),
+			__atomic_load_n(&relay_grown, __ATOMIC_RELAXED),
+			__atomic_load_n(&relay_shrunk, __ATOMIC_RELAXED),
+			__atomic_load_n(&relay_capped, __ATOMIC_RELAXED));
+	}
+	if (admission_table != NULL) {
+		fprintf(out, "# admission rejected_concurrent rejected_rate untracked\n");
+		fprintf(out, "admission %lu %lu %lu\n",
+			__atomic_load_n(&admission_rejected_conns, __ATOMIC_RELAXED),
+			__atomic_load_n(&admission_rejected_rate, __ATOMIC_RELAXED),
+			__atomic_load_n(&admission_untracked, __ATOMIC_RELAXED));
+	}
+	if (zip) {
+		uint64_t raw = __atomic_load_n(&zip_raw, __ATOMIC_RELAXED);
+		uint64_t wire = __atomic_load_n(&zip_wire, __ATOMIC_RELAXED);
+		fprintf(out, "# lz4 tunnels raw_bytes wire_bytes ratio blocks bypassed cpu_us\n");
+		fprintf(out, "lz4 %lu %lu %lu %.2f %lu %lu %lu\n",
+			__atomic_load_n(&zip_tunnels, __ATOMIC_RELAXED), raw, wire,
+			wire ? (double)raw / wire : 0.0,
+			__atomic_load_n(&zip_blocks, __ATOMIC_RELAXED),
+			__atomic_load_n(&zip_bypassed, __ATOMIC_RELAXED),
+			__atomic_load_n(&zip_cpu_ns, __ATOMIC_RELAXED) / 1000);
+	}
+	if (numa_stats) {
+		fprintf(out, "# numa node local_bytes remote_bytes\n");
+		for (int i = 0; i < MAX_NODES; i++) {
+			uint64_t local = __atomic_load_n(&buf_pools[i].local_bytes,
+							 __ATOMIC_RELAXED);
+			uint64_t remote = __atomic_load_n(&buf_pools[i].remote_bytes,
+							  __ATOMIC_RELAXED);
+			if (local != 0 || remote != 0) {
+				fprintf(out, "numa %d %lu %lu\n", i, local, remote);
 			}
 		}
-		freeaddrinfo(res);
-		return -1;
 	}
+	fflush(out);
+	pthread_mutex_unlock(&dump_lock);
+}
 
-    return -1;
+void trace_mark(int phase)
+{
+	struct conn *c = current_conn;
+	if (c == NULL || c->ts[phase] != 0) {
+		return;
+	}
+	uint64_t now = monotonic_ns();
+	c->ts[phase] = now;
+	hist_record(&phase_hist[phase], (now - c->ts[c->last_phase]) / 1000);
+	c->last_phase = phase;
 }
 
-int socks_invitation(int fd, int *version)
+// 双栈套接字上IPv4对端的地址是::ffff:a.b.c.d，还原成IPv4地址
+void sockaddr_unmap(struct sockaddr_storage *ss)
 {
-	char init[2];
-	int nread = readn(fd, (void *)init, ARRAY_SIZE(init));
-	if (nread == 2 && init[0] != VERSION5 && init[0] != VERSION4) {
-        log_message("They send us %hhX %hhX", init[0], init[1]);
-		log_message("Incompatible version!");
-		app_thread_exit(0, fd);
+	struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)ss;
+	if (ss->ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+		struct sockaddr_in in = { .sin_family = AF_INET, .sin_port = in6->sin6_port };
+		memcpy(&in.sin_addr, &in6->sin6_addr.s6_addr[12], IPSIZE);
+		memset(ss, 0, sizeof(*ss));
+		memcpy(ss, &in, sizeof(in));
 	}
-	log_message("Initial %hhX %hhX", init[0], init[1]);
-	*version = init[0];
-	return init[1];
 }
 
-char *socks5_auth_get_user(int fd)
+// "a.b.c.d:port"或"[v6]:port"
+void sockaddr_format(const struct sockaddr_storage *ss, char *buf, size_t size)
 {
-	unsigned char size;
-	readn(fd, (void *)&size, sizeof(size));
+	char ip[INET6_ADDRSTRLEN];
+	if (ss->ss_family == AF_INET6) {
+		const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)ss;
+		inet_ntop(AF_INET6, &in6->sin6_addr, ip, sizeof(ip));
+		snprintf(buf, size, "[%s]:%hu", ip, ntohs(in6->sin6_port));
+	} else {
+		const struct sockaddr_in *in = (const struct sockaddr_in *)ss;
+		inet_ntop(AF_INET, &in->sin_addr, ip, sizeof(ip));
+		snprintf(buf, size, "%s:%hu", ip, ntohs(in->sin_port));
+	}
+}
 
-	char *user = (char *)malloc(sizeof(char) * size + 1);
-	readn(fd, (void *)user, (int)size);
-	user[size] = 0;
+void trace_write(struct conn *c)
+{
+	char line[512];
+	char client[INET6_ADDRSTRLEN + 8];
+	int len;
 
-	return user;
+	sockaddr_format(&c->client, client, sizeof(client));
+	len = snprintf(line, sizeof(line), "%ld %s %s v%d", (long)time(NULL),
+		       client, c->dest[0] ? c->dest : "-", c->version);
+	uint64_t prev = c->ts[PHASE_ACCEPT];
+	for (int i = PHASE_START; i < PHASE_COUNT && len < sizeof(line); i++) {
+		if (c->ts[i] == 0) {
+			len += snprintf(line + len, sizeof(line) - len, " %s=-",
+					phase_names[i]);
+			continue;
+		}
+		len += snprintf(line + len, sizeof(line) - len, " %s=%lu",
+				phase_names[i], (c->ts[i] - prev) / 1000);
+		prev = c->ts[i];
+	}
+
+	pthread_mutex_lock(&trace_lock);
+	fprintf(trace_file, "%s\n", line);
+	fflush(trace_file);
+	pthread_mutex_unlock(&trace_lock);
 }
 
-char *socks5_auth_get_pass(int fd)
+void accesslog_write(struct conn *c)
 {
-	unsigned char size;
-	readn(fd, (void *)&size, sizeof(size));
+	struct accesslog_record r;
+	struct timespec ts;
+	uint64_t now = monotonic_ns();
 
-	char *pass = (char *)malloc(sizeof(char) * size + 1);
-	readn(fd, (void *)pass, (int)size);
-	pass[size] = 0;
+	memset(&r, 0, sizeof(r));
+	clock_gettime(CLOCK_REALTIME, &ts);
+	r.duration_us = (now - c->ts[PHASE_ACCEPT]) / 1000;
+	r.start_us = ts.tv_sec * 1000000ull + ts.tv_nsec / 1000 - r.duration_us;
+	r.bytes_up = c->bytes_up;
+	r.bytes_down = c->bytes_down;
+	uint64_t prev = c->ts[PHASE_ACCEPT];
+	for (int i = PHASE_START; i < PHASE_COUNT; i++) {
+		if (c->ts[i] != 0) {
+			r.phase_us[i] = (c->ts[i] - prev) / 1000;
+			prev = c->ts[i];
+		}
+	}
+	if (c->client.ss_family == AF_INET6) {
+		const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)&c->client;
+		memcpy(r.client, &in6->sin6_addr, IP6SIZE);
+		r.client_port = ntohs(in6->sin6_port);
+	} else {
+		const struct sockaddr_in *in = (const struct sockaddr_in *)&c->client;
+		r.client[10] = r.client[11] = 0xff;
+		memcpy(r.client + 12, &in->sin_addr, IPSIZE);
+		r.client_port = ntohs(in->sin_port);
+	}
+	r.version = c->version;
+	r.reason = c->reason;
+	r.flags = (c->tls ? ACCESSLOG_TLS : 0) | (c->zip_net || c->zip_inet ? ACCESSLOG_LZ4 : 0)
+	    | (c->sockmap ? ACCESSLOG_SOCKMAP : 0) | (c->route == ROUTE_PARENT ? ACCESSLOG_PARENT : 0);
+	memcpy(r.user, c->user, strnlen(c->user, sizeof(r.user) - 1));
+	memcpy(r.dest, c->dest, strnlen(c->dest, sizeof(r.dest) - 1));
 
-	return pass;
+	pthread_mutex_lock(&accesslog_lock);
+	if (accesslog_fill == ACCESSLOG_BATCH) {
+		pthread_mutex_unlock(&accesslog_lock);
+		__atomic_fetch_add(&accesslog_dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	accesslog_batch[accesslog_active][accesslog_fill++] = r;
+	if (accesslog_fill == ACCESSLOG_BATCH / 2) {
+		pthread_cond_signal(&accesslog_cond);
+	}
+	pthread_mutex_unlock(&accesslog_lock);
 }
 
-int socks5_auth_userpass(int fd)
+uint64_t siphash(const uint64_t key[2], const unsigned char *data, size_t len);
+
+// 匿名化的名字：带密钥的哈希，0留给没有名字的情况
+uint32_t workload_id(const void *data, size_t len)
 {
-	char answer[2] = { VERSION5, USERPASS };
-	writen(fd, (void *)answer, ARRAY_SIZE(answer));
-	char resp;
-	readn(fd, (void *)&resp, sizeof(resp));
-	log_message("auth %hhX", resp);
-	char *username = socks5_auth_get_user(fd);
-	char *password = socks5_auth_get_pass(fd);
-	log_message("l: %s p: %s", username, password);
-	if (strcmp(arg_username, username) == 0
-	    && strcmp(arg_password, password) == 0) {
-		char answer[2] = { AUTH_VERSION, AUTH_OK };
-		writen(fd, (void *)answer, ARRAY_SIZE(answer));
-		free(username);
-		free(password);
-		return 0;
+	uint32_t id = siphash(hash_key, (const unsigned char *)data, len);
+	return id != 0 ? id : 1;
+}
+
+void workload_account(struct conn *c, int up, size_t n)
+{
+	struct workload_record *w = c->workload;
+	uint32_t dir = up ? 0 : WORKLOAD_DOWN;
+	uint64_t now = monotonic_ns();
+	struct workload_turn *t = w->turn_count > 0 ? &w->turns[w->turn_count - 1] : NULL;
+
+	if (t == NULL || (t->bytes & WORKLOAD_DOWN) != dir) {
+		if (w->turn_count == WORKLOAD_TURNS) {
+			// 轮次方向交替，倒数第二个与本次方向相同
+			t = &w->turns[WORKLOAD_TURNS - 2];
+			w->truncated = 1;
+		} else {
+			uint64_t last = c->workload_ns ? c->workload_ns : c->ts[PHASE_CONNECTED];
+			t = &w->turns[w->turn_count++];
+			t->bytes = dir;
+			t->gap_us = last != 0 && now > last ? (now - last) / 1000 : 0;
+		}
+	}
+	if ((t->bytes & ~WORKLOAD_DOWN) + n < WORKLOAD_DOWN) {
+		t->bytes += n;
 	} else {
-		char answer[2] = { AUTH_VERSION, AUTH_FAIL };
-		writen(fd, (void *)answer, ARRAY_SIZE(answer));
-		free(username);
-		free(password);
-		return 1;
+		t->bytes = dir | (WORKLOAD_DOWN - 1);
 	}
+	c->workload_ns = now;
 }
 
-int socks5_auth_noauth(int fd)
+void workload_request(struct conn *c, int type, const void *buf, unsigned short int portnum)
 {
-	char answer[2] = { VERSION5, NOAUTH };
-	writen(fd, (void *)answer, ARRAY_SIZE(answer));
-	return 0;
+	struct workload_record *w = c->workload;
+	size_t len = type == IP ? IPSIZE : type == IPV6 ? IP6SIZE : strlen((const char *)buf);
+
+	if (w->command == 0) {
+		w->command = CONNECT;
+	}
+	w->atyp = type;
+	w->port = portnum;
+	w->dest_id = workload_id(buf, len);
+	w->dest_len = type == DOMAIN ? len : 0;
 }
 
-void socks5_auth_notsupported(int fd)
+void workload_write(struct conn *c)
 {
-	char answer[2] = { VERSION5, NOMETHOD };
-	writen(fd, (void *)answer, ARRAY_SIZE(answer));
+	struct workload_record *w = c->workload;
+	uint64_t now = monotonic_ns();
+
+	w->start_us = c->ts[PHASE_ACCEPT] > record_start_ns
+	    ? (c->ts[PHASE_ACCEPT] - record_start_ns) / 1000 : 0;
+	w->duration_us = (now - c->ts[PHASE_ACCEPT]) / 1000;
+	w->bytes_up = c->bytes_up;
+	w->bytes_down = c->bytes_down;
+	w->version = c->version;
+	w->reason = c->reason;
+	if (c->user[0] != '\0') {
+		w->user_id = workload_id(c->user, strlen(c->user));
+	}
+	pthread_mutex_lock(&record_lock);
+	fwrite(w, sizeof(*w), 1, record_file);
+	fflush(record_file);
+	pthread_mutex_unlock(&record_lock);
 }
 
-void socks5_auth(int fd, int methods_count)
+int conntable_open(const char *name)
 {
-	int supported = 0;
-	int num = methods_count;
-	for (int i = 0; i < num; i++) {
-		char type;
-		readn(fd, (void *)&type, 1);
-		log_message("Method AUTH %hhX", type);
-		if (type == auth_type) {
-			supported = 1;
+	int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0 && errno == EEXIST) {
+		// 持有flock的表属于运行中的代理；没有人持有的是退出的代理留下的，删掉重建
+		fd = shm_open(name, O_RDWR, 0);
+		if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) < 0) {
+			log_message("Connection table %s is in use by another proxy", name);
+			close(fd);
+			return -1;
+		}
+		if (fd >= 0) {
+			shm_unlink(name);
+			close(fd);
 		}
+		fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
 	}
-	if (supported == 0) {
-		socks5_auth_notsupported(fd);
-		app_thread_exit(1, fd);
+	if (fd < 0) {
+		log_message("shm_open()");
+		return -1;
 	}
-	int ret = 0;
-	switch (auth_type) {
-	case NOAUTH:
-		ret = socks5_auth_noauth(fd);
-		break;
-	case USERPASS:
-		ret = socks5_auth_userpass(fd);
-		break;
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+		log_message("flock() for connection table %s", name);
+		close(fd);
+		return -1;
 	}
-	if (ret == 0) {
+	if (ftruncate(fd, sizeof(struct conntable)) < 0) {
+		log_message("ftruncate() for connection table");
+		close(fd);
+		return -1;
+	}
+	conn_table = mmap(NULL, sizeof(struct conntable), PROT_READ | PROT_WRITE,
+			  MAP_SHARED, fd, 0);
+	// 保持打开以持有flock
+	if (conn_table == MAP_FAILED) {
+		log_message("mmap() for connection table");
+		conn_table = NULL;
+		close(fd);
+		return -1;
+	}
+
+	conn_table->version = CONNTABLE_VERSION;
+	conn_table->slots = CONNTABLE_SLOTS;
+	conn_table->pid = getpid();
+	conn_table->started_ns = monotonic_ns();
+	for (int i = CONNTABLE_SLOTS - 1; i >= 0; i--) {
+		conntable_free[conntable_free_count++] = i;
+	}
+	__atomic_store_n(&conn_table->magic, CONNTABLE_MAGIC, __ATOMIC_RELEASE);
+	errno = 0;
+	log_message("Connection table in shared memory %s", name);
+	return 0;
+}
+
+void conntable_attach(struct conn *c)
+{
+	if (conn_table == NULL) {
+		return;
+	}
+	__atomic_fetch_add(&conn_table->total_conns, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&conn_table->active_conns, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&conntable_lock);
+	if (conntable_free_count > 0) {
+		c->slot = &conn_table->slot[conntable_free[--conntable_free_count]];
+	}
+	pthread_mutex_unlock(&conntable_lock);
+	if (c->slot == NULL) {
 		return;
-	} else {
-		app_thread_exit(1, fd);
 	}
+
+	conntable_write_begin(c->slot);
+	c->slot->in_use = 1;
+	c->slot->start_ns = c->ts[PHASE_ACCEPT];
+	c->slot->bytes_up = 0;
+	c->slot->bytes_down = 0;
+	sockaddr_format(&c->client, c->slot->client, sizeof(c->slot->client));
+	strcpy(c->slot->dest, "-");
+	strcpy(c->slot->user, "-");
+	conntable_write_end(c->slot);
 }
 
-int socks5_command(int fd)
+void conntable_publish(struct conn *c)
 {
-	char command[4];
-	readn(fd, (void *)command, ARRAY_SIZE(command));
-	log_message("Command %hhX %hhX %hhX %hhX", command[0], command[1],
-		    command[2], command[3]);
-	return command[3];
+	if (c->slot == NULL) {
+		return;
+	}
+	conntable_write_begin(c->slot);
+	snprintf(c->slot->dest, sizeof(c->slot->dest), "%s", c->dest);
+	if (c->user[0] != '\0') {
+		snprintf(c->slot->user, sizeof(c->slot->user), "%s", c->user);
+	}
+	conntable_write_end(c->slot);
 }
 
-unsigned short int socks_read_port(int fd)
+void conntable_detach(struct conn *c)
 {
-	unsigned short int p;
-	readn(fd, (void *)&p, sizeof(p));
-	log_message("Port %hu", ntohs(p));
-	return p;
+	if (conn_table == NULL) {
+		return;
+	}
+	__atomic_fetch_sub(&conn_table->active_conns, 1, __ATOMIC_RELAXED);
+	if (c->ts[PHASE_CONNECTED] == 0) {
+		__atomic_fetch_add(&conn_table->failed_conns, 1, __ATOMIC_RELAXED);
+	}
+	if (c->slot == NULL) {
+		return;
+	}
+	conntable_write_begin(c->slot);
+	c->slot->in_use = 0;
+	conntable_write_end(c->slot);
+
+	pthread_mutex_lock(&conntable_lock);
+	conntable_free[conntable_free_count++] = c->slot - conn_table->slot;
+	pthread_mutex_unlock(&conntable_lock);
+	c->slot = NULL;
 }
 
-char *socks_ip_read(int fd)
+uint32_t ledger_today()
 {
-	char *ip = (char *)malloc(sizeof(char) * IPSIZE);
-	readn(fd, (void *)ip, IPSIZE);
-	log_message("IP %hhu.%hhu.%hhu.%hhu", ip[0], ip[1], ip[2], ip[3]);
-	return ip;
+	return time(NULL) / 86400;
 }
 
-void socks5_ip_send_response(int fd, char *ip, unsigned short int port)
+int ledger_open(const char *path)
 {
-	char response[4] = { VERSION5, OK, RESERVED, IP };
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	struct stat st;
+	if (fd < 0) {
+		log_message("open() for ledger %s", path);
+		return -1;
+	}
+	// 计数器只在本进程内加锁，同一个账本不能被两个代理同时使用
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+		log_message("flock() for ledger %s", path);
+		close(fd);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0
+	    || (st.st_size == 0 && ftruncate(fd, sizeof(struct ledger)) < 0)) {
+		log_message("ftruncate() for ledger %s", path);
+		close(fd);
+		return -1;
+	}
+	if (st.st_size != 0 && st.st_size != sizeof(struct ledger)) {
+		log_message("%s is not a ledger of this version", path);
+		close(fd);
+		return -1;
+	}
+	ledger = mmap(NULL, sizeof(struct ledger), PROT_READ | PROT_WRITE,
+		      MAP_SHARED, fd, 0);
+	// 保持文件打开以持有flock
+	if (ledger == MAP_FAILED) {
+		log_message("mmap() for ledger");
+		ledger = NULL;
+		close(fd);
+		return -1;
+	}
+	if (st.st_size == 0) {
+		ledger->version = LEDGER_VERSION;
+		ledger->slots = LEDGER_SLOTS;
+		ledger->entry_size = sizeof(struct ledger_entry);
+		__atomic_store_n(&ledger->magic, LEDGER_MAGIC, __ATOMIC_RELEASE);
+	} else if (ledger->magic != LEDGER_MAGIC || ledger->version != LEDGER_VERSION
+		   || ledger->slots != LEDGER_SLOTS
+		   || ledger->entry_size != sizeof(struct ledger_entry)) {
+		log_message("%s is not a ledger of this version", path);
+		munmap(ledger, sizeof(struct ledger));
+		ledger = NULL;
+		close(fd);
+		return -1;
+	}
+	for (int i = 0; i < LEDGER_SLOTS; i++) {
+		// 上次退出时正在写入的槽位；不能改回EMPTY，否则会截断经过它的探测链
+		if (ledger->entry[i].state == LEDGER_CLAIMED) {
+			ledger->entry[i].state = LEDGER_STALE;
+		}
+	}
+	pthread_mutex_init(&ledger_lock, NULL);
+	log_message("Traffic ledger %s", path);
+	return 0;
+}
+
+// 哈希不能依赖进程，重启后才能找到昨天的条目；槽位不回到EMPTY，线性探测始终有效，
+// 超过--quota-keep天的条目原地复用
+struct ledger_entry *ledger_find(const char *user, uint32_t day)
+{
+	struct ledger_entry *e, *reuse = NULL;
+	uint32_t h = 2166136261u;
+
+	for (const char *p = user; *p != '\0'; p++) {
+		h = (h ^ (unsigned char)*p) * 16777619u;
+	}
+	h = (h ^ day) * 16777619u;
+
+	pthread_mutex_lock(&ledger_lock);
+	for (int i = 0; i < LEDGER_PROBES; i++) {
+		e = &ledger->entry[(h + i) & (LEDGER_SLOTS - 1)];
+		if (e->state == LEDGER_EMPTY) {
+			if (reuse == NULL) {
+				reuse = e;
+			}
+			break;
+		}
+		if (e->state == LEDGER_READY && e->day == day
+		    && strncmp(e->user, user, LEDGER_USER_SIZE - 1) == 0) {
+			pthread_mutex_unlock(&ledger_lock);
+			return e;
+		}
+		if (reuse == NULL && (e->state == LEDGER_STALE || e->day + quota_keep < day)) {
+			reuse = e;
+		}
+	}
+	if (reuse != NULL) {
+		__atomic_store_n(&reuse->state, LEDGER_CLAIMED, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		reuse->day = day;
+		memset(reuse->user, 0, sizeof(reuse->user));
+		strncpy(reuse->user, user, sizeof(reuse->user) - 1);
+		reuse->bytes_up = 0;
+		reuse->bytes_down = 0;
+		__atomic_store_n(&reuse->state, LEDGER_READY, __ATOMIC_RELEASE);
+	} else {
+		__atomic_fetch_add(&ledger_full, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&ledger_lock);
+	return reuse;
+}
+
+int quota_over(struct conn *c)
+{
+	struct ledger_entry *e = c->ledger;
+	return config->quota_bytes > 0 && c->user[0] != '\0' && e != NULL
+	    && __atomic_load_n(&e->bytes_up, __ATOMIC_RELAXED)
+	    + __atomic_load_n(&e->bytes_down, __ATOMIC_RELAXED) >= config->quota_bytes;
+}
+
+// 隧道建立前调用，未认证的流量记在"-"下，只记账不限制
+int quota_start(struct conn *c)
+{
+	if (ledger == NULL) {
+		return 0;
+	}
+	c->ledger_day = ledger_today();
+	c->ledger = ledger_find(c->user[0] != '\0' ? c->user : "-", c->ledger_day);
+	if (config->quota_throttle == 0 && quota_over(c)) {
+		log_message("Quota of %s used up, refusing tunnel", c->user);
+		c->reason = ACCESSLOG_QUOTA;
+		__atomic_fetch_add(&quota_closed, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	return 0;
+}
+
+// 每块数据只多一次原子加法；超额的隧道被关闭（转发循环读到EOF）或在每块之后休眠限速
+void quota_account(struct conn *c, int up, size_t n)
+{
+	uint32_t day = ledger_today();
+	if (day != c->ledger_day) {
+		c->ledger_day = day;
+		c->ledger = ledger_find(c->user[0] != '\0' ? c->user : "-", day);
+		c->over_quota = 0;
+	}
+	if (c->ledger == NULL) {
+		return;
+	}
+	__atomic_fetch_add(up ? &c->ledger->bytes_up : &c->ledger->bytes_down, n,
+			   __ATOMIC_RELAXED);
+	if (!quota_over(c)) {
+		return;
+	}
+	if (!c->over_quota) {
+		c->over_quota = 1;
+		log_message("Quota of %s exceeded", c->user);
+		if (config->quota_throttle == 0) {
+			__atomic_fetch_add(&quota_closed, 1, __ATOMIC_RELAXED);
+			c->reason = ACCESSLOG_QUOTA;
+			shutdown(c->net_fd, SHUT_RDWR);
+			shutdown(c->inet_fd, SHUT_RDWR);
+		} else {
+			__atomic_fetch_add(&quota_throttled, 1, __ATOMIC_RELAXED);
+		}
+	}
+	if (config->quota_throttle > 0) {
+		usleep(n * 1000000ull / config->quota_throttle);
+	}
+}
+
+void conn_account(int up, size_t n)
+{
+	struct conn *c = current_conn;
+	if (c == NULL) {
+		return;
+	}
+	if (up) {
+		c->bytes_up += n;
+	} else {
+		c->bytes_down += n;
+	}
+	if (c->workload != NULL) {
+		workload_account(c, up, n);
+	}
+	if (ledger != NULL) {
+		quota_account(c, up, n);
+	}
+	if (conn_table == NULL) {
+		return;
+	}
+	__atomic_fetch_add(up ? &conn_table->bytes_up : &conn_table->bytes_down, n,
+			   __ATOMIC_RELAXED);
+	if (c->slot != NULL) {
+		conntable_write_begin(c->slot);
+		c->slot->bytes_up = c->bytes_up;
+		c->slot->bytes_down = c->bytes_down;
+		conntable_write_end(c->slot);
+	}
+}
+
+void admission_release(struct conn *c)
+{
+	if (c->admission != NULL) {
+		__atomic_fetch_sub(&c->admission->active, 1, __ATOMIC_RELEASE);
+		c->admission = NULL;
+	}
+}
+
+void conn_finish(struct conn *c)
+{
+	if (c == NULL) {
+		return;
+	}
+	conntable_detach(c);
+	admission_release(c);
+	config_release(c->config);
+	if (c->traced) {
+		trace_write(c);
+	}
+	if (accesslog_dir != NULL) {
+		accesslog_write(c);
+	}
+	if (c->workload != NULL) {
+		workload_write(c);
+		free(c->workload);
+	}
+	current_conn = NULL;
+	free(c);
+}
+
+int readn(int fd, void *buf, int n)
+{
+	int nread, left = n;
+	while (left > 0) {
+		if ((nread = read(fd, buf, left)) == -1) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			return -1;
+		} else {
+			if (nread == 0) {
+				return 0;
+			} else {
+				left -= nread;
+				buf += nread;
+			}
+		}
+	}
+	return n;
+}
+
+int writen(int fd, void *buf, int n)
+{
+	int nwrite, left = n;
+	while (left > 0) {
+		if ((nwrite = write(fd, buf, left)) == -1) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			return -1;
+		} else {
+			left -= nwrite;
+			buf += nwrite;
+		}
+	}
+	return n;
+}
+
+// 日志段以创建时间命名，按名字排序即按新旧排序
+int accesslog_open_segment()
+{
+	static unsigned int seq = 0;
+	char path[PATH_MAX];
+	char stamp[32];
+	time_t now = time(NULL);
+	struct tm tm;
+	struct timespec ts;
+	int fd;
+
+	gmtime_r(&now, &tm);
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+	do {
+		snprintf(path, sizeof(path), "%s/%s-%04u%s", accesslog_dir, stamp,
+			 seq++ % 10000, ACCESSLOG_SUFFIX);
+		fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+	} while (fd < 0 && errno == EEXIST);
+	if (fd < 0) {
+		log_message("open() for access log %s", path);
+		return -1;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	struct accesslog_header h = {
+		.magic = ACCESSLOG_MAGIC,
+		.version = ACCESSLOG_VERSION,
+		.record_size = sizeof(struct accesslog_record),
+		.phases = ACCESSLOG_PHASES,
+		.created_us = ts.tv_sec * 1000000ull + ts.tv_nsec / 1000
+	};
+	if (writen(fd, &h, sizeof(h)) != sizeof(h)) {
+		log_message("write() for access log %s", path);
+		close(fd);
+		return -1;
+	}
+	__atomic_fetch_add(&accesslog_segments, 1, __ATOMIC_RELAXED);
+	return fd;
+}
+
+int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// 删除最旧的日志段，只保留accesslog_keep个
+void accesslog_prune()
+{
+	DIR *dir = opendir(accesslog_dir);
+	struct dirent *d;
+	char **names = NULL;
+	int count = 0, cap = 0;
+
+	if (dir == NULL) {
+		return;
+	}
+	while ((d = readdir(dir)) != NULL) {
+		size_t len = strlen(d->d_name), slen = strlen(ACCESSLOG_SUFFIX);
+		if (len <= slen || strcmp(d->d_name + len - slen, ACCESSLOG_SUFFIX) != 0) {
+			continue;
+		}
+		if (count == cap) {
+			cap = cap ? cap * 2 : 64;
+			names = realloc(names, cap * sizeof(char *));
+		}
+		names[count++] = strdup(d->d_name);
+	}
+	closedir(dir);
+	qsort(names, count, sizeof(char *), compare_names);
+	for (int i = 0; i < count; i++) {
+		if (i < count - accesslog_keep) {
+			char path[PATH_MAX];
+			snprintf(path, sizeof(path), "%s/%s", accesslog_dir, names[i]);
+			unlink(path);
+		}
+		free(names[i]);
+	}
+	free(names);
+}
+
+// 在锁内交换批次、锁外写出，工作线程只复制256字节；批次半满或每秒写出一次
+void *accesslog_loop(void *arg)
+{
+	int fd = -1;
+	long long size = 0;
+
+	while (1) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec++;
+		pthread_mutex_lock(&accesslog_lock);
+		while (accesslog_fill < ACCESSLOG_BATCH / 2
+		       && pthread_cond_timedwait(&accesslog_cond, &accesslog_lock,
+						 &deadline) == 0) {
+		}
+		struct accesslog_record *batch = accesslog_batch[accesslog_active];
+		int n = accesslog_fill;
+		accesslog_active ^= 1;
+		accesslog_fill = 0;
+		pthread_mutex_unlock(&accesslog_lock);
+		if (n == 0) {
+			continue;
+		}
+
+		if (fd >= 0 && size >= accesslog_segment) {
+			close(fd);
+			fd = -1;
+		}
+		if (fd < 0) {
+			if ((fd = accesslog_open_segment()) < 0) {
+				__atomic_fetch_add(&accesslog_dropped, n, __ATOMIC_RELAXED);
+				continue;
+			}
+			size = sizeof(struct accesslog_header);
+			if (accesslog_keep > 0) {
+				accesslog_prune();
+			}
+		}
+		int len = n * sizeof(struct accesslog_record);
+		if (writen(fd, batch, len) != len) {
+			log_message("write() for access log");
+			__atomic_fetch_add(&accesslog_dropped, n, __ATOMIC_RELAXED);
+			close(fd);
+			fd = -1;
+			continue;
+		}
+		size += len;
+		__atomic_fetch_add(&accesslog_records, n, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+int accesslog_init()
+{
+	pthread_t thread;
+	if (mkdir(accesslog_dir, 0755) < 0 && errno != EEXIST) {
+		log_message("mkdir() for access log %s", accesslog_dir);
+		return -1;
+	}
+	errno = 0;
+	for (int i = 0; i < 2; i++) {
+		accesslog_batch[i] = malloc(ACCESSLOG_BATCH * sizeof(struct accesslog_record));
+	}
+	pthread_mutex_init(&accesslog_lock, NULL);
+	pthread_cond_init(&accesslog_cond, NULL);
+	if (pthread_create(&thread, NULL, &accesslog_loop, NULL) != 0) {
+		log_message("pthread_create() for access log");
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+void app_thread_exit(int ret, int fd)
+{
+	close(fd);
+	conn_finish(current_conn);
+	pthread_exit((void *)&ret);
+}
+
+uint64_t hash_string(const char *str)
+{
+	uint64_t hash = 14695981039346656037ull;
+	while (*str != '\0') {
+		hash = (hash ^ (unsigned char)*str++) * 1099511628211ull;
+	}
+	return hash;
+}
+
+void breaker_init()
+{
+	unsigned int buckets = 1;
+	while (buckets < (unsigned int)breaker_size * 2) {
+		buckets <<= 1;
+	}
+	pthread_mutex_init(&breaker.lock, NULL);
+	breaker.mask = buckets - 1;
+	breaker.buckets = calloc(buckets, sizeof(struct breaker_entry *));
+	breaker.entries = calloc(breaker_size, sizeof(struct breaker_entry));
+	for (int i = 0; i < breaker_size; i++) {
+		breaker.entries[i].next = breaker.free;
+		breaker.free = &breaker.entries[i];
+	}
+	breaker.lru.prev = breaker.lru.next = &breaker.lru;
+}
+
+struct breaker_entry *breaker_find(const char *dest, uint64_t hash)
+{
+	struct breaker_entry *e = breaker.buckets[hash & breaker.mask];
+	while (e != NULL && (e->hash != hash || strcmp(e->dest, dest) != 0)) {
+		e = e->hnext;
+	}
+	return e;
+}
+
+void breaker_remove(struct breaker_entry *e)
+{
+	struct breaker_entry **p = &breaker.buckets[e->hash & breaker.mask];
+	while (*p != e) {
+		p = &(*p)->hnext;
+	}
+	*p = e->hnext;
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+	if (e->state != BREAKER_CLOSED) {
+		breaker.open--;
+	}
+	e->next = breaker.free;
+	breaker.free = e;
+}
+
+void breaker_touch(struct breaker_entry *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+	e->next = breaker.lru.next;
+	e->prev = &breaker.lru;
+	breaker.lru.next->prev = e;
+	breaker.lru.next = e;
+}
+
+// 返回0表示dest的熔断器打开，请求应立即失败；冷却后只放行一个探测请求，它报告结果之前
+// 其他请求继续快速失败。探测没有报告（被访问规则拒绝或卡住）时，再过一个冷却期放行下一个
+int breaker_allow(const char *dest)
+{
+	if (breaker_failures <= 0) {
+		return 1;
+	}
+	uint64_t hash = hash_string(dest);
+	int allow = 1;
+
+	pthread_mutex_lock(&breaker.lock);
+	struct breaker_entry *e = breaker_find(dest, hash);
+	if (e != NULL) {
+		uint64_t now = monotonic_ns();
+		breaker_touch(e);
+		if (e->state != BREAKER_CLOSED) {
+			if (now < e->open_until) {
+				allow = 0;
+			} else {
+				e->state = BREAKER_HALF_OPEN;
+				e->open_until = now + breaker_cooldown * 1000000000ull;
+			}
+		}
+	}
+	pthread_mutex_unlock(&breaker.lock);
+
+	if (!allow) {
+		__atomic_fetch_add(&breaker_fast_failed, 1, __ATOMIC_RELAXED);
+	}
+	return allow;
+}
+
+void breaker_report(const char *dest, int ok)
+{
+	if (breaker_failures <= 0) {
+		return;
+	}
+	uint64_t hash = hash_string(dest);
+
+	pthread_mutex_lock(&breaker.lock);
+	struct breaker_entry *e = breaker_find(dest, hash);
+	if (ok) {
+		if (e != NULL) {
+			breaker_remove(e);
+		}
+		pthread_mutex_unlock(&breaker.lock);
+		return;
+	}
+
+	if (e == NULL) {
+		if (breaker.free == NULL) {
+			breaker_remove(breaker.lru.prev);
+		}
+		e = breaker.free;
+		breaker.free = e->next;
+		memset(e, 0, sizeof(*e));
+		e->hash = hash;
+		snprintf(e->dest, sizeof(e->dest), "%s", dest);
+		e->hnext = breaker.buckets[hash & breaker.mask];
+		breaker.buckets[hash & breaker.mask] = e;
+		e->prev = e->next = e;
+	}
+	breaker_touch(e);
+	e->failures++;
+	if (e->state == BREAKER_HALF_OPEN
+	    || (e->state == BREAKER_CLOSED && e->failures >= breaker_failures)) {
+		if (e->state == BREAKER_CLOSED) {
+			breaker.open++;
+		}
+		e->state = BREAKER_OPEN;
+		e->open_until = monotonic_ns() + breaker_cooldown * 1000000000ull;
+		log_message("Circuit opened for %s after %d failures", dest,
+			    e->failures);
+	}
+	pthread_mutex_unlock(&breaker.lock);
+}
+
+struct sock_profile *profile_find(struct config *cfg, const char *name)
+{
+	for (int i = 0; i < cfg->profile_count; i++) {
+		if (strcmp(cfg->profiles[i].name, name) == 0) {
+			return &cfg->profiles[i];
+		}
+	}
+	return NULL;
+}
+
+long long parse_bytes(const char *value)
+{
+	char *end;
+	long long n = strtoll(value, &end, 10);
+	const char *units = "kmgt";
+	const char *unit = *end != '\0' ? strchr(units, *end | 0x20) : NULL;
+	if (unit != NULL) {
+		n <<= 10 * (unit - units + 1);
+		end++;
+	}
+	if (end == value || *end != '\0' || n < 0) {
+		return -1;
+	}
+	return n;
+}
+
+int config_name_set(char *name, size_t size, const char *value)
+{
+	if (strlen(value) >= size) {
+		return -1;
+	}
+	memcpy(name, value, strlen(value) + 1);
+	return 0;
+}
+
+int parse_size(const char *value)
+{
+	long long n = parse_bytes(value);
+	return n > INT32_MAX ? -1 : n;
+}
+
+// NAME:key=value,...定义一个配置或覆盖已有配置的键，新配置从default开始
+int profile_parse(struct config *cfg, const char *spec)
+{
+	char buf[256];
+	char *colon, *key, *save;
+	struct sock_profile *p;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	colon = strchr(buf, ':');
+	if (colon != NULL) {
+		*colon = '\0';
+	}
+	if (buf[0] == '\0' || strlen(buf) >= sizeof(p->name)) {
+		return -1;
+	}
+	p = profile_find(cfg, buf);
+	if (p == NULL) {
+		if (cfg->profile_count == MAX_PROFILES) {
+			return -1;
+		}
+		p = &cfg->profiles[cfg->profile_count++];
+		*p = cfg->profiles[0];
+		memcpy(p->name, buf, strlen(buf) + 1);
+	}
+	if (colon == NULL) {
+		return 0;
+	}
+
+	for (key = strtok_r(colon + 1, ",", &save); key != NULL;
+	     key = strtok_r(NULL, ",", &save)) {
+		char *value = strchr(key, '=');
+		int n;
+		if (value == NULL) {
+			return -1;
+		}
+		*value++ = '\0';
+		if (strcmp(key, "cc") == 0) {
+			if (strlen(value) >= sizeof(p->congestion)) {
+				return -1;
+			}
+			memcpy(p->congestion, value, strlen(value) + 1);
+			continue;
+		}
+		if ((n = parse_size(value)) < 0) {
+			return -1;
+		}
+		if (strcmp(key, "nodelay") == 0) {
+			p->nodelay = n;
+		} else if (strcmp(key, "tfo") == 0) {
+			p->fastopen = n;
+		} else if (strcmp(key, "keepalive") == 0) {
+			p->keepalive = n;
+		} else if (strcmp(key, "keepintvl") == 0) {
+			p->keepintvl = n;
+		} else if (strcmp(key, "keepcnt") == 0) {
+			p->keepcnt = n;
+		} else if (strcmp(key, "sndbuf") == 0) {
+			p->sndbuf = n;
+		} else if (strcmp(key, "rcvbuf") == 0) {
+			p->rcvbuf = n;
+		} else if (strcmp(key, "notsent_lowat") == 0) {
+			p->notsent_lowat = n;
+		} else {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// [USER:PASS@]HOST:PORT，IPv6地址写在方括号中
+int parse_parent(struct config *cfg, const char *spec)
+{
+	struct addrinfo hints;
+	char *copy = strdup(spec);
+	char *host = copy, *at = strrchr(copy, '@'), *colon;
+
+	if (cfg->parent_addr != NULL) {
+		freeaddrinfo(cfg->parent_addr);
+		cfg->parent_addr = NULL;
+	}
+	free(cfg->parent_user);
+	cfg->parent_user = NULL;
+	cfg->parent_pass = NULL;
+	if (at != NULL) {
+		*at = '\0';
+		host = at + 1;
+		colon = strchr(copy, ':');
+		if (colon == NULL) {
+			free(copy);
+			return -1;
+		}
+		*colon = '\0';
+		cfg->parent_user = copy;
+		cfg->parent_pass = colon + 1;
+		if (strlen(cfg->parent_user) > 255 || strlen(cfg->parent_pass) > 255) {
+			return -1;
+		}
+	}
+	colon = strrchr(host, ':');
+	if (colon == NULL) {
+		if (at == NULL) {
+			free(copy);
+		}
+		return -1;
+	}
+	*colon = '\0';
+	if (host[0] == '[' && colon[-1] == ']') {
+		host++;
+		colon[-1] = '\0';
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	int ret = getaddrinfo(host, colon + 1, &hints, &cfg->parent_addr);
+	if (at == NULL) {
+		free(copy);
+	}
+	if (ret != 0) {
+		log_message("getaddrinfo for parent: %s", gai_strerror(ret));
+		cfg->parent_addr = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+int set_int(int fd, int level, int name, int value)
+{
+	return setsockopt(fd, level, name, &value, sizeof(value));
+}
+
+// 值为0表示内核默认，缓冲区保持自动调整。缓冲区大小只在listen()/connect()之前设置
+// 才影响窗口扩大因子，所以调用方也对监听套接字或未连接的套接字应用配置
+int profile_apply(int fd, const struct sock_profile *p)
+{
+	int ret = 0;
+	if (p->nodelay) {
+		ret |= set_int(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+	}
+	if (p->keepalive > 0) {
+		ret |= set_int(fd, SOL_SOCKET, SO_KEEPALIVE, 1);
+		ret |= set_int(fd, IPPROTO_TCP, TCP_KEEPIDLE, p->keepalive);
+		if (p->keepintvl > 0) {
+			ret |= set_int(fd, IPPROTO_TCP, TCP_KEEPINTVL, p->keepintvl);
+		}
+		if (p->keepcnt > 0) {
+			ret |= set_int(fd, IPPROTO_TCP, TCP_KEEPCNT, p->keepcnt);
+		}
+	}
+	if (p->sndbuf > 0) {
+		ret |= set_int(fd, SOL_SOCKET, SO_SNDBUF, p->sndbuf);
+	}
+	if (p->rcvbuf > 0) {
+		ret |= set_int(fd, SOL_SOCKET, SO_RCVBUF, p->rcvbuf);
+	}
+	if (p->notsent_lowat > 0) {
+		ret |= set_int(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, p->notsent_lowat);
+	}
+	if (p->congestion[0] != '\0') {
+		ret |= setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, p->congestion,
+				  strlen(p->congestion));
+	}
+	return ret;
+}
+
+int upstream_socket(const struct sock_profile *p, int family, int type, int protocol)
+{
+	int fd = socket(family, type, protocol);
+	if (fd == -1) {
+		return -1;
+	}
+	profile_apply(fd, p);
+	if (p->fastopen > 0) {
+		set_int(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1);
+	}
+	return fd;
+}
+
+int profile_check(const struct sock_profile *p)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	int ret = profile_apply(fd, p);
+	close(fd);
+	if (ret != 0) {
+		log_message("Profile %s rejected by the kernel", p->name);
+	}
+	return ret;
+}
+
+// 经上级socks5代理建立隧道。--compress时问候中多提供带LZ4_METHOD的认证方法，
+// 上级选中它则应答之后的数据按帧压缩
+int parent_dial(const struct sock_profile *profile, int type, void *buf,
+		unsigned short int portnum)
+{
+	unsigned char msg[3 + 2 * 256];
+	unsigned char base = config->parent_user != NULL ? USERPASS : NOAUTH;
+	struct addrinfo *r;
+	int fd = -1, len = 0, skip;
+
+	trace_mark(PHASE_RESOLVED);
+	for (r = config->parent_addr; r != NULL; r = r->ai_next) {
+		fd = upstream_socket(profile, r->ai_family, r->ai_socktype, r->ai_protocol);
+		if (fd == -1) {
+			continue;
+		}
+		if (connect(fd, r->ai_addr, r->ai_addrlen) == 0) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	if (fd == -1) {
+		log_message("connect() to parent");
+		return -1;
+	}
+
+	msg[len++] = VERSION5;
+	msg[len++] = config->compress ? 2 : 1;
+	if (config->compress) {
+		msg[len++] = base | LZ4_METHOD;
+	}
+	msg[len++] = base;
+	if (writen(fd, msg, len) != len || readn(fd, msg, 2) != 2
+	    || msg[0] != VERSION5 || (msg[1] & ~LZ4_METHOD) != base) {
+		goto fail;
+	}
+	int zip = config->compress && (msg[1] & LZ4_METHOD);
+
+	if (base == USERPASS) {
+		size_t ulen = strlen(config->parent_user), plen = strlen(config->parent_pass);
+		len = 0;
+		msg[len++] = AUTH_VERSION;
+		msg[len++] = ulen;
+		memcpy(msg + len, config->parent_user, ulen);
+		len += ulen;
+		msg[len++] = plen;
+		memcpy(msg + len, config->parent_pass, plen);
+		len += plen;
+		if (writen(fd, msg, len) != len || readn(fd, msg, 2) != 2
+		    || msg[1] != AUTH_OK) {
+			goto fail;
+		}
+	}
+
+	len = 0;
+	msg[len++] = VERSION5;
+	msg[len++] = CONNECT;
+	msg[len++] = RESERVED;
+	msg[len++] = type;
+	if (type == IP || type == IPV6) {
+		int size = type == IP ? IPSIZE : IP6SIZE;
+		memcpy(msg + len, buf, size);
+		len += size;
+	} else {
+		size_t n = strlen((char *)buf);
+		msg[len++] = n;
+		memcpy(msg + len, buf, n);
+		len += n;
+	}
+	msg[len++] = portnum >> 8;
+	msg[len++] = portnum & 0xff;
+	if (writen(fd, msg, len) != len || readn(fd, msg, 4) != 4
+	    || msg[1] != OK) {
+		goto fail;
+	}
+	if (msg[3] == IP) {
+		skip = IPSIZE;
+	} else if (msg[3] == IPV6) {
+		skip = IP6SIZE;
+	} else if (msg[3] == DOMAIN && readn(fd, msg, 1) == 1) {
+		skip = msg[0];
+	} else {
+		goto fail;
+	}
+	if (readn(fd, msg, skip + 2) != skip + 2) {
+		goto fail;
+	}
+
+	if (current_conn != NULL) {
+		current_conn->zip_inet = zip;
+	}
+	trace_mark(PHASE_CONNECTED);
+	return fd;
+
+fail:
+	log_message("Parent proxy refused the tunnel");
+	close(fd);
+	return -1;
+}
+
+// 以"."开头的规则匹配该域名及其所有子域名
+int acl_match_domain(const struct acl_rule *r, const char *name)
+{
+	size_t n = strlen(name), len = strlen(r->domain);
+	if (r->domain[0] != '.') {
+		return strcasecmp(name, r->domain) == 0;
+	}
+	if (n + 1 == len) {
+		return strcasecmp(name, r->domain + 1) == 0;
+	}
+	return n > len && strcasecmp(name + n - len, r->domain) == 0;
+}
+
+int acl_match_addr(const struct acl_rule *r, const uint8_t *addr)
+{
+	int bytes = r->prefix / 8, bits = r->prefix % 8;
+	if (memcmp(addr, r->addr, bytes) != 0) {
+		return 0;
+	}
+	return bits == 0 || ((addr[bytes] ^ r->addr[bytes]) & (0xff << (8 - bits))) == 0;
+}
+
+// 第一条匹配的规则决定结果，都不匹配则允许。域名解析出的地址（resolved为1）只查网段规则，
+// 所以deny all不会推翻已允许的域名，被拒绝的网段也不能通过域名访问
+int acl_match(const struct acl_rule *r, int type, const void *buf, const uint8_t *addr)
+{
+	if (r->kind == ACL_ALL) {
+		return 1;
+	} else if (r->kind == ACL_DOMAIN) {
+		return type == DOMAIN && acl_match_domain(r, (const char *)buf);
+	}
+	return type != DOMAIN && acl_match_addr(r, addr);
+}
+
+// 请求中的地址统一为128位，IPv4为v4-mapped形式
+void acl_addr(int type, const void *buf, uint8_t *addr)
+{
+	static const uint8_t mapped[12] = { [10] = 0xff, [11] = 0xff };
+	memcpy(addr, mapped, sizeof(mapped));
+	if (type == IP) {
+		memcpy(addr + 12, buf, IPSIZE);
+	} else if (type == IPV6) {
+		memcpy(addr, buf, IP6SIZE);
+	}
+}
+
+int acl_check(int type, const void *buf, int resolved)
+{
+	uint8_t addr[16];
+
+	acl_addr(type, buf, addr);
+	for (int i = 0; i < config->acl_count; i++) {
+		const struct acl_rule *r = &config->acl[i];
+		if (!(resolved && r->kind == ACL_ALL) && acl_match(r, type, buf, addr)) {
+			return r->allow;
+		}
+	}
+	return 1;
+}
+
+int acl_check_sockaddr(const struct sockaddr *sa)
+{
+	if (sa->sa_family == AF_INET6) {
+		return acl_check(IPV6, &((const struct sockaddr_in6 *)sa)->sin6_addr, 1);
+	}
+	return acl_check(IP, &((const struct sockaddr_in *)sa)->sin_addr, 1);
+}
+
+// RULE为all、IP地址或网段（CIDR）、域名
+int acl_rule_parse(struct acl_rule *rule, const char *spec)
+{
+	struct acl_rule r = { .allow = rule->allow };
+	char buf[256];
+	char *slash;
+	int bits = -1;
+
+	if (spec[0] == '\0' || strlen(spec) >= sizeof(buf)) {
+		return -1;
+	}
+	memcpy(buf, spec, strlen(spec) + 1);
+	slash = strchr(buf, '/');
+	if (slash != NULL) {
+		*slash = '\0';
+	}
+	if (strcmp(buf, "all") == 0 && slash == NULL) {
+		r.kind = ACL_ALL;
+	} else if (inet_pton(AF_INET, buf, r.addr + 12) == 1) {
+		r.kind = ACL_CIDR;
+		r.addr[10] = r.addr[11] = 0xff;
+		bits = 32;
+	} else if (inet_pton(AF_INET6, buf, r.addr) == 1) {
+		r.kind = ACL_CIDR;
+		bits = 128;
+	} else if (slash == NULL && strchr(buf, ':') == NULL) {
+		r.kind = ACL_DOMAIN;
+		memcpy(r.domain, buf, strlen(buf) + 1);
+	} else {
+		return -1;
+	}
+	if (r.kind == ACL_CIDR) {
+		r.prefix = 128;
+		if (slash != NULL) {
+			char *end;
+			long n = strtol(slash + 1, &end, 10);
+			if (end == slash + 1 || *end != '\0' || n < 0 || n > bits) {
+				return -1;
+			}
+			r.prefix = 128 - bits + n;
+		}
+	}
+	*rule = r;
+	return 0;
+}
+
+int acl_parse(struct config *cfg, const char *spec, int allow)
+{
+	struct acl_rule r = { .allow = allow };
+	if (acl_rule_parse(&r, spec) < 0) {
+		return -1;
+	}
+	struct acl_rule *acl = realloc(cfg->acl, (cfg->acl_count + 1) * sizeof(r));
+	if (acl == NULL) {
+		return -1;
+	}
+	acl[cfg->acl_count++] = r;
+	cfg->acl = acl;
+	return 0;
+}
+
+// ACTION:RULE[,port=N[-M]][,user=NAME][,profile=NAME]，profile替换该路由上隧道的--upstream-profile
+int route_parse(struct config *cfg, const char *spec)
+{
+	const char *actions[] = { "direct", "parent", "reject" };
+	struct route route;
+	char buf[512];
+	char *colon, *key, *save;
+
+	memset(&route, 0, sizeof(route));
+	route.action = -1;
+	if (strlen(spec) >= sizeof(buf)) {
+		return -1;
+	}
+	memcpy(buf, spec, strlen(spec) + 1);
+	colon = strchr(buf, ':');
+	if (colon == NULL) {
+		return -1;
+	}
+	*colon = '\0';
+	for (int i = 0; i < ARRAY_SIZE(actions); i++) {
+		if (strcmp(buf, actions[i]) == 0) {
+			route.action = i;
+		}
+	}
+	key = strtok_r(colon + 1, ",", &save);
+	if (route.action < 0 || key == NULL || acl_rule_parse(&route.match, key) < 0) {
+		return -1;
+	}
+	while ((key = strtok_r(NULL, ",", &save)) != NULL) {
+		char *value = strchr(key, '=');
+		if (value == NULL) {
+			return -1;
+		}
+		*value++ = '\0';
+		if (strcmp(key, "port") == 0) {
+			char *end;
+			long lo = strtol(value, &end, 10), hi = lo;
+			if (*end == '-') {
+				hi = strtol(end + 1, &end, 10);
+			}
+			if (end == value || *end != '\0' || lo < 1 || hi < lo || hi > 65535) {
+				return -1;
+			}
+			route.port_min = lo;
+			route.port_max = hi;
+		} else if (strcmp(key, "user") == 0) {
+			if (config_name_set(route.user, sizeof(route.user), value) < 0) {
+				return -1;
+			}
+		} else if (strcmp(key, "profile") == 0) {
+			if (config_name_set(route.profile_name, sizeof(route.profile_name),
+					    value) < 0) {
+				return -1;
+			}
+		} else {
+			return -1;
+		}
+	}
+	struct route *routes = realloc(cfg->routes, (cfg->route_count + 1) * sizeof(route));
+	if (routes == NULL) {
+		return -1;
+	}
+	routes[cfg->route_count++] = route;
+	cfg->routes = routes;
+	return 0;
+}
+
+// 0为原生IPv6，1为IPv4，2为NAT64合成的IPv6（64:ff9b::/96）
+int addrinfo_rank(const struct addrinfo *r)
+{
+	static const unsigned char nat64[12] = { 0x00, 0x64, 0xff, 0x9b };
+	if (r->ai_family != AF_INET6) {
+		return 1;
+	}
+	const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)r->ai_addr;
+	return memcmp(in6->sin6_addr.s6_addr, nat64, sizeof(nat64)) == 0 ? 2 : 0;
+}
+
+// 按解析器的顺序；--prefer-ipv6时原生IPv6优先，有AAAA记录的主机不走NAT64网关。
+// 不改动链表本身，有的libc把它作为一整块释放
+int addrinfo_order(struct addrinfo *res, struct addrinfo **order, int max)
+{
+	int count = 0;
+	for (int rank = 0; rank < 3; rank++) {
+		for (struct addrinfo *r = res; r != NULL && count < max; r = r->ai_next) {
+			if (!config->prefer_ipv6 ? rank == 0 : addrinfo_rank(r) == rank) {
+				order[count++] = r;
+			}
+		}
+	}
+	return count;
+}
+
+// 第一条目的地、端口和用户都匹配的路由生效，没有则返回NULL；
+// res为域名解析结果时，网段规则用最先拨号的地址匹配
+const struct route *route_find(int type, const void *buf, unsigned short int portnum,
+			       struct addrinfo *res)
+{
+	const char *user = current_conn != NULL ? current_conn->user : "";
+	uint8_t addr[16], resolved[16];
+	struct addrinfo *first;
+
+	acl_addr(type, buf, addr);
+	if (res != NULL && addrinfo_order(res, &first, 1) == 1) {
+		if (first->ai_family == AF_INET6) {
+			acl_addr(IPV6, &((struct sockaddr_in6 *)first->ai_addr)->sin6_addr, resolved);
+		} else {
+			acl_addr(IP, &((struct sockaddr_in *)first->ai_addr)->sin_addr, resolved);
+		}
+	} else {
+		res = NULL;
+	}
+	for (int i = 0; i < config->route_count; i++) {
+		const struct route *r = &config->routes[i];
+		if (r->port_max != 0 && (portnum < r->port_min || portnum > r->port_max)) {
+			continue;
+		}
+		if (r->user[0] != '\0' && strcmp(r->user, user) != 0) {
+			continue;
+		}
+		if (res != NULL && r->match.kind == ACL_CIDR ? acl_match_addr(&r->match, resolved)
+		    : acl_match(&r->match, type, buf, addr)) {
+			return r;
+		}
+	}
+	return NULL;
+}
+
+// 解析目的域名，返回getaddrinfo的错误码
+int app_resolve(const char *name, unsigned short int portnum, struct addrinfo **res)
+{
+	char portaddr[6];
+	struct addrinfo hints;
+
+	snprintf(portaddr, ARRAY_SIZE(portaddr), "%d", portnum);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	log_message("getaddrinfo: %s %s", name, portaddr);
+	int ret = getaddrinfo(name, portaddr, &hints, res);
+	if (ret != 0) {
+		log_message("getaddrinfo: %s", gai_strerror(ret));
+		return ret;
+	}
+	trace_mark(PHASE_RESOLVED);
+	return 0;
+}
+
+// 域名请求的res为app_connect已解析的结果，NULL时在这里解析
+int app_dial(int action, const struct sock_profile *profile, int type, void *buf,
+	     unsigned short int portnum, struct addrinfo *res)
+{
+	int fd;
+	struct sockaddr_storage remote;
+	socklen_t remotelen;
+
+	if (action == ROUTE_PARENT) {
+		return parent_dial(profile, type, buf, portnum);
+	}
+
+	if (type == IP || type == IPV6) {
+		memset(&remote, 0, sizeof(remote));
+		if (type == IP) {
+			struct sockaddr_in *in = (struct sockaddr_in *)&remote;
+			in->sin_family = AF_INET;
+			memcpy(&in->sin_addr, buf, IPSIZE);
+			in->sin_port = htons(portnum);
+			remotelen = sizeof(*in);
+		} else {
+			struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&remote;
+			in6->sin6_family = AF_INET6;
+			memcpy(&in6->sin6_addr, buf, IP6SIZE);
+			in6->sin6_port = htons(portnum);
+			remotelen = sizeof(*in6);
+		}
+
+		trace_mark(PHASE_RESOLVED);
+		fd = upstream_socket(profile, remote.ss_family, SOCK_STREAM, 0);
+		if (fd == -1) {
+			log_message("socket() in app_connect");
+			return -1;
+		}
+		if (connect(fd, (struct sockaddr *)&remote, remotelen) < 0) {
+			log_message("connect() in app_connect");
+			close(fd);
+			return -1;
+		}
+
+		trace_mark(PHASE_CONNECTED);
+		return fd;
+	} else if (type == DOMAIN) {
+		struct addrinfo *owned = NULL, *order[32];
+		int denied = 0;
+		if (res == NULL) {
+			if (app_resolve((char *)buf, portnum, &owned) != 0) {
+				return -1;
+			}
+			res = owned;
+		}
+		int count = addrinfo_order(res, order, ARRAY_SIZE(order));
+		fd = -1;
+		for (int i = 0; i < count && fd == -1; i++) {
+			struct addrinfo *r = order[i];
+			if (!acl_check_sockaddr(r->ai_addr)) {
+				denied++;
+				continue;
+			}
+			fd = upstream_socket(profile, r->ai_family, r->ai_socktype,
+					     r->ai_protocol);
+			if (fd != -1 && connect(fd, r->ai_addr, r->ai_addrlen) < 0) {
+				close(fd);
+				fd = -1;
+			}
+		}
+		if (owned != NULL) {
+			freeaddrinfo(owned);
+		}
+		if (fd != -1) {
+			trace_mark(PHASE_CONNECTED);
+			return fd;
+		}
+		if (denied > 0) {
+			log_message("%d addresses of %s denied", denied, (char *)buf);
+			errno = EACCES;
+		}
+		return -1;
+	}
+
+    return -1;
+}
+
+int app_connect(int type, void *buf, unsigned short int portnum)
+{
+	char dest[DEST_SIZE];
+
+	if (type == IP) {
+		unsigned char *ip = (unsigned char *)buf;
+		snprintf(dest, sizeof(dest), "%hhu.%hhu.%hhu.%hhu:%hu", ip[0], ip[1],
+			 ip[2], ip[3], portnum);
+	} else if (type == IPV6) {
+		char ip[INET6_ADDRSTRLEN];
+		inet_ntop(AF_INET6, buf, ip, sizeof(ip));
+		snprintf(dest, sizeof(dest), "[%s]:%hu", ip, portnum);
+	} else if (type == DOMAIN) {
+		snprintf(dest, sizeof(dest), "%s:%hu", (char *)buf, portnum);
+	} else {
+		return -1;
+	}
+	if (current_conn != NULL) {
+		memcpy(current_conn->dest, dest, sizeof(dest));
+		current_conn->reason = ACCESSLOG_UNREACHABLE;
+		if (current_conn->workload != NULL) {
+			workload_request(current_conn, type, buf, portnum);
+		}
+	}
+	if (!acl_check(type, buf, 0)) {
+		log_message("Access to %s denied", dest);
+		if (current_conn != NULL) {
+			current_conn->reason = ACCESSLOG_DENIED;
+		}
+		__atomic_fetch_add(&acl_denied, 1, __ATOMIC_RELAXED);
+		errno = EACCES;
+		return -1;
+	}
+
+	// 有网段路由时先解析域名，按解析出的地址选路由，直连时不再解析第二次
+	struct addrinfo *res = NULL;
+	int gai = 0, fd = -1;
+	if (type == DOMAIN && config->route_networks > 0) {
+		gai = app_resolve((char *)buf, portnum, &res);
+	}
+	const struct route *route = route_find(type, buf, portnum, res);
+	int action = config->parent_addr != NULL ? ROUTE_PARENT : ROUTE_DIRECT;
+	const struct sock_profile *profile = config->upstream_profile;
+	if (route != NULL) {
+		action = route->action;
+		if (route->profile != NULL) {
+			profile = route->profile;
+		}
+	}
+	__atomic_fetch_add(&route_taken[action], 1, __ATOMIC_RELAXED);
+	if (action == ROUTE_REJECT) {
+		log_message("Route rejects %s", dest);
+		if (current_conn != NULL) {
+			current_conn->reason = ACCESSLOG_DENIED;
+		}
+		errno = EACCES;
+		goto done;
+	}
+	if (current_conn != NULL) {
+		current_conn->route = action;
+		current_conn->upstream_profile = profile;
+	}
+	if (current_conn != NULL && quota_start(current_conn) < 0) {
+		goto done;
+	}
+
+	if (!breaker_allow(dest)) {
+		log_message("Circuit open for %s, failing fast", dest);
+		goto done;
+	}
+	// 本地解析失败时仍可交给上级代理，它自己解析域名
+	if (gai != 0 && action == ROUTE_DIRECT) {
+		errno = 0;
+	} else {
+		fd = app_dial(action, profile, type, buf, portnum, res);
+	}
+	if (fd == -1 && errno == EACCES) {
+		__atomic_fetch_add(&acl_denied, 1, __ATOMIC_RELAXED);
+		if (current_conn != NULL) {
+			current_conn->reason = ACCESSLOG_DENIED;
+		}
+		errno = EACCES;
+		goto done;
+	}
+	breaker_report(dest, fd != -1);
+done:
+	if (res != NULL) {
+		int saved = errno;
+		freeaddrinfo(res);
+		errno = saved;
+	}
+	return fd;
+}
+
+int socks_invitation(int fd, int *version)
+{
+	char init[2];
+	int nread = readn(fd, (void *)init, ARRAY_SIZE(init));
+	if (nread == 2 && init[0] != VERSION5 && init[0] != VERSION4) {
+        log_message("They send us %hhX %hhX", init[0], init[1]);
+		log_message("Incompatible version!");
+		app_thread_exit(0, fd);
+	}
+	log_message("Initial %hhX %hhX", init[0], init[1]);
+	*version = init[0];
+	return init[1];
+}
+
+char *socks5_auth_get_user(int fd)
+{
+	unsigned char size;
+	readn(fd, (void *)&size, sizeof(size));
+
+	char *user = (char *)malloc(sizeof(char) * size + 1);
+	readn(fd, (void *)user, (int)size);
+	user[size] = 0;
+
+	return user;
+}
+
+char *socks5_auth_get_pass(int fd)
+{
+	unsigned char size;
+	readn(fd, (void *)&size, sizeof(size));
+
+	char *pass = (char *)malloc(sizeof(char) * size + 1);
+	readn(fd, (void *)pass, (int)size);
+	pass[size] = 0;
+
+	return pass;
+}
+
+uint64_t rotl(uint64_t x, int b)
+{
+	return (x << b) | (x >> (64 - b));
+}
+
+#define SIPROUND \
+	do { \
+		v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32); \
+		v2 += v3; v3 = rotl(v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = rotl(v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32); \
+	} while (0)
+
+// SipHash-2-4：密钥随机，外部无法构造使缓存冲突的凭据
+uint64_t siphash(const uint64_t key[2], const unsigned char *data, size_t len)
+{
+	uint64_t v0 = 0x736f6d6570736575ull ^ key[0];
+	uint64_t v1 = 0x646f72616e646f6dull ^ key[1];
+	uint64_t v2 = 0x6c7967656e657261ull ^ key[0];
+	uint64_t v3 = 0x7465646279746573ull ^ key[1];
+	uint64_t m, last = (uint64_t)len << 56;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&m, data + i, sizeof(m));
+		v3 ^= m;
+		SIPROUND;
+		SIPROUND;
+		v0 ^= m;
+	}
+	for (int j = 0; i + j < len; j++) {
+		last |= (uint64_t)data[i + j] << (8 * j);
+	}
+	v3 ^= last;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= last;
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// 凭据按RFC 1929子协商的格式编码：ulen user plen pass
+int auth_encode(unsigned char *msg, const char *user, const char *pass)
+{
+	size_t ulen = strlen(user), plen = strlen(pass);
+	int len = 0;
+	msg[len++] = ulen;
+	memcpy(msg + len, user, ulen);
+	len += ulen;
+	msg[len++] = plen;
+	memcpy(msg + len, pass, plen);
+	return len + plen;
+}
+
+int auth_cache_get(uint64_t key)
+{
+	uint64_t now = monotonic_ns();
+	int status = -1;
+
+	pthread_mutex_lock(&auth_cache_lock);
+	for (int i = 0; i < AUTH_CACHE_WAYS; i++) {
+		struct auth_cache_entry *e = &auth_cache[(key + i) & auth_cache_mask];
+		if (e->key == key && e->expires > now) {
+			status = e->status;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&auth_cache_lock);
+	return status;
+}
+
+void auth_cache_put(uint64_t key, int status)
+{
+	int ttl = status == AUTH_OK ? auth_ttl : auth_negative_ttl;
+	uint64_t now = monotonic_ns();
+	struct auth_cache_entry *victim = NULL;
+
+	if (ttl <= 0) {
+		return;
+	}
+	pthread_mutex_lock(&auth_cache_lock);
+	for (int i = 0; i < AUTH_CACHE_WAYS; i++) {
+		struct auth_cache_entry *e = &auth_cache[(key + i) & auth_cache_mask];
+		if (e->key == key || e->expires <= now) {
+			victim = e;
+			break;
+		}
+		if (victim == NULL || e->expires < victim->expires) {
+			victim = e;
+		}
+	}
+	victim->key = key;
+	victim->status = status;
+	victim->expires = now + ttl * 1000000000ull;
+	pthread_mutex_unlock(&auth_cache_lock);
+}
+
+int auth_static_init(const char *arg)
+{
+	return 0;
+}
+
+int auth_static_verify(const char *user, const char *pass, uint64_t key)
+{
+	return strcmp(config->username, user) == 0 && strcmp(config->password, pass) == 0
+	    ? AUTH_OK : AUTH_FAIL;
+}
+
+// 用户文件每行一个"用户名:密码"
+int auth_file_init(const char *arg)
+{
+	char line[520];
+	FILE *f = arg != NULL ? fopen(arg, "r") : NULL;
+
+	if (f == NULL) {
+		log_message("fopen() for user file %s", arg);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		char *colon = strchr(line, ':');
+		if (colon == NULL) {
+			continue;
+		}
+		line[strcspn(line, "\r\n")] = '\0';
+		*colon = '\0';
+		auth_users = realloc(auth_users, sizeof(char *) * 2 * (auth_user_count + 1));
+		auth_users[2 * auth_user_count] = strdup(line);
+		auth_users[2 * auth_user_count + 1] = strdup(colon + 1);
+		auth_user_count++;
+	}
+	fclose(f);
+	log_message("Loaded %d users from %s", auth_user_count, arg);
+	return 0;
+}
+
+int auth_file_verify(const char *user, const char *pass, uint64_t key)
+{
+	for (int i = 0; i < auth_user_count; i++) {
+		if (strcmp(auth_users[2 * i], user) == 0) {
+			return strcmp(auth_users[2 * i + 1], pass) == 0 ? AUTH_OK : AUTH_FAIL;
+		}
+	}
+	return AUTH_FAIL;
+}
+
+int auth_unix_connect()
+{
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", auth_backend_arg);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		log_message("connect() to auth verifier %s", auth_backend_arg);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// 调用时持有auth_lock；status<0表示校验服务不可用
+void auth_complete(struct auth_request *r, int status)
+{
+	struct auth_request **p = &auth_pending;
+	while (*p != r) {
+		p = &(*p)->next;
+	}
+	*p = r->next;
+	r->status = status;
+	if (status < 0) {
+		__atomic_fetch_add(&auth_backend_errors, 1, __ATOMIC_RELAXED);
+	}
+	if (r->waiters == 0) {
+		pthread_cond_destroy(&r->cond);
+		free(r);
+	} else {
+		pthread_cond_broadcast(&r->cond);
+	}
+}
+
+void auth_fail_all(int sent_only)
+{
+	struct auth_request *r = auth_pending, *next;
+	for (; r != NULL; r = next) {
+		next = r->next;
+		if (r->sent || !sent_only) {
+			auth_complete(r, -1);
+		}
+	}
+}
+
+// 与校验服务通信的唯一线程。所有工作线程的请求在一条连接上流水发送"id(4) ulen user plen pass"，
+// 应答"id(4) version status"可以乱序，慢的应答只耽误等它的客户端
+void *auth_dispatch(void *arg)
+{
+	unsigned char in[AUTH_REPLY_SIZE * 64];
+	unsigned char out[sizeof(((struct auth_request *)0)->msg) * 64];
+	int fd = -1, have = 0, queued = 0;
+	uint64_t stalled = 0;
+
+	while (1) {
+		struct pollfd fds[2] = {
+			{ .fd = auth_wake[0], .events = POLLIN },
+			{ .fd = fd, .events = POLLIN }
+		};
+		uint64_t now = monotonic_ns();
+		struct auth_request *r, *next;
+
+		// 持锁时只把请求复制到发送缓冲区，写套接字在锁外进行，校验服务不读时工作线程照常超时
+		pthread_mutex_lock(&auth_lock);
+		for (r = auth_pending; r != NULL; r = next) {
+			next = r->next;
+			if (r->deadline <= now) {
+				auth_complete(r, -1);
+			}
+		}
+		if (fd >= 0 && queued > 0 && now - stalled > auth_timeout_ms * 1000000ull) {
+			log_message("Auth verifier stopped reading requests");
+			close(fd);
+			fd = -1;
+			queued = 0;
+			auth_fail_all(1);
+		}
+		if (fd < 0 && auth_pending != NULL) {
+			fd = auth_unix_connect();
+			have = 0;
+			queued = 0;
+			if (fd < 0) {
+				auth_fail_all(0);
+			}
+		}
+		for (r = auth_pending; r != NULL && fd >= 0; r = r->next) {
+			if (!r->sent && queued + r->len <= (int)sizeof(out)) {
+				if (queued == 0) {
+					stalled = now;
+				}
+				memcpy(out + queued, r->msg, r->len);
+				queued += r->len;
+				r->sent = 1;
+			}
+		}
+		pthread_mutex_unlock(&auth_lock);
+
+		if (fd >= 0 && queued > 0) {
+			ssize_t n = send(fd, out, queued, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (n > 0) {
+				memmove(out, out + n, queued - n);
+				queued -= n;
+				stalled = now;
+			} else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+				log_message("write() to auth verifier");
+				pthread_mutex_lock(&auth_lock);
+				close(fd);
+				fd = -1;
+				queued = 0;
+				auth_fail_all(1);
+				pthread_mutex_unlock(&auth_lock);
+				continue;
+			}
+		}
+
+		fds[1].fd = fd;
+		fds[1].events = POLLIN | (queued > 0 ? POLLOUT : 0);
+		if (poll(fds, fd < 0 ? 1 : 2, queued > 0 ? 100 : 1000) < 0) {
+			continue;
+		}
+		if (fds[0].revents & POLLIN) {
+			char drain[64];
+			read(auth_wake[0], drain, sizeof(drain));
+		}
+		if (fd < 0 || (fds[1].revents & ~POLLOUT) == 0) {
+			continue;
+		}
+
+		ssize_t n = read(fd, in + have, sizeof(in) - have);
+		pthread_mutex_lock(&auth_lock);
+		if (n <= 0) {
+			log_message("Auth verifier closed the connection");
+			close(fd);
+			fd = -1;
+			queued = 0;
+			auth_fail_all(1);
+			pthread_mutex_unlock(&auth_lock);
+			continue;
+		}
+		have += n;
+		int off = 0;
+		for (; have - off >= AUTH_REPLY_SIZE; off += AUTH_REPLY_SIZE) {
+			uint32_t id;
+			memcpy(&id, in + off, sizeof(id));
+			for (r = auth_pending; r != NULL; r = r->next) {
+				if (r->id == ntohl(id) && r->sent) {
+					auth_complete(r, in[off + 5] == AUTH_OK ? AUTH_OK : AUTH_FAIL);
+					break;
+				}
+			}
+		}
+		pthread_mutex_unlock(&auth_lock);
+		memmove(in, in + off, have - off);
+		have -= off;
+	}
+	return NULL;
+}
+
+int auth_unix_init(const char *arg)
+{
+	pthread_t thread;
+	if (arg == NULL) {
+		return -1;
+	}
+	if (pipe(auth_wake) < 0) {
+		log_message("pipe() for auth");
+		return -1;
+	}
+	fcntl(auth_wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(auth_wake[1], F_SETFL, O_NONBLOCK);
+	if (pthread_create(&thread, NULL, &auth_dispatch, NULL) != 0) {
+		log_message("pthread_create() for auth");
+		close(auth_wake[0]);
+		close(auth_wake[1]);
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+// 相同凭据的并发校验合并为一个请求，所有等待者共享结果
+int auth_unix_verify(const char *user, const char *pass, uint64_t key)
+{
+	struct auth_request *r;
+	struct timespec deadline;
+	int status;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += auth_timeout_ms / 1000;
+	deadline.tv_nsec += (auth_timeout_ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&auth_lock);
+	for (r = auth_pending; r != NULL; r = r->next) {
+		if (r->key == key) {
+			break;
+		}
+	}
+	if (r == NULL) {
+		r = (struct auth_request *)calloc(1, sizeof(struct auth_request));
+		pthread_cond_init(&r->cond, &auth_condattr);
+		r->key = key;
+		r->id = auth_next_id++;
+		r->status = AUTH_PENDING;
+		r->deadline = monotonic_ns() + auth_timeout_ms * 1000000ull;
+		uint32_t id = htonl(r->id);
+		memcpy(r->msg, &id, sizeof(id));
+		r->len = sizeof(id) + auth_encode(r->msg + sizeof(id), user, pass);
+		r->next = auth_pending;
+		auth_pending = r;
+		write(auth_wake[1], "", 1);
+	}
+	r->waiters++;
+	while (r->status == AUTH_PENDING) {
+		if (pthread_cond_timedwait(&r->cond, &auth_lock, &deadline) != 0) {
+			break;
+		}
+	}
+	status = r->status;
+	r->waiters--;
+	if (status != AUTH_PENDING && r->waiters == 0) {
+		pthread_cond_destroy(&r->cond);
+		free(r);
+	}
+	pthread_mutex_unlock(&auth_lock);
+	return status == AUTH_PENDING ? -1 : status;
+}
+
+struct auth_backend auth_backends[] = {
+	{"static", 0, auth_static_init, auth_static_verify},
+	{"file", 0, auth_file_init, auth_file_verify},
+	{"unix", 1, auth_unix_init, auth_unix_verify}
+};
+
+// BACKEND[:ARG]
+int auth_backend_select(const char *spec)
+{
+	char *copy = strdup(spec);
+	char *colon = strchr(copy, ':');
+
+	if (colon != NULL) {
+		*colon = '\0';
+		auth_backend_arg = colon + 1;
+	}
+	for (size_t i = 0; i < ARRAY_SIZE(auth_backends); i++) {
+		if (strcmp(auth_backends[i].name, copy) == 0) {
+			auth_backend = &auth_backends[i];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+int auth_verify(const char *user, const char *pass)
+{
+	unsigned char msg[2 + 2 * 255];
+	uint64_t key;
+	int status;
+
+	if (!auth_backend->cacheable) {
+		return auth_backend->verify(user, pass, 0);
+	}
+	key = siphash(hash_key, msg, auth_encode(msg, user, pass));
+	if ((status = auth_cache_get(key)) >= 0) {
+		__atomic_fetch_add(&auth_cache_hits, 1, __ATOMIC_RELAXED);
+		return status;
+	}
+	__atomic_fetch_add(&auth_cache_misses, 1, __ATOMIC_RELAXED);
+	status = auth_backend->verify(user, pass, key);
+	if (status < 0) {
+		log_message("Auth verifier unavailable, rejecting");
+		return AUTH_FAIL;
+	}
+	auth_cache_put(key, status);
+	return status;
+}
+
+int auth_init()
+{
+	struct auth_cache_entry *cache;
+	unsigned int size = 1;
+	if (auth_cache != NULL) {
+		return 0;
+	}
+	while (size < auth_cache_size) {
+		size <<= 1;
+	}
+	cache = (struct auth_cache_entry *)calloc(size, sizeof(struct auth_cache_entry));
+	if (cache == NULL) {
+		return -1;
+	}
+	pthread_mutex_init(&auth_lock, NULL);
+	pthread_mutex_init(&auth_cache_lock, NULL);
+	pthread_condattr_init(&auth_condattr);
+	pthread_condattr_setclock(&auth_condattr, CLOCK_MONOTONIC);
+	if (auth_backend->init(auth_backend_arg) < 0) {
+		log_message("Cannot start auth backend %s", auth_backend->name);
+		free(cache);
+		return -1;
+	}
+	// 后端启动成功后才发布缓存，失败的重载不会让下一次跳过初始化
+	auth_cache_mask = size - 1;
+	auth_cache = cache;
+	return 0;
+}
+
+int socks5_auth_userpass(int fd, char method)
+{
+	char answer[2] = { VERSION5, method };
+	writen(fd, (void *)answer, ARRAY_SIZE(answer));
+	char resp;
+	readn(fd, (void *)&resp, sizeof(resp));
+	log_message("auth %hhX", resp);
+	char *username = socks5_auth_get_user(fd);
+	char *password = socks5_auth_get_pass(fd);
+	log_message("Login %s", username);
+	if (current_conn != NULL && current_conn->workload != NULL) {
+		current_conn->workload->user_len = strlen(username);
+		current_conn->workload->pass_len = strlen(password);
+	}
+	if (auth_verify(username, password) == AUTH_OK) {
+		char answer[2] = { AUTH_VERSION, AUTH_OK };
+		if (current_conn != NULL) {
+			snprintf(current_conn->user, sizeof(current_conn->user), "%s",
+				 username);
+		}
+		writen(fd, (void *)answer, ARRAY_SIZE(answer));
+		free(username);
+		free(password);
+		return 0;
+	} else {
+		char answer[2] = { AUTH_VERSION, AUTH_FAIL };
+		if (current_conn != NULL) {
+			current_conn->reason = ACCESSLOG_AUTH;
+		}
+		writen(fd, (void *)answer, ARRAY_SIZE(answer));
+		free(username);
+		free(password);
+		return 1;
+	}
+}
+
+int socks5_auth_noauth(int fd, char method)
+{
+	char answer[2] = { VERSION5, method };
+	writen(fd, (void *)answer, ARRAY_SIZE(answer));
+	return 0;
+}
+
+void socks5_auth_notsupported(int fd)
+{
+	char answer[2] = { VERSION5, NOMETHOD };
+	writen(fd, (void *)answer, ARRAY_SIZE(answer));
+}
+
+void socks5_auth(int fd, int methods_count)
+{
+	int supported = 0;
+	int lz4 = 0;
+	int num = methods_count;
+	struct workload_record *w = current_conn != NULL ? current_conn->workload : NULL;
+	if (w != NULL) {
+		w->method_count = num;
+		w->method = NOMETHOD;
+	}
+	for (int i = 0; i < num; i++) {
+		unsigned char type;
+		readn(fd, (void *)&type, 1);
+		log_message("Method AUTH %hhX", type);
+		if (w != NULL && i < WORKLOAD_METHODS) {
+			w->methods[i] = type;
+		}
+		if (type == config->auth_type) {
+			supported = 1;
+		} else if (config->compress && type == (config->auth_type | LZ4_METHOD)) {
+			lz4 = 1;
+		}
+	}
+	if (supported == 0 && lz4 == 0) {
+		socks5_auth_notsupported(fd);
+		app_thread_exit(1, fd);
+	}
+	if (lz4 && current_conn != NULL) {
+		current_conn->zip_net = 1;
+	}
+	char method = config->auth_type | (lz4 ? LZ4_METHOD : 0);
+	int ret = 0;
+	if (w != NULL) {
+		w->method = method;
+	}
+	switch (config->auth_type) {
+	case NOAUTH:
+		ret = socks5_auth_noauth(fd, method);
+		break;
+	case USERPASS:
+		ret = socks5_auth_userpass(fd, method);
+		break;
+	}
+	if (ret == 0) {
+		return;
+	} else {
+		app_thread_exit(1, fd);
+	}
+}
+
+// 返回地址类型，命令写入*cmd
+int socks5_command(int fd, int *cmd)
+{
+	char command[4];
+	readn(fd, (void *)command, ARRAY_SIZE(command));
+	log_message("Command %hhX %hhX %hhX %hhX", command[0], command[1],
+		    command[2], command[3]);
+	*cmd = command[1];
+	return command[3];
+}
+
+unsigned short int socks_read_port(int fd)
+{
+	unsigned short int p;
+	readn(fd, (void *)&p, sizeof(p));
+	log_message("Port %hu", ntohs(p));
+	return p;
+}
+
+char *socks_ip_read(int fd)
+{
+	char *ip = (char *)malloc(sizeof(char) * IPSIZE);
+	readn(fd, (void *)ip, IPSIZE);
+	log_message("IP %hhu.%hhu.%hhu.%hhu", ip[0], ip[1], ip[2], ip[3]);
+	return ip;
+}
+
+char *socks_ip6_read(int fd)
+{
+	char *ip = (char *)malloc(sizeof(char) * IP6SIZE);
+	char text[INET6_ADDRSTRLEN];
+	readn(fd, (void *)ip, IP6SIZE);
+	inet_ntop(AF_INET6, ip, text, sizeof(text));
+	log_message("IPv6 %s", text);
+	return ip;
+}
+
+// type为IP或IPV6
+void socks5_ip_send_response(int fd, int type, char *ip, unsigned short int port)
+{
+	char response[4] = { VERSION5, OK, RESERVED, type };
+	writen(fd, (void *)response, ARRAY_SIZE(response));
+	writen(fd, (void *)ip, type == IPV6 ? IP6SIZE : IPSIZE);
+	writen(fd, (void *)&port, sizeof(port));
+}
+
+void socks5_sockaddr_send_response(int fd, const struct sockaddr_storage *ss)
+{
+	if (ss->ss_family == AF_INET6) {
+		const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)ss;
+		socks5_ip_send_response(fd, IPV6, (char *)&in6->sin6_addr, in6->sin6_port);
+	} else {
+		const struct sockaddr_in *in = (const struct sockaddr_in *)ss;
+		socks5_ip_send_response(fd, IP, (char *)&in->sin_addr, in->sin_port);
+	}
+}
+
+char *socks5_domain_read(int fd, unsigned char *size)
+{
+	unsigned char s;
+	readn(fd, (void *)&s, sizeof(s));
+	char *address = (char *)malloc((sizeof(char) * s) + 1);
+	readn(fd, (void *)address, (int)s);
+	address[s] = 0;
+	log_message("Address %s", address);
+	*size = s;
+	return address;
+}
+
+void socks5_send_failure(int fd, int status)
+{
+	char response[10] = { VERSION5, (char)status, RESERVED, IP };
+	writen(fd, (void *)response, ARRAY_SIZE(response));
+}
+
+void socks5_domain_send_response(int fd, char *domain, unsigned char size,
+				 unsigned short int port)
+{
+	char response[4] = { VERSION5, OK, RESERVED, DOMAIN };
 	writen(fd, (void *)response, ARRAY_SIZE(response));
-	writen(fd, (void *)ip, IPSIZE);
+	writen(fd, (void *)&size, sizeof(size));
+	writen(fd, (void *)domain, size * sizeof(char));
 	writen(fd, (void *)&port, sizeof(port));
 }
 
-char *socks5_domain_read(int fd, unsigned char *size)
+// 绑定通配地址的双栈套接字，内核不支持IPv6时为IPv4套接字
+int listen_socket(int type, unsigned short int port, int backlog)
+{
+	int one = 1, zero = 0;
+	struct sockaddr_storage local;
+	socklen_t len;
+	int fd = socket(AF_INET6, type, 0);
+
+	memset(&local, 0, sizeof(local));
+	if (fd >= 0) {
+		struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&local;
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+		in6->sin6_family = AF_INET6;
+		in6->sin6_addr = in6addr_any;
+		in6->sin6_port = htons(port);
+		len = sizeof(*in6);
+	} else {
+		struct sockaddr_in *in = (struct sockaddr_in *)&local;
+		if ((fd = socket(AF_INET, type, 0)) < 0) {
+			return -1;
+		}
+		in->sin_family = AF_INET;
+		in->sin_addr.s_addr = htonl(INADDR_ANY);
+		in->sin_port = htons(port);
+		len = sizeof(*in);
+	}
+	errno = 0;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0
+	    || bind(fd, (struct sockaddr *)&local, len) < 0
+	    || listen(fd, backlog) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int bind_listen(unsigned short int port)
+{
+	return listen_socket(SOCK_STREAM | SOCK_NONBLOCK, port, 4);
+}
+
+void bind_pool_init()
+{
+	bind_pool = (int *)calloc(bind_port_last - bind_port_first + 1, sizeof(int));
+	for (int port = bind_port_first; port <= bind_port_last; port++) {
+		int fd = bind_listen(port);
+		if (fd < 0) {
+			log_message("bind() for BIND port %d", port);
+			continue;
+		}
+		bind_pool[bind_pool_count++] = fd;
+	}
+	if (bind_pool_count == 0) {
+		log_message("No port in %d-%d is free for BIND", bind_port_first,
+			    bind_port_last);
+		exit(1);
+	}
+	pthread_mutex_init(&bind_lock, NULL);
+	log_message("BIND pool of %d ports", bind_pool_count);
+}
+
+// 丢弃上一个使用者留在监听队列里的连接
+void bind_drain(int fd)
+{
+	int stale;
+	while ((stale = accept(fd, NULL, NULL)) >= 0) {
+		close(stale);
+	}
+	errno = 0;
+}
+
+int bind_pool_get()
+{
+	int fd = -1;
+	if (bind_pool == NULL) {
+		return bind_listen(0);
+	}
+	pthread_mutex_lock(&bind_lock);
+	if (bind_pool_count > 0) {
+		fd = bind_pool[--bind_pool_count];
+	}
+	pthread_mutex_unlock(&bind_lock);
+	if (fd >= 0) {
+		bind_drain(fd);
+	}
+	return fd;
+}
+
+void bind_pool_put(int fd)
+{
+	if (bind_pool == NULL) {
+		close(fd);
+		return;
+	}
+	bind_drain(fd);
+	pthread_mutex_lock(&bind_lock);
+	bind_pool[bind_pool_count++] = fd;
+	pthread_mutex_unlock(&bind_lock);
+}
+
+// 对端应连接的地址：通往预期对端的路由的本地端（连接UDP套接字不发送数据），
+// 否则为客户端连到本机的地址；对端未知时route的地址族为0
+void bind_local_addr(int net_fd, const struct sockaddr_storage *route,
+		     struct sockaddr_storage *local)
+{
+	socklen_t len = sizeof(*local);
+
+	if (route->ss_family != 0) {
+		int fd = socket(route->ss_family, SOCK_DGRAM, 0);
+		socklen_t routelen = route->ss_family == AF_INET6
+		    ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+		if (fd >= 0 && connect(fd, (const struct sockaddr *)route, routelen) == 0
+		    && getsockname(fd, (struct sockaddr *)local, &len) == 0) {
+			close(fd);
+			sockaddr_unmap(local);
+			errno = 0;
+			return;
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+	len = sizeof(*local);
+	if (getsockname(net_fd, (struct sockaddr *)local, &len) < 0
+	    || (local->ss_family != AF_INET && local->ss_family != AF_INET6)) {
+		struct sockaddr_in *in = (struct sockaddr_in *)local;
+		memset(local, 0, sizeof(*local));
+		in->sin_family = AF_INET;
+		in->sin_addr.s_addr = htonl(INADDR_ANY);
+	}
+	sockaddr_unmap(local);
+	errno = 0;
+}
+
+// 只比较地址，不比较端口
+int sockaddr_same_host(const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+	if (a->ss_family != b->ss_family) {
+		return 0;
+	}
+	if (a->ss_family == AF_INET6) {
+		return memcmp(&((const struct sockaddr_in6 *)a)->sin6_addr,
+			      &((const struct sockaddr_in6 *)b)->sin6_addr, IP6SIZE) == 0;
+	}
+	return ((const struct sockaddr_in *)a)->sin_addr.s_addr
+	    == ((const struct sockaddr_in *)b)->sin_addr.s_addr;
+}
+
+int socks4_is_4a(char *ip)
+{
+	return (ip[0] == 0 && ip[1] == 0 && ip[2] == 0 && ip[3] != 0);
+}
+
+int socks4_read_nstring(int fd, char *buf, int size)
+{
+	char sym = 0;
+	int nread = 0;
+	int i = 0;
+
+	while (i < size) {
+		nread = recv(fd, &sym, sizeof(char), 0);
+
+		if (nread <= 0) {
+			break;
+		} else {
+			buf[i] = sym;
+			i++;
+		}
+
+		if (sym == 0) {
+			break;
+		}
+	}
+
+	return i;
+}
+
+void socks4_send_response(int fd, int status)
+{
+	char resp[8] = {0x00, (char)status, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	writen(fd, (void *)resp, ARRAY_SIZE(resp));
+}
+
+unsigned int current_node()
 {
-	unsigned char s;
-	readn(fd, (void *)&s, sizeof(s));
-	char *address = (char *)malloc((sizeof(char) * s) + 1);
-	readn(fd, (void *)address, (int)s);
-	address[s] = 0;
-	log_message("Address %s", address);
-	*size = s;
-	return address;
+	unsigned int cpu, node = 0;
+	if (getcpu(&cpu, &node) != 0 || node >= MAX_NODES) {
+		node = 0;
+	}
+	return node;
 }
 
-void socks5_domain_send_response(int fd, char *domain, unsigned char size,
-				 unsigned short int port)
+struct relay_buf *buf_get()
 {
-	char response[4] = { VERSION5, OK, RESERVED, DOMAIN };
-	writen(fd, (void *)response, ARRAY_SIZE(response));
-	writen(fd, (void *)&size, sizeof(size));
-	writen(fd, (void *)domain, size * sizeof(char));
-	writen(fd, (void *)&port, sizeof(port));
+	unsigned int node = current_node();
+	struct buf_pool *pool = &buf_pools[node];
+
+	pthread_mutex_lock(&pool->lock);
+	struct relay_buf *b = pool->free;
+	if (b != NULL) {
+		pool->free = b->next;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (b == NULL) {
+		// 新内存页在第一次写入时分配在当前节点上
+		b = mmap(NULL, sizeof(struct relay_buf), PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (b == MAP_FAILED) {
+			log_message("mmap() for relay buffer");
+			return NULL;
+		}
+		memset(b, 0, sizeof(struct relay_buf));
+		b->node = node;
+	}
+	return b;
+}
+
+void buf_put(struct relay_buf *b)
+{
+	struct buf_pool *pool = &buf_pools[b->node];
+	pthread_mutex_lock(&pool->lock);
+	b->next = pool->free;
+	pool->free = b;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void buf_account(struct relay_buf *b, size_t n)
+{
+	struct buf_pool *pool = &buf_pools[b->node];
+	if (current_node() == b->node) {
+		__atomic_fetch_add(&pool->local_bytes, n, __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_add(&pool->remote_bytes, n, __ATOMIC_RELAXED);
+	}
+}
+
+int bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+int sockmap_create()
+{
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_SOCKHASH;
+	attr.key_size = sizeof(uint64_t);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = SOCKMAP_SIZE;
+	return bpf(BPF_MAP_CREATE, &attr);
+}
+
+int sockmap_load(struct bpf_insn *insns, int count)
+{
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+	attr.insns = (uintptr_t)insns;
+	attr.insn_cnt = count;
+	attr.license = (uintptr_t)"Public Domain";
+	return bpf(BPF_PROG_LOAD, &attr);
+}
+
+int sockmap_attach(int prog_fd, int type)
+{
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.target_fd = sockmap_attach_fd;
+	attr.attach_bpf_fd = prog_fd;
+	attr.attach_type = type;
+	return bpf(BPF_PROG_ATTACH, &attr);
+}
+
+int sockmap_init()
+{
+	// 按自身cookie查找对端套接字并重定向到对端的发送方向，找不到时交给用户态
+	struct bpf_insn verdict[] = {
+		BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0),
+		BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_get_socket_cookie),
+		BPF_INSN(BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_0, -8, 0),
+		BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0),
+		BPF_INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_2, BPF_PSEUDO_MAP_FD, 0, 0),
+		BPF_INSN(0, 0, 0, 0, 0),
+		BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0),
+		BPF_INSN(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, -8),
+		BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0),
+		BPF_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_sk_redirect_hash),
+		BPF_INSN(BPF_JMP | BPF_JNE | BPF_K, BPF_REG_0, 0, 1, SK_DROP),
+		BPF_INSN(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, SK_PASS),
+		BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+	// 旧内核只支持带stream parser的verdict，parser把整个skb作为一条消息
+	struct bpf_insn parser[] = {
+		BPF_INSN(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_0, BPF_REG_1,
+			 offsetof(struct __sk_buff, len), 0),
+		BPF_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+
+	if ((sockmap_peer_fd = sockmap_create()) < 0
+	    || (sockmap_attach_fd = sockmap_create()) < 0) {
+		log_message("bpf() map create");
+		return -1;
+	}
+	verdict[4].imm = sockmap_peer_fd;
+	int verdict_fd = sockmap_load(verdict, ARRAY_SIZE(verdict));
+	if (verdict_fd < 0) {
+		log_message("bpf() verdict program load");
+		return -1;
+	}
+	if (sockmap_attach(verdict_fd, BPF_SK_SKB_VERDICT) == 0) {
+		return 0;
+	}
+	errno = 0;
+	int parser_fd = sockmap_load(parser, ARRAY_SIZE(parser));
+	if (parser_fd < 0
+	    || sockmap_attach(parser_fd, BPF_SK_SKB_STREAM_PARSER) < 0
+	    || sockmap_attach(verdict_fd, BPF_SK_SKB_STREAM_VERDICT) < 0) {
+		log_message("bpf() program attach");
+		return -1;
+	}
+	return 0;
+}
+
+int sockmap_update(int map_fd, uint64_t key, int fd, int flags)
+{
+	union bpf_attr attr;
+	uint32_t value = fd;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.key = (uintptr_t)&key;
+	attr.value = (uintptr_t)&value;
+	attr.flags = flags;
+	return bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+void sockmap_delete(int map_fd, uint64_t key)
+{
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map_fd;
+	attr.key = (uintptr_t)&key;
+	bpf(BPF_MAP_DELETE_ELEM, &attr);
+}
+
+void sockmap_release(struct conn *c)
+{
+	sockmap_delete(sockmap_attach_fd, c->cookie[0]);
+	sockmap_delete(sockmap_attach_fd, c->cookie[1]);
+	sockmap_delete(sockmap_peer_fd, c->cookie[0]);
+	sockmap_delete(sockmap_peer_fd, c->cookie[1]);
+	errno = 0;
+	c->sockmap = 0;
+}
+
+// 连接上游之后、发送socks应答之前调用。客户端收到应答前不发数据，可以立即交给verdict；
+// 上游套接字在sockmap_pipe()中应答入队后才加入，数据不会抢在应答前面
+void sockmap_prepare(int net_fd, int inet_fd)
+{
+	struct conn *c = current_conn;
+	socklen_t len = sizeof(uint64_t);
+
+	if (!sockmap_enabled || c == NULL || c->tls || c->zip_net || c->zip_inet) {
+		return;
+	}
+	if (getsockopt(net_fd, SOL_SOCKET, SO_COOKIE, &c->cookie[0], &len) < 0
+	    || getsockopt(inet_fd, SOL_SOCKET, SO_COOKIE, &c->cookie[1],
+			  &len) < 0) {
+		log_message("getsockopt() SO_COOKIE");
+		return;
+	}
+	if (sockmap_update(sockmap_peer_fd, c->cookie[0], inet_fd, BPF_NOEXIST) < 0
+	    || sockmap_update(sockmap_peer_fd, c->cookie[1], net_fd,
+			      BPF_NOEXIST) < 0
+	    || sockmap_update(sockmap_attach_fd, c->cookie[0], net_fd,
+			      BPF_NOEXIST) < 0) {
+		log_message("bpf() sockmap update, using userspace relay");
+		sockmap_release(c);
+		return;
+	}
+	c->sockmap = 1;
+}
+
+uint64_t tcp_bytes_received(int fd)
+{
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	memset(&info, 0, sizeof(info));
+	getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len);
+	return info.tcpi_bytes_received;
+}
+
+uint64_t tcp_bytes_written(int fd)
+{
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	int queued = 0;
+	memset(&info, 0, sizeof(info));
+	getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len);
+	ioctl(fd, SIOCOUTQ, &queued);
+	return info.tcpi_bytes_acked + queued;
+}
+
+// 重定向的数据由内核工作项发给对端，一侧的EOF可能早于它最后的数据到达另一侧；
+// 只要写入仍有进展，就等到每个套接字写出的量等于对端收到的量
+void sockmap_flush(int inet_fd, int net_fd, uint64_t in_up, uint64_t in_down,
+		   uint64_t out_up, uint64_t out_down)
+{
+	uint64_t last = 0;
+	int idle = 0;
+
+	while (idle < 500) {
+		uint64_t up = tcp_bytes_written(inet_fd) - out_up;
+		uint64_t down = tcp_bytes_written(net_fd) - out_down;
+		if (up >= tcp_bytes_received(net_fd) - in_up
+		    && down >= tcp_bytes_received(inet_fd) - in_down) {
+			break;
+		}
+		idle = (up + down == last) ? idle + 1 : 0;
+		last = up + down;
+		usleep(10000);
+	}
+}
+
+void sockmap_pipe(int inet_fd, int net_fd)
+{
+	struct conn *c = current_conn;
+	struct pollfd fds[2] = {
+		{ .fd = inet_fd, .events = POLLIN | POLLRDHUP },
+		{ .fd = net_fd, .events = POLLIN | POLLRDHUP }
+	};
+	int one = 1;
+	uint64_t up = tcp_bytes_received(net_fd);
+	uint64_t down = 0;
+	uint64_t in_up = up, in_down = down;
+	uint64_t out_up = tcp_bytes_written(inet_fd);
+	uint64_t out_down = tcp_bytes_written(net_fd);
+
+	if (sockmap_update(sockmap_attach_fd, c->cookie[1], inet_fd,
+			   BPF_NOEXIST) < 0) {
+		log_message("bpf() sockmap update, relaying upstream in userspace");
+	}
+	// 修改SO_RCVLOWAT会触发sk_data_ready，让verdict处理接管前已到达的数据
+	setsockopt(inet_fd, SOL_SOCKET, SO_RCVLOWAT, &one, sizeof(one));
+	setsockopt(net_fd, SOL_SOCKET, SO_RCVLOWAT, &one, sizeof(one));
+
+	struct relay_buf *rb = NULL;
+	int done = 0;
+
+	log_message("Connecting two sockets in kernel");
+	while (!done) {
+		int ret = poll(fds, 2, 1000);
+		if (ret < 0 && errno != EINTR) {
+			break;
+		}
+		for (int i = 0; i < 2 && ret > 0 && !done; i++) {
+			if (fds[i].revents == 0) {
+				continue;
+			}
+			// verdict找不到对端时数据才会留在用户态，照常转发
+			if (rb == NULL && (rb = buf_get()) == NULL) {
+				done = 1;
+				break;
+			}
+			ssize_t nread = recv(fds[i].fd, rb->data, BUFSIZE, MSG_DONTWAIT);
+			if (nread == 0 || (nread < 0 && errno != EAGAIN && errno != EINTR)) {
+				done = 1;
+			} else if (nread > 0) {
+				writen(fds[1 - i].fd, rb->data, nread);
+			}
+		}
+		uint64_t now_up = tcp_bytes_received(net_fd);
+		uint64_t now_down = tcp_bytes_received(inet_fd);
+		if (now_up != up) {
+			conn_account(1, now_up - up);
+			up = now_up;
+		}
+		if (now_down != down) {
+			trace_mark(PHASE_FIRST_BYTE);
+			conn_account(0, now_down - down);
+			down = now_down;
+		}
+	}
+	sockmap_flush(inet_fd, net_fd, in_up, in_down, out_up, out_down);
+	errno = 0;
+	if (rb != NULL) {
+		buf_put(rb);
+	}
+	sockmap_release(c);
+}
+
+uint64_t thread_cpu_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// 前ZIP_SAMPLE字节的碰撞熵H2 = -log2(sum p^2)，超过每字节7.5位（已压缩或加密）时
+// LZ4只会浪费CPU，数据块原样发送
+int zip_incompressible(const unsigned char *data, int n)
+{
+	uint32_t count[256];
+	uint64_t sum = 0;
+
+	memset(count, 0, sizeof(count));
+	if (n > ZIP_SAMPLE) {
+		n = ZIP_SAMPLE;
+	}
+	for (int i = 0; i < n; i++) {
+		count[data[i]]++;
+	}
+	for (int i = 0; i < 256; i++) {
+		sum += (uint64_t)count[i] * count[i];
+	}
+	return sum * 181 < (uint64_t)n * n;
+}
+
+// 帧格式：4字节网络序头部（最高位为压缩标志，其余为长度）加数据
+int zip_send(int fd, const char *data, int n, char *frame)
+{
+	struct conn *c = current_conn;
+	uint32_t header;
+	int len = 0;
+
+	if (n >= ZIP_MIN && !zip_incompressible((const unsigned char *)data, n)) {
+		uint64_t start = thread_cpu_ns();
+		len = lz4_compress_block(data, n, frame + 4, n - 1);
+		c->zip_cpu_ns += thread_cpu_ns() - start;
+	}
+	if (len > 0) {
+		header = htonl(len | ZIP_COMPRESSED);
+	} else {
+		memcpy(frame + 4, data, n);
+		len = n;
+		header = htonl(len);
+		c->zip_bypassed++;
+	}
+	memcpy(frame, &header, sizeof(header));
+	c->zip_raw += n;
+	c->zip_wire += len + sizeof(header);
+	c->zip_blocks++;
+	return writen(fd, frame, len + sizeof(header)) == len + sizeof(header) ? 0 : -1;
+}
+
+int zip_recv(int fd, char *data, char *frame)
+{
+	struct conn *c = current_conn;
+	uint32_t header;
+	int n, ret = readn(fd, &header, sizeof(header));
+
+	if (ret != sizeof(header)) {
+		return ret == 0 ? 0 : -1;
+	}
+	header = ntohl(header);
+	int len = header & ~ZIP_COMPRESSED;
+	if (len == 0 || len > ZIP_BLOCK) {
+		log_message("Bad LZ4 frame length %d", len);
+		return -1;
+	}
+	if (header & ZIP_COMPRESSED) {
+		if (readn(fd, frame, len) != len) {
+			return -1;
+		}
+		uint64_t start = thread_cpu_ns();
+		n = lz4_decompress_block(frame, len, data, BUFSIZE);
+		c->zip_cpu_ns += thread_cpu_ns() - start;
+		if (n <= 0) {
+			log_message("Corrupted LZ4 frame");
+			return -1;
+		}
+	} else {
+		if (readn(fd, data, len) != len) {
+			return -1;
+		}
+		n = len;
+		c->zip_bypassed++;
+	}
+	c->zip_raw += n;
+	c->zip_wire += len + sizeof(header);
+	c->zip_blocks++;
+	return n;
+}
+
+// 有一侧按帧传输的转发（zip[0]对应fd0，zip[1]对应fd1），明文每次最多读ZIP_BLOCK，正好装进一帧
+void zip_pipe(int fd0, int fd1, char *data)
+{
+	struct conn *c = current_conn;
+	struct relay_buf *frame = buf_get();
+	struct pollfd fds[2] = {
+		{ .fd = fd0, .events = POLLIN },
+		{ .fd = fd1, .events = POLLIN }
+	};
+	int zip[2] = { c->zip_inet, c->zip_net };
+	int relayed = 0;
+
+	if (frame == NULL) {
+		return;
+	}
+	log_message("Connecting two sockets, LZ4 on %s", zip[0] ? "upstream" : "client");
+	while (1) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		for (int i = 0; i < 2; i++) {
+			int src = fds[i].fd, dst = fds[1 - i].fd;
+			ssize_t n;
+			if (fds[i].revents == 0) {
+				continue;
+			}
+			if (zip[i]) {
+				n = zip_recv(src, data, frame->data);
+			} else {
+				n = recv(src, data, zip[1 - i] ? ZIP_BLOCK : BUFSIZE, 0);
+			}
+			if (n <= 0) {
+				goto done;
+			}
+			if (zip[1 - i] ? zip_send(dst, data, n, frame->data) < 0
+			    : writen(dst, data, n) != n) {
+				goto done;
+			}
+			conn_account(i, n);
+			if (!relayed) {
+				trace_mark(PHASE_FIRST_BYTE);
+				relayed = 1;
+			}
+		}
+	}
+
+done:
+	buf_put(frame);
+	log_message("LZ4 %s: raw %lu wire %lu ratio %.2f, %lu of %lu blocks raw, cpu %lu us",
+		    c->dest, c->zip_raw, c->zip_wire,
+		    c->zip_wire ? (double)c->zip_raw / c->zip_wire : 0.0,
+		    c->zip_bypassed, c->zip_blocks, c->zip_cpu_ns / 1000);
+	__atomic_fetch_add(&zip_tunnels, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&zip_raw, c->zip_raw, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&zip_wire, c->zip_wire, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&zip_blocks, c->zip_blocks, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&zip_bypassed, c->zip_bypassed, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&zip_cpu_ns, c->zip_cpu_ns, __ATOMIC_RELAXED);
+}
+
+// MSG_ZEROCOPY的一个转发方向。内核在错误队列上报告完成之前缓冲区一直被占用，
+// 所以放进待完成列表，下一次recv换新的缓冲区
+struct zc_side {
+	int fd;
+	int threshold;
+	uint32_t next_id;
+	int inflight;
+	struct relay_buf *head;
+	struct relay_buf *tail;
+};
+
+// 零拷贝被自动暂停时返回0，只有定期的探测隧道重新尝试
+int zc_start_threshold()
+{
+	int t = __atomic_load_n(&zc_threshold, __ATOMIC_RELAXED);
+	if (t <= BUFSIZE) {
+		return t;
+	}
+	return __atomic_fetch_add(&zc_probe, 1, __ATOMIC_RELAXED)
+	    % ZC_PROBE_EVERY == 0 ? zerocopy : 0;
+}
+
+void zc_side_init(struct zc_side *z, int fd, int threshold)
+{
+	int one = 1;
+	memset(z, 0, sizeof(*z));
+	z->fd = fd;
+	z->threshold = threshold;
+	if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+		errno = 0;
+		z->threshold = 0;
+	}
+}
+
+// 完成通知是闭区间，TCP按顺序报告。内核仍然复制时（回环、不支持分散聚集）阈值加倍直到
+// 回到普通send；学到的阈值所有隧道共享，真正的零拷贝完成会把它拉回--zerocopy
+void zc_reap(struct zc_side *z)
+{
+	char control[128];
+	struct msghdr msg;
+
+	while (1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(z->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			errno = 0;
+			return;
+		}
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+		if (cm == NULL || !((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+				    || (cm->cmsg_level == SOL_IPV6
+					&& cm->cmsg_type == IPV6_RECVERR))) {
+			continue;
+		}
+		struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cm);
+		if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0) {
+			continue;
+		}
+		uint32_t lo = serr->ee_info, hi = serr->ee_data;
+		__atomic_fetch_add(&zc_completions, hi - lo + 1, __ATOMIC_RELAXED);
+		if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+			__atomic_fetch_add(&zc_copied, hi - lo + 1, __ATOMIC_RELAXED);
+			if (!zerocopy_fixed && z->threshold > 0) {
+				z->threshold = z->threshold < 4096 ? 4096 : z->threshold * 2;
+				if (z->threshold > __atomic_load_n(&zc_threshold, __ATOMIC_RELAXED)) {
+					__atomic_store_n(&zc_threshold, z->threshold, __ATOMIC_RELAXED);
+				}
+				if (z->threshold > BUFSIZE) {
+					z->threshold = 0;
+					__atomic_fetch_add(&zc_disabled, 1, __ATOMIC_RELAXED);
+					log_message("Zerocopy copied by kernel, using plain send");
+				}
+			}
+		} else if (!zerocopy_fixed) {
+			int t = __atomic_load_n(&zc_threshold, __ATOMIC_RELAXED);
+			if (t > zerocopy) {
+				__atomic_store_n(&zc_threshold, t / 2 > zerocopy ? t / 2 : zerocopy,
+						 __ATOMIC_RELAXED);
+			}
+		}
+		while (z->head != NULL && (int32_t)(z->head->zc_id - hi) <= 0) {
+			struct relay_buf *b = z->head;
+			z->head = b->next;
+			z->inflight--;
+			buf_put(b);
+		}
+		if (z->head == NULL) {
+			z->tail = NULL;
+		}
+	}
+}
+
+// 返回1表示缓冲区已交给内核，调用者需要换一个新的缓冲区
+int zc_send(struct zc_side *z, struct relay_buf *rb, int n)
+{
+	int sent = 0, zc = 0;
+
+	while (sent < n) {
+		ssize_t ret = send(z->fd, rb->data + sent, n - sent, MSG_ZEROCOPY);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret < 0 && errno == ENOBUFS) {
+			// 超出optmem限制，剩余部分普通发送
+			errno = 0;
+			break;
+		}
+		if (ret < 0) {
+			break;
+		}
+		sent += ret;
+		z->next_id++;
+		zc = 1;
+	}
+	int status = 0;
+	if (sent < n && writen(z->fd, rb->data + sent, n - sent) < 0) {
+		status = -1;
+	}
+	if (!zc) {
+		return status;
+	}
+	__atomic_fetch_add(&zc_sends, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&zc_bytes, sent, __ATOMIC_RELAXED);
+	rb->zc_id = z->next_id - 1;
+	rb->next = NULL;
+	if (z->tail != NULL) {
+		z->tail->next = rb;
+	} else {
+		z->head = rb;
+	}
+	z->tail = rb;
+	z->inflight++;
+	return status < 0 ? status : 1;
+}
+
+// 内核仍未释放的缓冲区直接解除映射，页面在发送完成后由内核回收
+void zc_drain(struct zc_side *z)
+{
+	struct pollfd pfd = { .fd = z->fd, .events = 0 };
+	uint64_t deadline = monotonic_ns() + ZC_DRAIN_MS * 1000000ull;
+
+	while (z->head != NULL && monotonic_ns() < deadline) {
+		if (poll(&pfd, 1, ZC_DRAIN_MS) <= 0) {
+			break;
+		}
+		int inflight = z->inflight;
+		zc_reap(z);
+		if (z->inflight == inflight) {
+			break;
+		}
+	}
+	while (z->head != NULL) {
+		struct relay_buf *b = z->head;
+		z->head = b->next;
+		munmap(b, sizeof(struct relay_buf));
+	}
+	z->tail = NULL;
+	z->inflight = 0;
+	errno = 0;
+}
+
+void zc_pipe(int fd0, int fd1, struct relay_buf *rb, int threshold)
+{
+	struct pollfd fds[2] = {
+		{ .fd = fd0, .events = POLLIN },
+		{ .fd = fd1, .events = POLLIN }
+	};
+	struct zc_side side[2];
+	int relayed = 0, done = 0;
+
+	zc_side_init(&side[0], fd1, threshold);
+	zc_side_init(&side[1], fd0, threshold);
+	log_message("Connecting two sockets with zerocopy from %d bytes", threshold);
+	while (!done) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		for (int i = 0; i < 2 && !done; i++) {
+			if (fds[i].revents & POLLERR) {
+				// 错误队列属于发送套接字，对应另一个方向
+				zc_reap(&side[1 - i]);
+			}
+			if (fds[i].revents == 0) {
+				continue;
+			}
+			struct zc_side *z = &side[i];
+			ssize_t nread = recv(fds[i].fd, rb->data, BUFSIZE, MSG_DONTWAIT);
+			if (nread < 0 && (errno == EAGAIN || errno == EINTR)) {
+				errno = 0;
+				continue;
+			}
+			if (nread <= 0) {
+				done = 1;
+				break;
+			}
+			int ret;
+			if (z->threshold > 0 && nread >= z->threshold
+			    && z->inflight < ZC_MAX_INFLIGHT) {
+				ret = zc_send(z, rb, nread);
+			} else {
+				ret = writen(z->fd, rb->data, nread) < 0 ? -1 : 0;
+			}
+			if (ret < 0) {
+				done = 1;
+			}
+			if (ret == 1 && (rb = buf_get()) == NULL) {
+				done = 1;
+			}
+			conn_account(i, nread);
+			if (!relayed) {
+				trace_mark(PHASE_FIRST_BYTE);
+				relayed = 1;
+			}
+		}
+	}
+	zc_drain(&side[0]);
+	zc_drain(&side[1]);
+	if (rb != NULL) {
+		buf_put(rb);
+	}
+}
+
+// sock[i]为fd[i]按setsockopt取值的SO_SNDBUF和SO_RCVBUF，owned标记本转发设置过的，其余是内核的；
+// charge为隧道占用的预算：转发缓冲区和owned的套接字缓冲区
+struct relay_tuning {
+	char *buf;
+	int size;
+	int sock[2][2];
+	int owned[2][2];
+	int fixed[2];
+	uint64_t charge;
+	uint64_t bytes[2];
+	uint64_t last;
+};
+
+// 发送方向用平滑RTT，接收方向用接收端估计的RTT，单位微秒
+uint32_t tcp_rtt_us(int fd, int receiving)
+{
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	memset(&info, 0, sizeof(info));
+	getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len);
+	return receiving ? info.tcpi_rcv_rtt : info.tcpi_rtt;
+}
+
+// 内核把设置的缓冲区大小加倍保存，这里换算回设置时的值
+int sockbuf_get(int fd, int name)
+{
+	int value = 0;
+	socklen_t len = sizeof(value);
+	getsockopt(fd, SOL_SOCKET, name, &value, &len);
+	return value / 2;
+}
+
+int relay_reserve(uint64_t *charge, uint64_t want)
+{
+	if (want <= *charge) {
+		__atomic_fetch_sub(&relay_used, *charge - want, __ATOMIC_RELAXED);
+		*charge = want;
+		return 0;
+	}
+	uint64_t delta = want - *charge;
+	uint64_t used = __atomic_load_n(&relay_used, __ATOMIC_RELAXED);
+	do {
+		if (used + delta > (uint64_t)relay_budget) {
+			return -1;
+		}
+	} while (!__atomic_compare_exchange_n(&relay_used, &used, used + delta, 1,
+					      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	*charge = want;
+	return 0;
 }
 
-int socks4_is_4a(char *ip)
+// 取不小于n的2的幂，限制在[RELAY_MIN_BUF, max]内
+int relay_round(uint64_t n, int max)
 {
-	return (ip[0] == 0 && ip[1] == 0 && ip[2] == 0 && ip[3] != 0);
+	int size = RELAY_MIN_BUF;
+	while (size < n && size < max) {
+		size <<= 1;
+	}
+	return size;
 }
 
-int socks4_read_nstring(int fd, char *buf, int size)
+// 变大立即生效，变小要到四分之一以下才生效，免得在两档之间来回切换
+int relay_settle(int old, int want)
 {
-	char sym = 0;
-	int nread = 0;
-	int i = 0;
+	return want > old || want * 4 <= old ? want : old;
+}
 
-	while (i < size) {
-		nread = recv(fd, &sym, sizeof(char), 0);
+// 带宽时延积为上次调整以来的速率乘两段中较大的RTT，内核只把SO_RCVBUF的一部分通告为窗口，所以取四倍；
+// 接收缓冲区只增不减，缩小会让内核丢掉已排队的数据；超出预算的增长跳过
+void relay_tune(struct relay_tuning *t, const int *fd, uint64_t now)
+{
+	static const int names[2] = { SO_SNDBUF, SO_RCVBUF };
+	uint64_t elapsed = now - t->last;
+	int target[2], sock[2][2], owned[2][2], size;
 
-		if (nread <= 0) {
-			break;
-		} else {
-			buf[i] = sym;
-			i++;
+	// 从fd[i]读出的数据写入fd[1 - i]
+	for (int i = 0; i < 2; i++) {
+		uint64_t rate = t->bytes[i] * 1000000000ull / elapsed;
+		uint32_t rtt = tcp_rtt_us(fd[i], 1), out = tcp_rtt_us(fd[1 - i], 0);
+		target[i] = relay_round(4 * rate * (rtt > out ? rtt : out) / 1000000,
+					RELAY_MAX_SOCKBUF);
+		t->bytes[i] = 0;
+	}
+	t->last = now;
+	memcpy(owned, t->owned, sizeof(owned));
+	for (int i = 0; i < 4; i++) {
+		int *s = &sock[i / 2][i % 2], *o = &owned[i / 2][i % 2];
+		int old = *o ? t->sock[i / 2][i % 2] : sockbuf_get(fd[i / 2], names[i % 2]);
+		*s = t->fixed[i / 2] ? old : relay_settle(old, target[i % 2 ? i / 2 : 1 - i / 2]);
+		if (names[i % 2] == SO_RCVBUF && *s < old) {
+			*s = old;
 		}
+		*o = *o || *s != old;
+	}
+	size = relay_settle(t->size, target[0] > target[1] ? target[0] : target[1]);
+	if (size > RELAY_MAX_BUF) {
+		size = RELAY_MAX_BUF;
+	}
+	if (size == t->size && memcmp(sock, t->sock, sizeof(sock)) == 0) {
+		return;
+	}
 
-		if (sym == 0) {
-			break;
+	uint64_t want = size, old = t->charge;
+	for (int i = 0; i < 4; i++) {
+		want += owned[i / 2][i % 2] ? sock[i / 2][i % 2] : 0;
+	}
+	if (relay_reserve(&t->charge, want) < 0) {
+		__atomic_fetch_add(&relay_capped, 1, __ATOMIC_RELAXED);
+		want = size = size < t->size ? size : t->size;
+		for (int i = 0; i < 4; i++) {
+			int *s = &sock[i / 2][i % 2], cur = t->sock[i / 2][i % 2];
+			if (!t->owned[i / 2][i % 2]) {
+				owned[i / 2][i % 2] = 0;
+				*s = cur;
+			} else if (cur < *s) {
+				*s = cur;
+			}
+			want += owned[i / 2][i % 2] ? *s : 0;
+		}
+		relay_reserve(&t->charge, want);
+	}
+	if (t->charge != old) {
+		__atomic_fetch_add(t->charge > old ? &relay_grown : &relay_shrunk, 1,
+				   __ATOMIC_RELAXED);
+	}
+	for (int i = 0; i < 4; i++) {
+		int s = sock[i / 2][i % 2];
+		if (owned[i / 2][i % 2] && (!t->owned[i / 2][i % 2] || s != t->sock[i / 2][i % 2])) {
+			set_int(fd[i / 2], SOL_SOCKET, names[i % 2], s);
+		}
+	}
+	memcpy(t->sock, sock, sizeof(sock));
+	memcpy(t->owned, owned, sizeof(owned));
+	if (size != t->size) {
+		char *buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (buf != MAP_FAILED) {
+			munmap(t->buf, t->size);
+			t->buf = buf;
+			t->size = size;
+		} else {
+			relay_reserve(&t->charge, t->charge - size + t->size);
 		}
 	}
-
-	return i;
 }
 
-void socks4_send_response(int fd, int status)
+// 设置了--relay-budget时的普通转发：fd0为上游，fd1为客户端；配置中指定了缓冲区大小的套接字保持不变
+void relay_tuned_pipe(int fd0, int fd1)
 {
-	char resp[8] = {0x00, (char)status, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
-	writen(fd, (void *)resp, ARRAY_SIZE(resp));
+	const int fd[2] = { fd0, fd1 };
+	struct relay_tuning t;
+	struct conn *c = current_conn;
+	const struct sock_profile *up = c != NULL && c->upstream_profile != NULL
+	    ? c->upstream_profile : config->upstream_profile;
+	int relayed = 0;
+
+	memset(&t, 0, sizeof(t));
+	t.fixed[0] = up->sndbuf > 0 || up->rcvbuf > 0;
+	t.fixed[1] = config->client_profile->sndbuf > 0 || config->client_profile->rcvbuf > 0;
+	t.size = relay_reserve(&t.charge, BUFSIZE) == 0 ? BUFSIZE : RELAY_MIN_BUF;
+	if (t.charge == 0) {
+		// 预算用尽时仍给最小的缓冲区，隧道照常转发
+		__atomic_fetch_add(&relay_used, t.size, __ATOMIC_RELAXED);
+		t.charge = t.size;
+	}
+	t.buf = mmap(NULL, t.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (t.buf == MAP_FAILED) {
+		log_message("mmap() for relay buffer");
+		__atomic_fetch_sub(&relay_used, t.charge, __ATOMIC_RELAXED);
+		return;
+	}
+	t.last = monotonic_ns();
+	log_message("Connecting two sockets, buffers sized by bandwidth-delay product");
+
+	struct pollfd fds[2] = {
+		{ .fd = fd0, .events = POLLIN },
+		{ .fd = fd1, .events = POLLIN }
+	};
+	while (1) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		for (int i = 0; i < 2; i++) {
+			if (fds[i].revents == 0) {
+				continue;
+			}
+			ssize_t n = recv(fd[i], t.buf, t.size, 0);
+			if (n <= 0 || writen(fd[1 - i], t.buf, n) != n) {
+				goto done;
+			}
+			conn_account(i, n);
+			t.bytes[i] += n;
+			if (!relayed) {
+				trace_mark(PHASE_FIRST_BYTE);
+				relayed = 1;
+			}
+		}
+		uint64_t now = monotonic_ns();
+		if (now - t.last >= RELAY_TUNE_NS) {
+			relay_tune(&t, fd, now);
+		}
+	}
+done:
+	munmap(t.buf, t.size);
+	__atomic_fetch_sub(&relay_used, t.charge, __ATOMIC_RELAXED);
 }
 
 void app_socket_pipe(int fd0, int fd1)
 {
 	int maxfd, ret;
+	int relayed = 0;
 	fd_set rd_set;
-	size_t nread;
-	char buffer_r[BUFSIZE];
+	ssize_t nread;
+	struct relay_buf *rb = buf_get();
+	if (rb == NULL) {
+		return;
+	}
+	char *buffer_r = rb->data;
 
+	if (current_conn != NULL && current_conn->sockmap) {
+		buf_put(rb);
+		sockmap_pipe(fd0, fd1);
+		return;
+	}
+	if (current_conn != NULL && (current_conn->zip_inet || current_conn->zip_net)) {
+		zip_pipe(fd0, fd1, buffer_r);
+		buf_put(rb);
+		return;
+	}
+	int threshold;
+	if (zerocopy > 0 && (threshold = zc_start_threshold()) > 0) {
+		zc_pipe(fd0, fd1, rb, threshold);
+		return;
+	}
+	if (relay_budget > 0) {
+		buf_put(rb);
+		relay_tuned_pipe(fd0, fd1);
+		return;
+	}
     log_message("Connecting two sockets");
 
 	maxfd = (fd0 > fd1) ? fd0 : fd1;
@@ -421,6 +4175,14 @@ void app_socket_pipe(int fd0, int fd1)
 			if (nread <= 0)
 				break;
 			send(fd1, (const void *)buffer_r, nread, 0);
+			conn_account(0, nread);
+			if (numa_stats) {
+				buf_account(rb, nread);
+			}
+			if (!relayed) {
+				trace_mark(PHASE_FIRST_BYTE);
+				relayed = 1;
+			}
 		}
 
 		if (FD_ISSET(fd1, &rd_set)) {
@@ -428,42 +4190,373 @@ void app_socket_pipe(int fd0, int fd1)
 			if (nread <= 0)
 				break;
 			send(fd0, (const void *)buffer_r, nread, 0);
+			conn_account(1, nread);
+			if (numa_stats) {
+				buf_account(rb, nread);
+			}
+			if (!relayed) {
+				trace_mark(PHASE_FIRST_BYTE);
+				relayed = 1;
+			}
+		}
+	}
+	buf_put(rb);
+}
+
+#ifdef WITH_TLS
+int tls_init()
+{
+	tls_ctx = SSL_CTX_new(TLS_server_method());
+	if (tls_ctx == NULL) {
+		return -1;
+	}
+	SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+	SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS);
+	if (SSL_CTX_use_certificate_chain_file(tls_ctx, tls_cert) != 1
+	    || SSL_CTX_use_PrivateKey_file(tls_ctx, tls_key,
+					   SSL_FILETYPE_PEM) != 1
+	    || SSL_CTX_check_private_key(tls_ctx) != 1) {
+		log_message("Cannot load TLS certificate %s and key %s: %s", tls_cert,
+			    tls_key, ERR_error_string(ERR_get_error(), NULL));
+		return -1;
+	}
+	return 0;
+}
+
+int tls_want(SSL *ssl, int ret, short *events)
+{
+	switch (SSL_get_error(ssl, ret)) {
+	case SSL_ERROR_WANT_READ:
+		*events |= POLLIN;
+		return 0;
+	case SSL_ERROR_WANT_WRITE:
+		*events |= POLLOUT;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+// 内核不能接管两个方向时的用户态后备：工作线程经socketpair说普通socks，本线程在它和TLS连接间
+// 搬运记录；两侧都是非阻塞的，一个方向满了不会卡住另一个方向
+void *tls_bridge(void *arg)
+{
+	SSL *ssl = (SSL *)arg;
+	int fd = SSL_get_fd(ssl);
+	int peer = (int)(intptr_t)SSL_get_app_data(ssl);
+	char up[TLS_RECORD_SIZE], down[TLS_RECORD_SIZE];
+	int up_len = 0, up_off = 0, down_len = 0;
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	fcntl(peer, F_SETFL, fcntl(peer, F_GETFL) | O_NONBLOCK);
+	while (1) {
+		struct pollfd fds[2] = {
+			{ .fd = fd, .events = 0 },
+			{ .fd = peer, .events = 0 }
+		};
+		int progress = 0;
+		if (up_off == up_len) {
+			int n = SSL_read(ssl, up, sizeof(up));
+			if (n > 0) {
+				up_len = n;
+				up_off = 0;
+				progress = 1;
+			} else if (tls_want(ssl, n, &fds[0].events) < 0) {
+				break;
+			}
+		}
+		if (up_off < up_len) {
+			ssize_t n = write(peer, up + up_off, up_len - up_off);
+			if (n > 0) {
+				up_off += n;
+				progress = 1;
+			} else if (errno == EAGAIN) {
+				fds[1].events |= POLLOUT;
+			} else {
+				break;
+			}
+		}
+		if (down_len == 0) {
+			ssize_t n = read(peer, down, sizeof(down));
+			if (n > 0) {
+				down_len = n;
+				progress = 1;
+			} else if (n < 0 && errno == EAGAIN) {
+				fds[1].events |= POLLIN;
+			} else {
+				break;
+			}
+		}
+		if (down_len > 0) {
+			int n = SSL_write(ssl, down, down_len);
+			if (n > 0) {
+				down_len = 0;
+				progress = 1;
+			} else if (tls_want(ssl, n, &fds[0].events) < 0) {
+				break;
+			}
+		}
+		if (!progress && poll(fds, 2, -1) < 0 && errno != EINTR) {
+			break;
+		}
+	}
+	SSL_shutdown(ssl);
+	SSL_free(ssl);
+	close(fd);
+	close(peer);
+	return NULL;
+}
+
+// 在接受的套接字上握手，返回工作线程说socks的fd：kTLS接管两个方向时为原套接字，
+// 否则为由tls_bridge服务的socketpair的一端
+int tls_accept(int fd)
+{
+	SSL *ssl = SSL_new(tls_ctx);
+	struct timeval timeout = { TLS_HANDSHAKE_TIMEOUT, 0 };
+	int pair[2];
+	pthread_t thread;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	if (ssl == NULL || SSL_set_fd(ssl, fd) != 1 || SSL_accept(ssl) != 1) {
+		log_message("TLS handshake failed: %s",
+			    ERR_error_string(ERR_get_error(), NULL));
+		__atomic_fetch_add(&tls_failed, 1, __ATOMIC_RELAXED);
+		SSL_free(ssl);
+		return -1;
+	}
+	timeout.tv_sec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	if (BIO_get_ktls_send(SSL_get_wbio(ssl))
+	    && BIO_get_ktls_recv(SSL_get_rbio(ssl))) {
+		__atomic_fetch_add(&tls_ktls, 1, __ATOMIC_RELAXED);
+		SSL_free(ssl);
+		return fd;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+		log_message("socketpair() for TLS");
+		SSL_free(ssl);
+		return -1;
+	}
+	SSL_set_app_data(ssl, (void *)(intptr_t)pair[1]);
+	if (pthread_create(&thread, NULL, &tls_bridge, ssl) != 0) {
+		log_message("pthread_create() for TLS");
+		SSL_free(ssl);
+		close(pair[0]);
+		close(pair[1]);
+		return -1;
+	}
+	pthread_detach(thread);
+	__atomic_fetch_add(&tls_bridged, 1, __ATOMIC_RELAXED);
+	return pair[0];
+}
+#endif
+
+// RFC 1928 BIND：第一个应答是监听地址，第二个是连进来的对端。等待时也检查客户端，
+// 客户端放弃时立即释放端口；请求中给了地址时只接受来自该地址的对端
+int socks5_bind(int net_fd, int type)
+{
+	struct sockaddr_storage expected, route, local, remote;
+	char dest[DEST_SIZE];
+
+	memset(&expected, 0, sizeof(expected));
+	memset(&route, 0, sizeof(route));
+	__atomic_fetch_add(&bind_requests, 1, __ATOMIC_RELAXED);
+	if (type == IP) {
+		struct sockaddr_in *in = (struct sockaddr_in *)&expected;
+		char *ip = socks_ip_read(net_fd);
+		in->sin_family = AF_INET;
+		in->sin_port = htons(9);
+		memcpy(&in->sin_addr, ip, IPSIZE);
+		free(ip);
+		socks_read_port(net_fd);
+	} else if (type == IPV6) {
+		struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&expected;
+		char *ip = socks_ip6_read(net_fd);
+		in6->sin6_family = AF_INET6;
+		in6->sin6_port = htons(9);
+		memcpy(&in6->sin6_addr, ip, IP6SIZE);
+		free(ip);
+		socks_read_port(net_fd);
+	} else if (type == DOMAIN) {
+		unsigned char size;
+		struct addrinfo hints = { .ai_socktype = SOCK_STREAM };
+		struct addrinfo *res;
+		char *address = socks5_domain_read(net_fd, &size);
+		socks_read_port(net_fd);
+		// 域名只用来选择出口地址，不限制对端
+		if (getaddrinfo(address, "9", &hints, &res) == 0) {
+			memcpy(&route, res->ai_addr, res->ai_addrlen);
+			freeaddrinfo(res);
+		}
+		free(address);
+	} else {
+		socks5_send_failure(net_fd, GENERAL_FAILURE);
+		return -1;
+	}
+	if (type != DOMAIN) {
+		route = expected;
+	}
+	trace_mark(PHASE_REQUEST);
+	if (config->parent_addr != NULL) {
+		log_message("BIND is not forwarded to the parent proxy");
+		socks5_send_failure(net_fd, COMMAND_NOT_SUPPORTED);
+		return -1;
+	}
+	if (current_conn != NULL && quota_start(current_conn) < 0) {
+		socks5_send_failure(net_fd, NOT_ALLOWED);
+		return -1;
+	}
+
+	int listen_fd = bind_pool_get();
+	if (listen_fd < 0) {
+		log_message("No BIND port available");
+		__atomic_fetch_add(&bind_exhausted, 1, __ATOMIC_RELAXED);
+		socks5_send_failure(net_fd, GENERAL_FAILURE);
+		return -1;
+	}
+	struct sockaddr_storage bound;
+	socklen_t len = sizeof(bound);
+	getsockname(listen_fd, (struct sockaddr *)&bound, &len);
+	bind_local_addr(net_fd, &route, &local);
+	// 两种地址结构中端口的位置相同
+	((struct sockaddr_in *)&local)->sin_port = ((struct sockaddr_in *)&bound)->sin_port;
+	sockaddr_format(&local, dest, sizeof(dest));
+	log_message("BIND listening on %s", dest);
+	socks5_sockaddr_send_response(net_fd, &local);
+
+	struct pollfd fds[2] = {
+		{ .fd = listen_fd, .events = POLLIN },
+		{ .fd = net_fd, .events = POLLIN | POLLRDHUP }
+	};
+	uint64_t deadline = monotonic_ns() + bind_timeout * 1000000000ull;
+	int peer_fd = -1;
+	while (peer_fd < 0) {
+		uint64_t now = monotonic_ns();
+		if (now >= deadline) {
+			log_message("BIND timed out");
+			__atomic_fetch_add(&bind_timeouts, 1, __ATOMIC_RELAXED);
+			socks5_send_failure(net_fd, TTL_EXPIRED);
+			break;
+		}
+		int ret = poll(fds, 2, (deadline - now) / 1000000 + 1);
+		if (ret < 0 && errno != EINTR) {
+			break;
+		}
+		if (ret <= 0) {
+			continue;
+		}
+		if (fds[1].revents != 0) {
+			log_message("Client left while waiting for BIND peer");
+			break;
+		}
+		len = sizeof(remote);
+		peer_fd = accept(listen_fd, (struct sockaddr *)&remote, &len);
+		if (peer_fd < 0) {
+			errno = 0;
+			continue;
+		}
+		sockaddr_unmap(&remote);
+		if (expected.ss_family != 0 && !sockaddr_same_host(&remote, &expected)) {
+			sockaddr_format(&remote, dest, sizeof(dest));
+			log_message("BIND peer %s is not the requested one", dest);
+			close(peer_fd);
+			peer_fd = -1;
 		}
 	}
+	bind_pool_put(listen_fd);
+	if (peer_fd < 0) {
+		return -1;
+	}
+
+	__atomic_fetch_add(&bind_accepted, 1, __ATOMIC_RELAXED);
+	trace_mark(PHASE_CONNECTED);
+	profile_apply(peer_fd, config->upstream_profile);
+	sockaddr_format(&remote, dest, sizeof(dest));
+	if (current_conn != NULL) {
+		memcpy(current_conn->dest, dest, sizeof(dest));
+	}
+	log_message("BIND peer %s", dest);
+	sockmap_prepare(net_fd, peer_fd);
+	socks5_sockaddr_send_response(net_fd, &remote);
+	return peer_fd;
 }
 
-void *app_thread_process(void *fd)
+void *app_thread_process(void *arg)
 {
-	int net_fd = *(int *)fd;
+	current_conn = (struct conn *)arg;
+	current_conn->config = config = config_acquire();
+	int net_fd = current_conn->net_fd;
 	int version = 0;
 	int inet_fd = -1;
+	trace_mark(PHASE_START);
+	profile_apply(net_fd, config->client_profile);
+	conntable_attach(current_conn);
+#ifdef WITH_TLS
+	if (tls_ctx != NULL) {
+		int fd = tls_accept(net_fd);
+		if (fd < 0) {
+			app_thread_exit(0, net_fd);
+		}
+		net_fd = fd;
+		current_conn->net_fd = fd;
+		current_conn->tls = 1;
+	}
+#endif
 	char methods = socks_invitation(net_fd, &version);
+	current_conn->version = version;
+	trace_mark(PHASE_GREETING);
 
 	switch (version) {
 	case VERSION5: {
 			socks5_auth(net_fd, methods);
-			int command = socks5_command(net_fd);
+			trace_mark(PHASE_AUTH);
+			int cmd;
+			int command = socks5_command(net_fd, &cmd);
+			if (current_conn->workload != NULL) {
+				current_conn->workload->command = cmd;
+			}
 
-			if (command == IP) {
-				char *ip = socks_ip_read(net_fd);
+			if (cmd == BIND) {
+				inet_fd = socks5_bind(net_fd, command);
+				if (inet_fd == -1) {
+					app_thread_exit(1, net_fd);
+				}
+				current_conn->reason = ACCESSLOG_CLOSED;//BIND不经过app_connect
+				break;
+			} else if (cmd != CONNECT) {
+				socks5_send_failure(net_fd, COMMAND_NOT_SUPPORTED);
+				app_thread_exit(1, net_fd);
+			}
+			if (command == IP || command == IPV6) {
+				char *ip = command == IP ? socks_ip_read(net_fd)
+				    : socks_ip6_read(net_fd);
 				unsigned short int p = socks_read_port(net_fd);
+				trace_mark(PHASE_REQUEST);
 
-				inet_fd = app_connect(IP, (void *)ip, ntohs(p));
+				inet_fd = app_connect(command, (void *)ip, ntohs(p));
 				if (inet_fd == -1) {
+					socks5_send_failure(net_fd, errno == EACCES ? NOT_ALLOWED : FAILED);
 					app_thread_exit(1, net_fd);
 				}
-				socks5_ip_send_response(net_fd, ip, p);
+				sockmap_prepare(net_fd, inet_fd);
+				socks5_ip_send_response(net_fd, command, ip, p);
 				free(ip);
 				break;
 			} else if (command == DOMAIN) {
 				unsigned char size;
 				char *address = socks5_domain_read(net_fd, &size);
 				unsigned short int p = socks_read_port(net_fd);
+				trace_mark(PHASE_REQUEST);
 
 				inet_fd = app_connect(DOMAIN, (void *)address, ntohs(p));
 				if (inet_fd == -1) {
+					socks5_send_failure(net_fd, errno == EACCES ? NOT_ALLOWED : FAILED);
 					app_thread_exit(1, net_fd);
 				}
+				sockmap_prepare(net_fd, inet_fd);
 				socks5_domain_send_response(net_fd, address, size, p);
 				free(address);
 				break;
@@ -481,14 +4574,17 @@ void *app_thread_process(void *fd)
 				if (socks4_is_4a(ip)) {
 					char domain[255];
 					socks4_read_nstring(net_fd, domain, sizeof(domain));
+					trace_mark(PHASE_REQUEST);
 					log_message("Socks4A: ident:%s; domain:%s;", ident, domain);
 					inet_fd = app_connect(DOMAIN, (void *)domain, ntohs(p));
 				} else {
+					trace_mark(PHASE_REQUEST);
 					log_message("Socks4: connect by ip & port");
 					inet_fd = app_connect(IP, (void *)ip, ntohs(p));
 				}
 
 				if (inet_fd != -1) {
+					sockmap_prepare(net_fd, inet_fd);
 					socks4_send_response(net_fd, 0x5a);
 				} else {
 					socks4_send_response(net_fd, 0x5b);
@@ -504,6 +4600,11 @@ void *app_thread_process(void *fd)
 		}
 	}
 
+	conntable_publish(current_conn);
+	current_conn->inet_fd = inet_fd;
+	if (current_conn->reason == ACCESSLOG_UNREACHABLE) {
+		current_conn->reason = ACCESSLOG_CLOSED;
+	}
 	app_socket_pipe(inet_fd, net_fd);
 	close(inet_fd);
 	app_thread_exit(0, net_fd);
@@ -511,61 +4612,277 @@ void *app_thread_process(void *fd)
     return NULL;
 }
 
-int app_loop()
+int parse_cpu_list(const char *list)
 {
-	int sock_fd, net_fd;
-	int optval = 1;
-	struct sockaddr_in local, remote;
-	socklen_t remotelen;
-	if ((sock_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		log_message("socket()");
-		exit(1);
+	const char *p = list;
+	char *end;
+
+	CPU_ZERO(&worker_cpus);
+	while (*p != '\0') {
+		long first = strtol(p, &end, 10);
+		long last = first;
+		if (end == p) {
+			return -1;
+		}
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p) {
+				return -1;
+			}
+		}
+		if (first < 0 || last >= CPU_SETSIZE || first > last) {
+			return -1;
+		}
+		for (long cpu = first; cpu <= last; cpu++) {
+			CPU_SET(cpu, &worker_cpus);
+		}
+		p = (*end == ',') ? end + 1 : end;
+		if (*end != ',' && *end != '\0') {
+			return -1;
+		}
 	}
 
-	if (setsockopt
-	    (sock_fd, SOL_SOCKET, SO_REUSEADDR, (char *)&optval,
-	     sizeof(optval)) < 0) {
-		log_message("setsockopt()");
-		exit(1);
+	worker_cpu_count = 0;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &worker_cpus)) {
+			worker_cpu_list[worker_cpu_count++] = cpu;
+		}
 	}
+	return worker_cpu_count;
+}
 
-	memset(&local, 0, sizeof(local));
-	local.sin_family = AF_INET;
-	local.sin_addr.s_addr = htonl(INADDR_ANY);
-	local.sin_port = htons(port);
+int worker_cpu_pick(int fd)
+{
+	if (incoming_cpu) {
+		int cpu;
+		socklen_t len = sizeof(cpu);
+		if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0
+		    && cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &worker_cpus)) {
+			return cpu;
+		}
+	}
+	return worker_cpu_list[worker_cpu_next++ % worker_cpu_count];
+}
 
-	if (bind(sock_fd, (struct sockaddr *)&local, sizeof(local)) < 0) {
-		log_message("bind()");
-		exit(1);
+// 只由accept线程调用。IPv4按地址、IPv6按/64统计；速率用GCRA，tat为额度恢复满的时间，
+// 每个新连接推后一个间隔，不能超过burst个间隔；返回-1拒绝，未跟踪的地址*entry为NULL
+int admission_admit(const struct sockaddr_storage *remote,
+		    struct admission_entry **entry)
+{
+	uint8_t addr[16] = { [10] = 0xff, [11] = 0xff };
+	uint64_t now = monotonic_ns();
+	struct admission_entry *e = NULL, *free_slot = NULL;
+
+	if (remote->ss_family == AF_INET6) {
+		// 一台IPv6主机通常拥有整个/64
+		memcpy(addr, &((const struct sockaddr_in6 *)remote)->sin6_addr, 8);
+		memset(addr + 8, 0, 8);
+	} else {
+		memcpy(addr + 12, &((const struct sockaddr_in *)remote)->sin_addr, 4);
+	}
+	uint64_t h = siphash(hash_key, addr, sizeof(addr));
+	for (int i = 0; i < ADMISSION_PROBES; i++) {
+		struct admission_entry *slot = &admission_table[(h + i) & admission_mask];
+		if (slot->used && memcmp(slot->addr, addr, sizeof(addr)) == 0) {
+			e = slot;
+			break;
+		}
+		if (free_slot == NULL && (!slot->used
+		    || (__atomic_load_n(&slot->active, __ATOMIC_ACQUIRE) == 0
+			&& slot->tat <= now))) {
+			free_slot = slot;
+		}
+	}
+	if (e == NULL) {
+		if (free_slot == NULL) {
+			__atomic_fetch_add(&admission_untracked, 1, __ATOMIC_RELAXED);
+			return 0;
+		}
+		e = free_slot;
+		memcpy(e->addr, addr, sizeof(addr));
+		e->used = 1;
+		e->tat = now;
+	}
+
+	if (config->max_conns_per_ip > 0
+	    && __atomic_load_n(&e->active, __ATOMIC_ACQUIRE) >= config->max_conns_per_ip) {
+		__atomic_fetch_add(&admission_rejected_conns, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	if (config->conn_rate > 0) {
+		uint64_t interval = 1000000000ull / config->conn_rate;
+		uint64_t tat = e->tat > now ? e->tat : now;
+		if (tat - now > interval * (config->conn_burst - 1)) {
+			__atomic_fetch_add(&admission_rejected_rate, 1, __ATOMIC_RELAXED);
+			return -1;
+		}
+		e->tat = tat + interval;
+	}
+	__atomic_fetch_add(&e->active, 1, __ATOMIC_RELAXED);
+	*entry = e;
+	return 0;
+}
+
+void admission_init()
+{
+	unsigned int size = 1;
+	while (size < admission_size) {
+		size <<= 1;
 	}
+	admission_table = (struct admission_entry *)calloc(size,
+		sizeof(struct admission_entry));
+	admission_mask = size - 1;
+}
 
-	if (listen(sock_fd, 25) < 0) {
+int app_loop()
+{
+	int sock_fd, net_fd, ret;
+	struct sockaddr_storage remote;
+	socklen_t remotelen;
+	if ((sock_fd = listen_socket(SOCK_STREAM, port, 25)) < 0) {
 		log_message("listen()");
 		exit(1);
 	}
+	profile_apply(sock_fd, config_current->client_profile);
+	if (config_current->client_profile->fastopen > 0) {
+		set_int(sock_fd, IPPROTO_TCP, TCP_FASTOPEN,
+			config_current->client_profile->fastopen);
+	}
+
+	log_message("Listening port %d...", port);
+
+	pthread_t worker;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	while (1) {
+		remotelen = sizeof(remote);
+		if ((net_fd =
+		     accept(sock_fd, (struct sockaddr *)&remote,
+			    &remotelen)) < 0) {
+			if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS
+			    || errno == ENOMEM) {
+				log_message("accept()");
+				usleep(10000);
+				continue;
+			}
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			log_message("accept()");
+			exit(1);
+		}
+		sockaddr_unmap(&remote);
+		struct admission_entry *admitted = NULL;
+		config = config_acquire();
+		ret = admission_table != NULL ? admission_admit(&remote, &admitted) : 0;
+		config_release(config);
+		if (ret < 0) {
+			struct linger reset = { 1, 0 };
+			setsockopt(net_fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+			close(net_fd);
+			continue;
+		}
+		struct conn *c = (struct conn *)calloc(1, sizeof(struct conn));
+		c->admission = admitted;
+		c->ts[PHASE_ACCEPT] = monotonic_ns();
+		c->inet_fd = -1;
+		c->reason = ACCESSLOG_HANDSHAKE;
+		c->net_fd = net_fd;
+		c->client = remote;
+		c->traced = trace_file != NULL
+		    && trace_counter++ % trace_sample == 0;
+		if (record_file != NULL && record_counter++ % record_sample == 0) {
+			c->workload = calloc(1, sizeof(struct workload_record));
+		}
+		if (worker_cpu_count > 0) {
+			cpu_set_t cpu;
+			CPU_ZERO(&cpu);
+			CPU_SET(worker_cpu_pick(net_fd), &cpu);
+			pthread_attr_setaffinity_np(&attr, sizeof(cpu), &cpu);
+		}
+		if (pthread_create
+		    (&worker, &attr, &app_thread_process,
+		     (void *)c) == 0) {
+			pthread_detach(worker);
+		} else {
+			log_message("pthread_create()");
+			close(net_fd);
+			admission_release(c);
+			free(c);
+		}
+	}
+}
+
+void *app_stats_signal(void *arg)
+{
+	sigset_t *set = (sigset_t *)arg;
+	int sig;
+	while (1) {
+		if (sigwait(set, &sig) == 0 && sig == SIGUSR1 && !daemon_mode) {
+			pthread_mutex_lock(&lock);
+			stats_dump(log_file);
+			pthread_mutex_unlock(&lock);
+		}
+	}
+	return NULL;
+}
+
+void *app_metrics_loop(void *arg)
+{
+	int sock_fd, fd;
+	int optval = 1;
+	struct sockaddr_in local;
+
+	if ((sock_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		log_message("socket() for metrics");
+		return NULL;
+	}
+	setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, (char *)&optval,
+		   sizeof(optval));
 
-	remotelen = sizeof(remote);
-	memset(&remote, 0, sizeof(remote));
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	local.sin_port = htons(metrics_port);
 
-	log_message("Listening port %d...", port);
+	if (bind(sock_fd, (struct sockaddr *)&local, sizeof(local)) < 0
+	    || listen(sock_fd, 5) < 0) {
+		log_message("bind() for metrics");
+		close(sock_fd);
+		return NULL;
+	}
 
-	pthread_t worker;
+	log_message("Metrics on 127.0.0.1:%d", metrics_port);
 	while (1) {
-		if ((net_fd =
-		     accept(sock_fd, (struct sockaddr *)&remote,
-			    &remotelen)) < 0) {
-			log_message("accept()");
-			exit(1);
+		if ((fd = accept(sock_fd, NULL, NULL)) < 0) {
+			continue;
 		}
-        int one = 1;
-        setsockopt(sock_fd, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
-		if (pthread_create
-		    (&worker, NULL, &app_thread_process,
-		     (void *)&net_fd) == 0) {
-			pthread_detach(worker);
-		} else {
-			log_message("pthread_create()");
+		FILE *out = fdopen(fd, "w");
+		if (out == NULL) {
+			close(fd);
+			continue;
 		}
+		stats_dump(out);
+		fclose(out);
+	}
+	return NULL;
+}
+
+void app_stats_start()
+{
+	static sigset_t set;
+	pthread_t thread;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	if (pthread_create(&thread, NULL, &app_stats_signal, &set) == 0) {
+		pthread_detach(thread);
+	}
+	if (metrics_port != 0
+	    && pthread_create(&thread, NULL, &app_metrics_loop, NULL) == 0) {
+		pthread_detach(thread);
 	}
 }
 
@@ -609,64 +4926,739 @@ void daemonize()
 	}
 }
 
+enum long_options {
+	OPT_METRICS_PORT = 256,
+	OPT_TRACE_FILE,
+	OPT_TRACE_SAMPLE,
+	OPT_CPUS,
+	OPT_INCOMING_CPU,
+	OPT_NUMA_STATS,
+	OPT_SHM,
+	OPT_SOCKMAP,
+	OPT_BREAKER_FAILURES,
+	OPT_BREAKER_COOLDOWN,
+	OPT_BREAKER_SIZE,
+	OPT_PROFILE,
+	OPT_CLIENT_PROFILE,
+	OPT_UPSTREAM_PROFILE,
+	OPT_TLS_CERT,
+	OPT_TLS_KEY,
+	OPT_PARENT,
+	OPT_COMPRESS,
+	OPT_AUTH_BACKEND,
+	OPT_AUTH_TTL,
+	OPT_AUTH_NEGATIVE_TTL,
+	OPT_AUTH_TIMEOUT,
+	OPT_AUTH_CACHE,
+	OPT_MAX_CONNS_PER_IP,
+	OPT_CONN_RATE,
+	OPT_CONN_BURST,
+	OPT_ADMISSION_SIZE,
+	OPT_ZEROCOPY,
+	OPT_ZEROCOPY_FIXED,
+	OPT_QUOTA_FILE,
+	OPT_QUOTA,
+	OPT_QUOTA_THROTTLE,
+	OPT_QUOTA_KEEP,
+	OPT_BIND_PORTS,
+	OPT_BIND_TIMEOUT,
+	OPT_PREFER_IPV6,
+	OPT_CONFIG,
+	OPT_ALLOW,
+	OPT_DENY,
+	OPT_ACCESS_LOG,
+	OPT_ACCESS_LOG_SIZE,
+	OPT_ACCESS_LOG_KEEP,
+	OPT_ROUTE,
+	OPT_RECORD,
+	OPT_RECORD_SAMPLE,
+	OPT_RELAY_BUDGET
+};
+
+struct option long_options[] = {
+	{"port", required_argument, NULL, 'n'},
+	{"username", required_argument, NULL, 'u'},
+	{"password", required_argument, NULL, 'p'},
+	{"log", required_argument, NULL, 'l'},
+	{"auth-type", required_argument, NULL, 'a'},
+	{"daemon", no_argument, NULL, 'd'},
+	{"help", no_argument, NULL, 'h'},
+	{"metrics-port", required_argument, NULL, OPT_METRICS_PORT},
+	{"trace-file", required_argument, NULL, OPT_TRACE_FILE},
+	{"trace-sample", required_argument, NULL, OPT_TRACE_SAMPLE},
+	{"cpus", required_argument, NULL, OPT_CPUS},
+	{"incoming-cpu", no_argument, NULL, OPT_INCOMING_CPU},
+	{"numa-stats", no_argument, NULL, OPT_NUMA_STATS},
+	{"shm", optional_argument, NULL, OPT_SHM},
+	{"sockmap", no_argument, NULL, OPT_SOCKMAP},
+	{"breaker-failures", required_argument, NULL, OPT_BREAKER_FAILURES},
+	{"breaker-cooldown", required_argument, NULL, OPT_BREAKER_COOLDOWN},
+	{"breaker-size", required_argument, NULL, OPT_BREAKER_SIZE},
+	{"profile", required_argument, NULL, OPT_PROFILE},
+	{"client-profile", required_argument, NULL, OPT_CLIENT_PROFILE},
+	{"upstream-profile", required_argument, NULL, OPT_UPSTREAM_PROFILE},
+	{"tls-cert", required_argument, NULL, OPT_TLS_CERT},
+	{"tls-key", required_argument, NULL, OPT_TLS_KEY},
+	{"parent", required_argument, NULL, OPT_PARENT},
+	{"compress", no_argument, NULL, OPT_COMPRESS},
+	{"auth-backend", required_argument, NULL, OPT_AUTH_BACKEND},
+	{"auth-ttl", required_argument, NULL, OPT_AUTH_TTL},
+	{"auth-negative-ttl", required_argument, NULL, OPT_AUTH_NEGATIVE_TTL},
+	{"auth-timeout", required_argument, NULL, OPT_AUTH_TIMEOUT},
+	{"auth-cache", required_argument, NULL, OPT_AUTH_CACHE},
+	{"max-conns-per-ip", required_argument, NULL, OPT_MAX_CONNS_PER_IP},
+	{"conn-rate", required_argument, NULL, OPT_CONN_RATE},
+	{"conn-burst", required_argument, NULL, OPT_CONN_BURST},
+	{"admission-size", required_argument, NULL, OPT_ADMISSION_SIZE},
+	{"zerocopy", required_argument, NULL, OPT_ZEROCOPY},
+	{"zerocopy-fixed", no_argument, NULL, OPT_ZEROCOPY_FIXED},
+	{"quota-file", required_argument, NULL, OPT_QUOTA_FILE},
+	{"quota", required_argument, NULL, OPT_QUOTA},
+	{"quota-throttle", required_argument, NULL, OPT_QUOTA_THROTTLE},
+	{"quota-keep", required_argument, NULL, OPT_QUOTA_KEEP},
+	{"bind-ports", required_argument, NULL, OPT_BIND_PORTS},
+	{"bind-timeout", required_argument, NULL, OPT_BIND_TIMEOUT},
+	{"prefer-ipv6", no_argument, NULL, OPT_PREFER_IPV6},
+	{"config", required_argument, NULL, OPT_CONFIG},
+	{"allow", required_argument, NULL, OPT_ALLOW},
+	{"deny", required_argument, NULL, OPT_DENY},
+	{"access-log", required_argument, NULL, OPT_ACCESS_LOG},
+	{"access-log-size", required_argument, NULL, OPT_ACCESS_LOG_SIZE},
+	{"access-log-keep", required_argument, NULL, OPT_ACCESS_LOG_KEEP},
+	{"route", required_argument, NULL, OPT_ROUTE},
+	{"record", required_argument, NULL, OPT_RECORD},
+	{"record-sample", required_argument, NULL, OPT_RECORD_SAMPLE},
+	{"relay-budget", required_argument, NULL, OPT_RELAY_BUDGET},
+	{NULL, 0, NULL, 0}
+};
+
 void usage(char *app)
 {
 	printf
 	    ("USAGE: %s [-h][-n PORT][-a AUTHTYPE][-u USERNAME][-p PASSWORD][-l LOGFILE]\n",
 	     app);
+	printf("\t[--metrics-port PORT][--trace-file FILE][--trace-sample N]\n");
+	printf("\t[--cpus LIST][--incoming-cpu][--numa-stats][--shm[=NAME]]\n");
+	printf("\t[--sockmap][--breaker-failures N][--breaker-cooldown SECONDS]\n");
+	printf("\t[--breaker-size N][--profile NAME:KEY=VALUE,...]\n");
+	printf("\t[--client-profile NAME][--upstream-profile NAME]\n");
+	printf("\t[--tls-cert FILE][--tls-key FILE][--parent [USER:PASS@]HOST:PORT]\n");
+	printf("\t[--compress][--auth-backend BACKEND[:ARG]][--auth-ttl SECONDS]\n");
+	printf("\t[--auth-negative-ttl SECONDS][--auth-timeout MS][--auth-cache N]\n");
+	printf("\t[--max-conns-per-ip N][--conn-rate N][--conn-burst N][--admission-size N]\n");
+	printf("\t[--zerocopy BYTES][--zerocopy-fixed]\n");
+	printf("\t[--quota-file FILE][--quota BYTES][--quota-throttle BYTES][--quota-keep DAYS]\n");
+	printf("\t[--bind-ports FIRST-LAST][--bind-timeout SECONDS]\n");
+	printf("\t[--prefer-ipv6][--config FILE][--allow RULE][--deny RULE]\n");
+	printf("\t[--access-log DIR][--access-log-size BYTES][--access-log-keep N]\n");
+	printf("\t[--route ACTION:RULE[,port=N[-M]][,user=NAME][,profile=NAME]]\n");
+	printf("\t[--record FILE][--record-sample N][--relay-budget BYTES]\n");
 	printf("AUTHTYPE: 0 for NOAUTH, 2 for USERPASS\n");
+	printf("BACKEND: static (-u/-p), file:USERFILE or unix:SOCKET for an external verifier\n");
 	printf
 	    ("By default: port is 1080, authtype is no auth, logfile is stdout\n");
+	printf("Phase latency histograms are dumped on SIGUSR1 and on the metrics port\n");
+	printf("LIST: cpus to pin workers to, e.g. 0-3,8-11\n");
+	printf("NAME: shared memory connection table for proxytop, default %s\n",
+	       CONNTABLE_NAME);
+	printf("Socket profiles: default, interactive, bulk; KEY is one of nodelay,\n");
+	printf("tfo, keepalive, keepintvl, keepcnt, sndbuf, rcvbuf, notsent_lowat, cc\n");
+	printf("FILE: one long option per line, reloaded on SIGHUP\n");
+	printf("RULE: all, ADDRESS[/PREFIX] or DOMAIN (.DOMAIN includes subdomains);\n");
+	printf("the first matching rule decides, unmatched requests are allowed\n");
+	printf("ACTION: direct, parent or reject; unrouted requests use --parent if given\n");
 	exit(1);
 }
 
-int main(int argc, char *argv[])
+struct config *config_new()
 {
-	int ret;
-	log_file = stdout;
-	auth_type = NOAUTH;
-	arg_username = "user";
-	arg_password = "pass";
-	pthread_mutex_init(&lock, NULL);
+	struct config *cfg = (struct config *)calloc(1, sizeof(struct config));
+	cfg->generation = 1;
+	cfg->auth_type = NOAUTH;
+	cfg->username = strdup("user");
+	cfg->password = strdup("pass");
+	memcpy(cfg->profiles, profile_builtin, sizeof(profile_builtin));
+	cfg->profile_count = PROFILE_BUILTIN;
+	strcpy(cfg->client_profile_name, "default");
+	strcpy(cfg->upstream_profile_name, "default");
+	return cfg;
+}
 
-	signal(SIGPIPE, SIG_IGN);
+void config_free(struct config *cfg)
+{
+	free(cfg->username);
+	free(cfg->password);
+	free(cfg->acl);
+	free(cfg->routes);
+	if (cfg->parent_addr != NULL) {
+		freeaddrinfo(cfg->parent_addr);
+	}
+	free(cfg->parent_user);
+	free(cfg);
+}
+
+// 所有选项处理完后解析引用并检查，失败时快照不会被发布
+int config_finish(struct config *cfg)
+{
+	cfg->client_profile = profile_find(cfg, cfg->client_profile_name);
+	cfg->upstream_profile = profile_find(cfg, cfg->upstream_profile_name);
+	if (cfg->client_profile == NULL || cfg->upstream_profile == NULL) {
+		log_message("Unknown socket profile");
+		return -1;
+	}
+	for (int i = 0; i < cfg->profile_count; i++) {
+		if (profile_check(&cfg->profiles[i]) < 0) {
+			return -1;
+		}
+	}
+	for (int i = 0; i < cfg->route_count; i++) {
+		struct route *r = &cfg->routes[i];
+		if (r->match.kind == ACL_CIDR) {
+			cfg->route_networks++;
+		}
+		if (r->profile_name[0] != '\0'
+		    && (r->profile = profile_find(cfg, r->profile_name)) == NULL) {
+			log_message("Unknown socket profile %s in route", r->profile_name);
+			return -1;
+		}
+		if (r->action == ROUTE_PARENT && cfg->parent_addr == NULL) {
+			log_message("Route to the parent proxy without --parent");
+			return -1;
+		}
+	}
+	if (cfg->auth_type != NOAUTH && cfg->auth_type != USERPASS) {
+		log_message("Unknown auth type %d", cfg->auth_type);
+		return -1;
+	}
+	if (cfg->conn_burst == 0) {
+		cfg->conn_burst = cfg->conn_rate > 0 ? cfg->conn_rate : 1;
+	}
+	return 0;
+}
+
+// 重新加载能改变的选项；opt不属于这些选项时返回1
+int config_option(struct config *cfg, int opt, char *arg)
+{
+	switch (opt) {
+	case 'u':{
+			free(cfg->username);
+			cfg->username = strdup(arg);
+			break;
+		}
+	case 'p':{
+			free(cfg->password);
+			cfg->password = strdup(arg);
+			break;
+		}
+	case 'a':{
+			cfg->auth_type = atoi(arg);
+			break;
+		}
+	case OPT_PROFILE:{
+			return profile_parse(cfg, arg);
+		}
+	case OPT_CLIENT_PROFILE:{
+			return config_name_set(cfg->client_profile_name,
+					       sizeof(cfg->client_profile_name), arg);
+		}
+	case OPT_UPSTREAM_PROFILE:{
+			return config_name_set(cfg->upstream_profile_name,
+					       sizeof(cfg->upstream_profile_name), arg);
+		}
+	case OPT_PARENT:{
+			return parse_parent(cfg, arg);
+		}
+	case OPT_COMPRESS:{
+			cfg->compress = 1;
+			break;
+		}
+	case OPT_MAX_CONNS_PER_IP:{
+			cfg->max_conns_per_ip = atoi(arg);
+			break;
+		}
+	case OPT_CONN_RATE:{
+			cfg->conn_rate = atoi(arg);
+			break;
+		}
+	case OPT_CONN_BURST:{
+			cfg->conn_burst = atoi(arg);
+			break;
+		}
+	case OPT_QUOTA:{
+			long long n = parse_bytes(arg);
+			if (n < 0) {
+				return -1;
+			}
+			cfg->quota_bytes = n;
+			break;
+		}
+	case OPT_QUOTA_THROTTLE:{
+			cfg->quota_throttle = parse_size(arg);
+			if (cfg->quota_throttle < 0) {
+				return -1;
+			}
+			break;
+		}
+	case OPT_PREFER_IPV6:{
+			cfg->prefer_ipv6 = 1;
+			break;
+		}
+	case OPT_ALLOW:{
+			return acl_parse(cfg, arg, 1);
+		}
+	case OPT_DENY:{
+			return acl_parse(cfg, arg, 0);
+		}
+	case OPT_ROUTE:{
+			return route_parse(cfg, arg);
+		}
+	default:
+		return 1;
+	}
+	return 0;
+}
 
-	while ((ret = getopt(argc, argv, "n:u:p:l:a:hd")) != -1) {
-		switch (ret) {
+// 只在启动时读取的选项；opt未知时返回1
+int option_set(int opt, char *arg)
+{
+	switch (opt) {
 		case 'd':{
 				daemon_mode = 1;
 				daemonize();
 				break;
 			}
 		case 'n':{
-				port = atoi(optarg) & 0xffff;
+				port = atoi(arg) & 0xffff;
+				break;
+			}
+		case 'l':{
+				freopen(arg, "wa", log_file);
 				break;
 			}
-		case 'u':{
-				arg_username = strdup(optarg);
+		case OPT_METRICS_PORT:{
+				metrics_port = atoi(arg) & 0xffff;
 				break;
 			}
-		case 'p':{
-				arg_password = strdup(optarg);
+		case OPT_TRACE_FILE:{
+				trace_file = fopen(arg, "a");
+				if (trace_file == NULL) {
+					log_message("fopen() for trace file");
+					exit(1);
+				}
 				break;
 			}
-		case 'l':{
-				freopen(optarg, "wa", log_file);
+		case OPT_CPUS:{
+				if (parse_cpu_list(arg) <= 0) {
+					return -1;
+				}
+				break;
+			}
+		case OPT_INCOMING_CPU:{
+				incoming_cpu = 1;
+				break;
+			}
+		case OPT_NUMA_STATS:{
+				numa_stats = 1;
+				break;
+			}
+		case OPT_BREAKER_FAILURES:{
+				breaker_failures = atoi(arg);
+				break;
+			}
+		case OPT_BREAKER_COOLDOWN:{
+				breaker_cooldown = atoi(arg);
+				break;
+			}
+		case OPT_BREAKER_SIZE:{
+				breaker_size = atoi(arg);
+				if (breaker_size <= 0) {
+					return -1;
+				}
+				break;
+			}
+		case OPT_TLS_CERT:{
+				tls_cert = strdup(arg);
+				break;
+			}
+		case OPT_TLS_KEY:{
+				tls_key = strdup(arg);
+				break;
+			}
+		case OPT_AUTH_BACKEND:{
+				if (auth_backend_select(arg) < 0) {
+					return -1;
+				}
+				break;
+			}
+		case OPT_AUTH_TTL:{
+				auth_ttl = atoi(arg);
+				break;
+			}
+		case OPT_AUTH_NEGATIVE_TTL:{
+				auth_negative_ttl = atoi(arg);
+				break;
+			}
+		case OPT_AUTH_TIMEOUT:{
+				auth_timeout_ms = atoi(arg);
+				if (auth_timeout_ms <= 0) {
+					return -1;
+				}
+				break;
+			}
+		case OPT_AUTH_CACHE:{
+				auth_cache_size = atoi(arg);
+				if (auth_cache_size == 0) {
+					return -1;
+				}
+				break;
+			}
+		case OPT_ADMISSION_SIZE:{
+				admission_size = atoi(arg);
+				if (admission_size == 0) {
+					return -1;
+				}
 				break;
 			}
-		case 'a':{
-				auth_type = atoi(optarg);
+		case OPT_ZEROCOPY:{
+				zerocopy = parse_size(arg);
+				if (zerocopy <= 0) {
+					return -1;
+				}
+				zc_threshold = zerocopy;
+				break;
+			}
+		case OPT_ZEROCOPY_FIXED:{
+				zerocopy_fixed = 1;
+				break;
+			}
+		case OPT_QUOTA_FILE:{
+				quota_file = strdup(arg);
+				break;
+			}
+		case OPT_QUOTA_KEEP:{
+				quota_keep = atoi(arg);
+				break;
+			}
+		case OPT_BIND_PORTS:{
+				if (sscanf(arg, "%d-%d", &bind_port_first, &bind_port_last) != 2
+				    || bind_port_first <= 0 || bind_port_last > 65535
+				    || bind_port_first > bind_port_last) {
+					return -1;
+				}
+				break;
+			}
+		case OPT_BIND_TIMEOUT:{
+				bind_timeout = atoi(arg);
+				break;
+			}
+		case OPT_SOCKMAP:{
+				sockmap_enabled = 1;
+				break;
+			}
+		case OPT_SHM:{
+				shm_name = arg ? strdup(arg) : CONNTABLE_NAME;
+				break;
+			}
+		case OPT_TRACE_SAMPLE:{
+				trace_sample = atoi(arg);
+				if (trace_sample == 0) {
+					trace_sample = 1;
+				}
+				break;
+			}
+	case OPT_ACCESS_LOG:{
+			accesslog_dir = strdup(arg);
+			break;
+		}
+	case OPT_ACCESS_LOG_SIZE:{
+			accesslog_segment = parse_bytes(arg);
+			if (accesslog_segment <= 0) {
+				return -1;
+			}
+			break;
+		}
+	case OPT_ACCESS_LOG_KEEP:{
+			accesslog_keep = atoi(arg);
+			break;
+		}
+	case OPT_RECORD:{
+			struct workload_header h = {
+				.magic = WORKLOAD_MAGIC,
+				.version = WORKLOAD_VERSION,
+				.record_size = sizeof(struct workload_record),
+				.turns = WORKLOAD_TURNS
+			};
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			h.created_us = ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+			record_file = fopen(arg, "w");
+			if (record_file == NULL || fwrite(&h, sizeof(h), 1, record_file) != 1) {
+				log_message("fopen() for workload recording");
+				exit(1);
+			}
+			fflush(record_file);
+			record_start_ns = monotonic_ns();
+			break;
+		}
+	case OPT_RECORD_SAMPLE:{
+			record_sample = atoi(arg);
+			if (record_sample == 0) {
+				record_sample = 1;
+			}
+			break;
+		}
+	case OPT_RELAY_BUDGET:{
+			relay_budget = parse_bytes(arg);
+			if (relay_budget < 0) {
+				return -1;
+			}
+			break;
+		}
+	default:
+		return 1;
+	}
+	return 0;
+}
+
+int config_load(struct config *cfg, const char *path, int startup);
+
+// 重新加载时startup为0：监听、文件、表和线程保持不变，跳过决定它们的选项
+int option_apply(struct config *cfg, int opt, char *arg, int startup)
+{
+	if (opt == OPT_CONFIG) {
+		return config_load(cfg, arg, startup);
+	}
+	int ret = config_option(cfg, opt, arg);
+	if (ret == 1) {
+		ret = startup ? option_set(opt, arg) : 0;
+	}
+	return ret;
+}
+
+// 每行一个选项：长选项名，有值时后跟值；跳过空行和#开头的行
+int config_load(struct config *cfg, const char *path, int startup)
+{
+	char line[1024];
+	int lineno = 0, ret = 0;
+	FILE *f = fopen(path, "r");
+
+	if (f == NULL) {
+		log_message("fopen() for config %s", path);
+		return -1;
+	}
+	while (ret == 0 && fgets(line, sizeof(line), f) != NULL) {
+		char *key = line + strspn(line, " \t"), *value, *end;
+		const struct option *o;
+		lineno++;
+		key[strcspn(key, "\r\n")] = '\0';
+		if (key[0] == '\0' || key[0] == '#') {
+			continue;
+		}
+		value = key + strcspn(key, " \t=");
+		if (*value != '\0') {
+			*value++ = '\0';
+			value += strspn(value, " \t=");
+		}
+		for (end = value + strlen(value); end > value && (end[-1] == ' ' || end[-1] == '\t');) {
+			*--end = '\0';
+		}
+		for (o = long_options; o->name != NULL; o++) {
+			if (strcmp(o->name, key) == 0) {
 				break;
 			}
-		case 'h':
-		default:
+		}
+		if (o->name == NULL || o->val == OPT_CONFIG || o->val == 'h'
+		    || (o->has_arg == required_argument && value[0] == '\0')
+		    || (o->has_arg == no_argument && value[0] != '\0')) {
+			log_message("%s:%d: bad option %s", path, lineno, key);
+			ret = -1;
+			break;
+		}
+		ret = option_apply(cfg, o->val, value[0] != '\0' ? value : NULL, startup);
+		if (ret != 0) {
+			log_message("%s:%d: bad value for %s", path, lineno, key);
+		}
+	}
+	fclose(f);
+	return ret;
+}
+
+// 重新读取配置文件并重放命令行，文件有错时保留正在使用的快照
+int config_reload()
+{
+	struct config *next = config_new();
+	int opt, ret = 0;
+
+	optind = 0;
+	while (ret == 0 && (opt = getopt_long(config_argc, config_argv, SHORT_OPTIONS,
+					      long_options, NULL)) != -1) {
+		ret = option_apply(next, opt, optarg, 0);
+	}
+	if (ret == 0) {
+		ret = config_finish(next);
+	}
+	if (ret == 0 && next->auth_type == USERPASS) {
+		ret = auth_init();
+	}
+	if (ret != 0) {
+		log_message("Config reload failed, keeping generation %lu",
+			    config_current->generation);
+		__atomic_fetch_add(&config_reload_failed, 1, __ATOMIC_RELAXED);
+		config_free(next);
+		return -1;
+	}
+	next->generation = config_current->generation + 1;
+	struct config *old = __atomic_exchange_n(&config_current, next, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&config_generation, next->generation, __ATOMIC_RELAXED);
+	old->next = config_retired;
+	config_retired = old;
+	log_message("Config generation %lu loaded", next->generation);
+	return 0;
+}
+
+// 只由重新加载线程调用
+void config_reclaim()
+{
+	struct config **p = &config_retired;
+	// 与config_acquire先加计数再读指针配对，必须是SEQ_CST，否则可能读到旧的0
+	while (__atomic_load_n(&config_entering, __ATOMIC_SEQ_CST) != 0) {
+		sched_yield();
+	}
+	while (*p != NULL) {
+		struct config *cfg = *p;
+		if (__atomic_load_n(&cfg->readers, __ATOMIC_ACQUIRE) == 0) {
+			*p = cfg->next;
+			config_free(cfg);
+		} else {
+			p = &cfg->next;
+		}
+	}
+}
+
+void *config_reload_loop(void *arg)
+{
+	sigset_t *set = (sigset_t *)arg;
+	struct timespec tick = { 1, 0 };
+	while (1) {
+		if (sigtimedwait(set, NULL, &tick) == SIGHUP) {
+			config_reload();
+		}
+		errno = 0;
+		config_reclaim();
+	}
+	return NULL;
+}
+
+void config_reload_start()
+{
+	static sigset_t set;
+	pthread_t thread;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	if (pthread_create(&thread, NULL, &config_reload_loop, &set) == 0) {
+		pthread_detach(thread);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	log_file = stdout;
+	auth_backend = &auth_backends[0];
+	pthread_mutex_init(&lock, NULL);
+	pthread_mutex_init(&trace_lock, NULL);
+	pthread_mutex_init(&record_lock, NULL);
+
+	signal(SIGPIPE, SIG_IGN);
+
+	config_current = config_new();
+	config_argc = argc;
+	config_argv = argv;
+	while ((ret =
+		getopt_long(argc, argv, SHORT_OPTIONS, long_options,
+			    NULL)) != -1) {
+		if (ret == OPT_CONFIG) {
+			config_files++;
+		}
+		if (option_apply(config_current, ret, optarg, 1) != 0) {
 			usage(argv[0]);
 		}
 	}
-	log_message("Starting with authtype %X", auth_type);
-	if (auth_type != NOAUTH) {
-		log_message("Username is %s, password is %s", arg_username,
-			    arg_password);
+	if (config_finish(config_current) < 0) {
+		exit(1);
+	}
+	if (config_files > 0) {
+		// 在创建任何线程之前屏蔽，只由重新加载线程接收
+		sigset_t set;
+		sigemptyset(&set);
+		sigaddset(&set, SIGHUP);
+		pthread_sigmask(SIG_BLOCK, &set, NULL);
+	}
+	log_message("Starting with authtype %X", config_current->auth_type);
+	if (getrandom(hash_key, sizeof(hash_key), 0) != sizeof(hash_key)) {
+		log_message("getrandom() for hash key");
+		exit(1);
+	}
+	// 有配置文件时限制可能在重新加载后才打开，地址表提前建好
+	if (config_current->max_conns_per_ip > 0 || config_current->conn_rate > 0
+	    || config_files > 0) {
+		admission_init();
+	}
+	if (config_current->auth_type == USERPASS && auth_init() < 0) {
+		exit(1);
+	}
+	if (config_current->auth_type != NOAUTH) {
+		log_message("Auth backend %s", auth_backend->name);
+	}
+	log_message("Client profile %s, upstream profile %s",
+		    config_current->client_profile->name,
+		    config_current->upstream_profile->name);
+	if (tls_cert != NULL) {
+		if (tls_key == NULL) {
+			tls_key = tls_cert;
+		}
+#ifdef WITH_TLS
+		if (tls_init() < 0) {
+			exit(1);
+		}
+#else
+		log_message("Built without TLS support, rebuild with make TLS=1");
+		exit(1);
+#endif
+	}
+	if (incoming_cpu && worker_cpu_count == 0) {
+		sched_getaffinity(0, sizeof(worker_cpus), &worker_cpus);
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &worker_cpus)) {
+				worker_cpu_list[worker_cpu_count++] = cpu;
+			}
+		}
+	}
+	for (int i = 0; i < MAX_NODES; i++) {
+		pthread_mutex_init(&buf_pools[i].lock, NULL);
+	}
+	pthread_mutex_init(&conntable_lock, NULL);
+	breaker_init();
+	if (bind_port_first > 0) {
+		bind_pool_init();
+	}
+	if (quota_file != NULL && ledger_open(quota_file) < 0) {
+		exit(1);
+	}
+	if (shm_name != NULL && conntable_open(shm_name) < 0) {
+		exit(1);
+	}
+	if (accesslog_dir != NULL && accesslog_init() < 0) {
+		exit(1);
+	}
+	if (sockmap_enabled && sockmap_init() < 0) {
+		log_message("BPF sockmap unavailable, using userspace relay");
+		sockmap_enabled = 0;
+	}
+	app_stats_start();
+	if (config_files > 0) {
+		config_reload_start();
 	}
 	app_loop();
 	return 0;
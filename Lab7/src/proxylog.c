@@ -0,0 +1,492 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include "accesslog.h"
+
+#define KEY_SIZE 128 //聚合键的最大长度
+
+const char *reason_names[ACCESSLOG_REASONS] = {
+	"closed", "handshake", "auth", "denied", "unreachable", "quota"
+};
+
+struct group {
+	char key[KEY_SIZE];
+	uint64_t tunnels;
+	uint64_t failed;
+	uint64_t bytes_up;
+	uint64_t bytes_down;
+	uint64_t setup_us;
+};
+
+char *filter_user;//只看此用户
+char *filter_dest;//目标中包含此字符串
+uint8_t filter_addr[16];//客户端地址所在网段
+int filter_prefix = -1;//网段前缀长度（按128位计），-1为不过滤
+int filter_reason = -1;//只看此结束原因，-1为不过滤
+uint64_t since_us = 0;//开始时间下限
+uint64_t until_us = UINT64_MAX;//开始时间上限
+char *group_by;//聚合字段，NULL为逐条打印
+int top = 20;//聚合时输出的行数
+int verbose = 0;//在标准错误输出扫描速度
+struct group *groups;//开放寻址的聚合表
+size_t group_cap = 0;
+size_t group_count = 0;
+uint64_t scanned = 0;//扫描过的记录数
+uint64_t matched = 0;//匹配的记录数
+
+uint64_t monotonic_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Unix秒数，UTC的YYYY-MM-DD[THH:MM:SS]，或相对现在的-N(s|m|h|d)
+int parse_time(const char *value, uint64_t *us)
+{
+	struct tm tm;
+	char *end;
+
+	if (value[0] == '-') {
+		long n = strtol(value + 1, &end, 10);
+		int unit = *end == 's' ? 1 : *end == 'm' ? 60 : *end == 'h' ? 3600
+		    : *end == 'd' ? 86400 : 0;
+		if (end == value + 1 || unit == 0 || end[1] != '\0') {
+			return -1;
+		}
+		*us = (time(NULL) - n * unit) * 1000000ull;
+		return 0;
+	}
+	memset(&tm, 0, sizeof(tm));
+	end = strptime(value, "%Y-%m-%dT%H:%M:%S", &tm);
+	if (end == NULL) {
+		memset(&tm, 0, sizeof(tm));
+		end = strptime(value, "%Y-%m-%d", &tm);
+	}
+	if (end != NULL && *end == '\0') {
+		*us = timegm(&tm) * 1000000ull;
+		return 0;
+	}
+	long long n = strtoll(value, &end, 10);
+	if (end == value || *end != '\0') {
+		return -1;
+	}
+	*us = n * 1000000ull;
+	return 0;
+}
+
+int parse_network(const char *value)
+{
+	char buf[64];
+	char *slash;
+	int bits;
+
+	snprintf(buf, sizeof(buf), "%s", value);
+	slash = strchr(buf, '/');
+	if (slash != NULL) {
+		*slash = '\0';
+	}
+	memset(filter_addr, 0, sizeof(filter_addr));
+	if (inet_pton(AF_INET, buf, filter_addr + 12) == 1) {
+		filter_addr[10] = filter_addr[11] = 0xff;
+		bits = 32;
+	} else if (inet_pton(AF_INET6, buf, filter_addr) == 1) {
+		bits = 128;
+	} else {
+		return -1;
+	}
+	filter_prefix = 128;
+	if (slash != NULL) {
+		int n = atoi(slash + 1);
+		if (n < 0 || n > bits) {
+			return -1;
+		}
+		filter_prefix = 128 - bits + n;
+	}
+	return 0;
+}
+
+int match_network(const uint8_t *addr)
+{
+	int bytes = filter_prefix / 8, bits = filter_prefix % 8;
+	if (memcmp(addr, filter_addr, bytes) != 0) {
+		return 0;
+	}
+	return bits == 0 || ((addr[bytes] ^ filter_addr[bytes]) & (0xff << (8 - bits))) == 0;
+}
+
+void format_client(const struct accesslog_record *r, char *buf, size_t size)
+{
+	char ip[INET6_ADDRSTRLEN];
+	static const uint8_t mapped[12] = { [10] = 0xff, [11] = 0xff };
+	if (memcmp(r->client, mapped, sizeof(mapped)) == 0) {
+		inet_ntop(AF_INET, r->client + 12, ip, sizeof(ip));
+		snprintf(buf, size, "%s:%hu", ip, r->client_port);
+	} else {
+		inet_ntop(AF_INET6, r->client, ip, sizeof(ip));
+		snprintf(buf, size, "[%s]:%hu", ip, r->client_port);
+	}
+}
+
+// 从accept到与目标建立连接的时间，即除最后的first_byte外各阶段之和
+uint64_t setup_us(const struct accesslog_record *r)
+{
+	uint64_t sum = 0;
+	for (int i = 0; i < ACCESSLOG_PHASES - 1; i++) {
+		sum += r->phase_us[i];
+	}
+	return sum;
+}
+
+int record_match(const struct accesslog_record *r)
+{
+	if (r->start_us < since_us || r->start_us >= until_us) {
+		return 0;
+	}
+	if (filter_reason >= 0 && r->reason != filter_reason) {
+		return 0;
+	}
+	if (filter_prefix >= 0 && !match_network(r->client)) {
+		return 0;
+	}
+	if (filter_user != NULL && strncmp(r->user, filter_user, sizeof(r->user)) != 0) {
+		return 0;
+	}
+	if (filter_dest != NULL && memmem(r->dest, strnlen(r->dest, sizeof(r->dest)),
+					  filter_dest, strlen(filter_dest)) == NULL) {
+		return 0;
+	}
+	return 1;
+}
+
+void record_print(const struct accesslog_record *r)
+{
+	char client[INET6_ADDRSTRLEN + 8];
+	char stamp[32];
+	time_t sec = r->start_us / 1000000;
+	struct tm tm;
+
+	gmtime_r(&sec, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+	format_client(r, client, sizeof(client));
+	printf("%s.%03luZ %s %.*s %.*s v%d %s up=%lu down=%lu duration_ms=%lu setup_us=%lu"
+	       " first_byte_us=%u%s%s%s%s\n", stamp, (r->start_us / 1000) % 1000, client,
+	       (int)sizeof(r->user), r->user[0] ? r->user : "-",
+	       (int)sizeof(r->dest), r->dest[0] ? r->dest : "-", r->version,
+	       r->reason < ACCESSLOG_REASONS ? reason_names[r->reason] : "?",
+	       r->bytes_up, r->bytes_down, r->duration_us / 1000, setup_us(r),
+	       r->phase_us[ACCESSLOG_PHASES - 1],
+	       r->flags & ACCESSLOG_TLS ? " tls" : "", r->flags & ACCESSLOG_LZ4 ? " lz4" : "",
+	       r->flags & ACCESSLOG_SOCKMAP ? " sockmap" : "",
+	       r->flags & ACCESSLOG_PARENT ? " parent" : "");
+}
+
+void group_key(const struct accesslog_record *r, char *key)
+{
+	if (strcmp(group_by, "user") == 0) {
+		snprintf(key, KEY_SIZE, "%.*s", (int)sizeof(r->user), r->user[0] ? r->user : "-");
+	} else if (strcmp(group_by, "dest") == 0 || strcmp(group_by, "host") == 0) {
+		snprintf(key, KEY_SIZE, "%.*s", (int)sizeof(r->dest), r->dest[0] ? r->dest : "-");
+		char *colon = strrchr(key, ':');
+		if (group_by[0] == 'h' && colon != NULL && colon != key) {
+			*colon = '\0';
+		}
+	} else if (strcmp(group_by, "client") == 0) {
+		format_client(r, key, KEY_SIZE);
+		*strrchr(key, ':') = '\0';
+	} else if (strcmp(group_by, "reason") == 0) {
+		snprintf(key, KEY_SIZE, "%s",
+			 r->reason < ACCESSLOG_REASONS ? reason_names[r->reason] : "?");
+	} else {
+		time_t sec = r->start_us / 1000000;
+		struct tm tm;
+		gmtime_r(&sec, &tm);
+		strftime(key, KEY_SIZE, "%Y-%m-%dT%H", &tm);
+	}
+}
+
+struct group *group_find(const char *key)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (const char *p = key; *p != '\0'; p++) {
+		hash = (hash ^ (unsigned char)*p) * 1099511628211ull;
+	}
+	if ((group_count + 1) * 10 > group_cap * 7) {
+		struct group *old = groups;
+		size_t old_cap = group_cap;
+		group_cap = group_cap ? group_cap * 2 : 1024;
+		groups = calloc(group_cap, sizeof(struct group));
+		group_count = 0;
+		for (size_t i = 0; i < old_cap; i++) {
+			if (old[i].key[0] != '\0') {
+				*group_find(old[i].key) = old[i];
+			}
+		}
+		free(old);
+	}
+	for (size_t i = hash & (group_cap - 1);; i = (i + 1) & (group_cap - 1)) {
+		if (groups[i].key[0] == '\0') {
+			memcpy(groups[i].key, key, strlen(key) + 1);
+			group_count++;
+			return &groups[i];
+		}
+		if (strcmp(groups[i].key, key) == 0) {
+			return &groups[i];
+		}
+	}
+}
+
+void record_add(const struct accesslog_record *r)
+{
+	char key[KEY_SIZE];
+	group_key(r, key);
+	struct group *g = group_find(key);
+	g->tunnels++;
+	g->failed += r->reason != ACCESSLOG_CLOSED;
+	g->bytes_up += r->bytes_up;
+	g->bytes_down += r->bytes_down;
+	g->setup_us += setup_us(r);
+}
+
+int compare_groups(const void *a, const void *b)
+{
+	const struct group *x = a, *y = b;
+	uint64_t bx = x->bytes_up + x->bytes_down, by = y->bytes_up + y->bytes_down;
+	if (bx != by) {
+		return (bx < by) - (bx > by);
+	}
+	return (x->tunnels < y->tunnels) - (x->tunnels > y->tunnels);
+}
+
+void print_groups()
+{
+	size_t count = 0;
+	for (size_t i = 0; i < group_cap; i++) {
+		if (groups[i].key[0] != '\0') {
+			groups[count++] = groups[i];
+		}
+	}
+	qsort(groups, count, sizeof(struct group), compare_groups);
+	printf("%-40s %10s %8s %14s %14s %12s\n", group_by, "tunnels", "failed",
+	       "bytes_up", "bytes_down", "mean_setup_us");
+	for (size_t i = 0; i < count && (int)i < top; i++) {
+		struct group *g = &groups[i];
+		printf("%-40s %10lu %8lu %14lu %14lu %12lu\n", g->key, g->tunnels, g->failed,
+		       g->bytes_up, g->bytes_down, g->setup_us / g->tunnels);
+	}
+}
+
+int scan_segment(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	if (st.st_size < (off_t)sizeof(struct accesslog_header)) {
+		close(fd);
+		return 0;
+	}
+	const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(path);
+		return -1;
+	}
+	const struct accesslog_header *h = (const struct accesslog_header *)map;
+	if (h->magic != ACCESSLOG_MAGIC || h->version != ACCESSLOG_VERSION
+	    || h->record_size != sizeof(struct accesslog_record)) {
+		fprintf(stderr, "%s is not an access log of this version\n", path);
+		munmap((void *)map, st.st_size);
+		return -1;
+	}
+	madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+	const struct accesslog_record *r = (const struct accesslog_record *)(h + 1);
+	size_t n = (st.st_size - sizeof(*h)) / sizeof(*r);
+	for (size_t i = 0; i < n; i++) {
+		if (!record_match(&r[i])) {
+			continue;
+		}
+		matched++;
+		if (group_by != NULL) {
+			record_add(&r[i]);
+		} else {
+			record_print(&r[i]);
+		}
+	}
+	scanned += n;
+	munmap((void *)map, st.st_size);
+	return 0;
+}
+
+int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// 目录中的日志段按文件名（即创建时间）顺序扫描
+int scan_path(const char *path)
+{
+	struct stat st;
+	if (stat(path, &st) < 0) {
+		perror(path);
+		return -1;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		return scan_segment(path);
+	}
+	DIR *dir = opendir(path);
+	struct dirent *d;
+	char **names = NULL;
+	int count = 0, cap = 0, ret = 0;
+	size_t slen = strlen(ACCESSLOG_SUFFIX);
+
+	if (dir == NULL) {
+		perror(path);
+		return -1;
+	}
+	while ((d = readdir(dir)) != NULL) {
+		size_t len = strlen(d->d_name);
+		if (len <= slen || strcmp(d->d_name + len - slen, ACCESSLOG_SUFFIX) != 0) {
+			continue;
+		}
+		if (count == cap) {
+			cap = cap ? cap * 2 : 64;
+			names = realloc(names, cap * sizeof(char *));
+		}
+		if (asprintf(&names[count], "%s/%s", path, d->d_name) < 0) {
+			break;
+		}
+		count++;
+	}
+	closedir(dir);
+	qsort(names, count, sizeof(char *), compare_names);
+	for (int i = 0; i < count; i++) {
+		if (scan_segment(names[i]) < 0) {
+			ret = -1;
+		}
+		free(names[i]);
+	}
+	free(names);
+	return ret;
+}
+
+void usage(char *app)
+{
+	printf("USAGE: %s [-h][-u USER][-d DEST][-c ADDRESS[/PREFIX]][-r REASON]\n"
+	       "\t[-s SINCE][-e UNTIL][-g FIELD][-n N][-v] DIR|SEGMENT...\n", app);
+	printf("Reads the binary access log written by proxy --access-log and prints the\n");
+	printf("matching tunnels, or with -g totals per user, dest, host, client, reason or hour\n");
+	printf("-d matches part of the destination; -s and -e take unix seconds, UTC\n");
+	printf("YYYY-MM-DD[THH:MM:SS] or -N(s|m|h|d) relative to now\n");
+	printf("REASON: closed, handshake, auth, denied, unreachable, quota\n");
+	printf("-n limits the groups printed (default 20), -v reports the scan rate\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	while ((ret = getopt(argc, argv, "u:d:c:r:s:e:g:n:vh")) != -1) {
+		switch (ret) {
+		case 'u':{
+				filter_user = optarg;
+				break;
+			}
+		case 'd':{
+				filter_dest = optarg;
+				break;
+			}
+		case 'c':{
+				if (parse_network(optarg) < 0) {
+					usage(argv[0]);
+				}
+				break;
+			}
+		case 'r':{
+				for (int i = 0; i < ACCESSLOG_REASONS; i++) {
+					if (strcmp(reason_names[i], optarg) == 0) {
+						filter_reason = i;
+					}
+				}
+				if (filter_reason < 0) {
+					usage(argv[0]);
+				}
+				break;
+			}
+		case 's':{
+				if (parse_time(optarg, &since_us) < 0) {
+					usage(argv[0]);
+				}
+				break;
+			}
+		case 'e':{
+				if (parse_time(optarg, &until_us) < 0) {
+					usage(argv[0]);
+				}
+				break;
+			}
+		case 'g':{
+				const char *fields[] = { "user", "dest", "host", "client", "reason", "hour" };
+				group_by = NULL;
+				for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+					if (strcmp(fields[i], optarg) == 0) {
+						group_by = optarg;
+					}
+				}
+				if (group_by == NULL) {
+					usage(argv[0]);
+				}
+				break;
+			}
+		case 'n':{
+				top = atoi(optarg);
+				break;
+			}
+		case 'v':{
+				verbose = 1;
+				break;
+			}
+		case 'h':
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind == argc) {
+		usage(argv[0]);
+	}
+
+	uint64_t start = monotonic_ns();
+	ret = 0;
+	for (int i = optind; i < argc; i++) {
+		if (scan_path(argv[i]) < 0) {
+			ret = 1;
+		}
+	}
+	uint64_t elapsed = monotonic_ns() - start;
+	if (group_by != NULL && group_count > 0) {
+		print_groups();
+	}
+	if (verbose) {
+		fprintf(stderr, "scanned %lu records, matched %lu, %.3fs, %.1fM records/s\n",
+			scanned, matched, elapsed / 1e9,
+			elapsed ? scanned * 1e3 / elapsed : 0.0);
+	}
+	return ret;
+}
@@ -0,0 +1,212 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "conntable.h"
+#include "ledger.h"
+
+char *shm_name = CONNTABLE_NAME;//共享内存连接表名称
+int rows = 20;//显示的连接行数
+int once = 0;//只输出一次，不刷新屏幕
+char *ledger_file;//要打印的流量账本文件，NULL为显示连接表
+struct conntable_slot live[CONNTABLE_SLOTS];//本次读取到的连接快照
+
+uint64_t monotonic_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int compare_bytes(const void *a, const void *b)
+{
+	const struct conntable_slot *x = a, *y = b;
+	uint64_t bx = x->bytes_up + x->bytes_down;
+	uint64_t by = y->bytes_up + y->bytes_down;
+	return (bx < by) - (bx > by);
+}
+
+int compare_ledger(const void *a, const void *b)
+{
+	const struct ledger_entry *x = a, *y = b;
+	uint64_t bx = x->bytes_up + x->bytes_down;
+	uint64_t by = y->bytes_up + y->bytes_down;
+	if (x->day != y->day) {
+		return (x->day < y->day) - (x->day > y->day);
+	}
+	return (bx < by) - (bx > by);
+}
+
+char *human(uint64_t bytes, char *buf, size_t size)
+{
+	const char *units = "BKMGT";
+	double v = bytes;
+	int unit = 0;
+	while (v >= 1024 && unit < 4) {
+		v /= 1024;
+		unit++;
+	}
+	snprintf(buf, size, unit ? "%.1f%c" : "%.0f%c", v, units[unit]);
+	return buf;
+}
+
+void render(const struct conntable *table, uint64_t *prev_up,
+	    uint64_t *prev_down)
+{
+	char b0[16], b1[16], b2[16], b3[16];
+	uint64_t now = monotonic_ns();
+	uint64_t up = __atomic_load_n(&table->bytes_up, __ATOMIC_RELAXED);
+	uint64_t down = __atomic_load_n(&table->bytes_down, __ATOMIC_RELAXED);
+	int count = 0;
+
+	for (int i = 0; i < CONNTABLE_SLOTS; i++) {
+		if (conntable_read(&table->slot[i], &live[count])) {
+			count++;
+		}
+	}
+	qsort(live, count, sizeof(live[0]), compare_bytes);
+
+	if (!once) {
+		printf("\033[H\033[2J");
+	}
+	printf("proxy pid %u  up %lus  active %lu  total %lu  failed %lu\n",
+	       table->pid, (now - table->started_ns) / 1000000000,
+	       __atomic_load_n(&table->active_conns, __ATOMIC_RELAXED),
+	       __atomic_load_n(&table->total_conns, __ATOMIC_RELAXED),
+	       __atomic_load_n(&table->failed_conns, __ATOMIC_RELAXED));
+	printf("bytes up %s (%s/s)  down %s (%s/s)\n\n",
+	       human(up, b0, sizeof(b0)), human(up - *prev_up, b1, sizeof(b1)),
+	       human(down, b2, sizeof(b2)),
+	       human(down - *prev_down, b3, sizeof(b3)));
+	printf("%-22s %-32s %-12s %9s %9s %7s\n", "CLIENT", "DESTINATION", "USER",
+	       "UP", "DOWN", "AGE");
+	for (int i = 0; i < count && i < rows; i++) {
+		printf("%-22s %-32.32s %-12.12s %9s %9s %6lus\n", live[i].client,
+		       live[i].dest, live[i].user,
+		       human(live[i].bytes_up, b0, sizeof(b0)),
+		       human(live[i].bytes_down, b1, sizeof(b1)),
+		       (now - live[i].start_ns) / 1000000000);
+	}
+	fflush(stdout);
+	*prev_up = up;
+	*prev_down = down;
+}
+
+int print_ledger(const char *path)
+{
+	char b0[16], b1[16], date[16];
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror("open()");
+		return 1;
+	}
+	const struct ledger *l = mmap(NULL, sizeof(struct ledger), PROT_READ,
+				      MAP_SHARED, fd, 0);
+	close(fd);
+	if (l == MAP_FAILED) {
+		perror("mmap()");
+		return 1;
+	}
+	if (l->magic != LEDGER_MAGIC || l->version != LEDGER_VERSION
+	    || l->slots != LEDGER_SLOTS) {
+		fprintf(stderr, "%s is not a proxy traffic ledger\n", path);
+		return 1;
+	}
+
+	struct ledger_entry *rows = malloc(sizeof(struct ledger_entry) * LEDGER_SLOTS);
+	int count = 0;
+	for (int i = 0; i < LEDGER_SLOTS; i++) {
+		if (__atomic_load_n(&l->entry[i].state, __ATOMIC_ACQUIRE) == LEDGER_READY) {
+			rows[count] = l->entry[i];
+			rows[count].user[LEDGER_USER_SIZE - 1] = '\0';
+			count++;
+		}
+	}
+	qsort(rows, count, sizeof(rows[0]), compare_ledger);
+	printf("%-10s %-32s %9s %9s %14s\n", "DAY", "USER", "UP", "DOWN", "BYTES");
+	for (int i = 0; i < count; i++) {
+		time_t t = (time_t)rows[i].day * 86400;
+		strftime(date, sizeof(date), "%Y-%m-%d", gmtime(&t));
+		printf("%-10s %-32.32s %9s %9s %14lu\n", date, rows[i].user,
+		       human(rows[i].bytes_up, b0, sizeof(b0)),
+		       human(rows[i].bytes_down, b1, sizeof(b1)),
+		       rows[i].bytes_up + rows[i].bytes_down);
+	}
+	free(rows);
+	return 0;
+}
+
+void usage(char *app)
+{
+	printf("USAGE: %s [-h][-s NAME][-n ROWS][-1][-l LEDGER]\n", app);
+	printf("Shows live tunnels of a proxy started with --shm, refreshed every second\n");
+	printf("-l prints the per-user daily traffic of a --quota-file ledger instead\n");
+	printf("By default: NAME is %s, 20 rows\n", CONNTABLE_NAME);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	while ((ret = getopt(argc, argv, "s:n:1l:h")) != -1) {
+		switch (ret) {
+		case 's':{
+				shm_name = optarg;
+				break;
+			}
+		case 'n':{
+				rows = atoi(optarg);
+				break;
+			}
+		case '1':{
+				once = 1;
+				break;
+			}
+		case 'l':{
+				ledger_file = optarg;
+				break;
+			}
+		case 'h':
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (ledger_file != NULL) {
+		return print_ledger(ledger_file);
+	}
+
+	int fd = shm_open(shm_name, O_RDONLY, 0);
+	if (fd < 0) {
+		perror("shm_open()");
+		return 1;
+	}
+	const struct conntable *table = mmap(NULL, sizeof(struct conntable),
+					     PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (table == MAP_FAILED) {
+		perror("mmap()");
+		return 1;
+	}
+	if (__atomic_load_n(&table->magic, __ATOMIC_ACQUIRE) != CONNTABLE_MAGIC
+	    || table->version != CONNTABLE_VERSION) {
+		fprintf(stderr, "%s is not a proxy connection table\n", shm_name);
+		return 1;
+	}
+
+	uint64_t prev_up = table->bytes_up, prev_down = table->bytes_down;
+	while (1) {
+		render(table, &prev_up, &prev_down);
+		if (once) {
+			break;
+		}
+		sleep(1);
+	}
+	return 0;
+}
@@ -0,0 +1,318 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+
+// 给压测用的TCP转发器，让回环上的一跳像广域网链路，不需要root或netem。每个方向把数据流切成包，按带宽限速发出，
+// 加上延迟和抖动后送达；数据流必须保序，丢包（RTO后重传）和乱序表现为一个晚到的包挡住后面所有数据
+
+#define PACKET_SIZE 1448 //每个包携带的字节数，与以太网上的MSS相同
+#define QUEUE_PACKETS 2048 //每个方向最多排队的包数（约3MB），排满后停止读取
+#define MIN_RTO_MS 200 //丢包后重传等待的最短时间
+
+char *listen_port = "12100";//监听端口
+char *target_host = "127.0.0.1";//转发目标地址
+char *target_port;//转发目标端口
+int delay_ms = 0;//单向延迟
+int jitter_ms = 0;//延迟的随机抖动范围（±）
+uint64_t rate = 0;//每个方向的带宽（字节/秒），0为不限
+double loss = 0;//丢包率（百分比）
+double reorder = 0;//乱序率（百分比）
+
+struct packet {
+	uint64_t due;
+	int len;
+	char data[PACKET_SIZE];
+};
+
+struct direction {
+	int src;
+	int dst;
+	unsigned int seed;
+	uint64_t link_free;
+	uint64_t last_due;
+	int head;
+	int count;
+	struct packet *queue;
+};
+
+uint64_t monotonic_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int writen(int fd, void *buf, int n)
+{
+	int nwrite, left = n;
+	while (left > 0) {
+		if ((nwrite = write(fd, buf, left)) == -1) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			return -1;
+		}
+		left -= nwrite;
+		buf += nwrite;
+	}
+	return n;
+}
+
+double chance(struct direction *d)
+{
+	return rand_r(&d->seed) * 100.0 / ((double)RAND_MAX + 1);
+}
+
+uint64_t packet_due(struct direction *d, uint64_t now, int len)
+{
+	uint64_t departure = now > d->link_free ? now : d->link_free;
+	if (rate > 0) {
+		d->link_free = departure + len * 1000000000ull / rate;
+		departure = d->link_free;
+	}
+	int64_t latency = delay_ms * 1000000ll;
+	if (jitter_ms > 0) {
+		latency += (int64_t)(rand_r(&d->seed) % (2 * jitter_ms * 1000 + 1)
+				     - jitter_ms * 1000) * 1000;
+	}
+	if (latency < 0) {
+		latency = 0;
+	}
+	if (loss > 0 && chance(d) < loss) {
+		int rto = 2 * delay_ms > MIN_RTO_MS ? 2 * delay_ms : MIN_RTO_MS;
+		latency += (rto + 2 * delay_ms) * 1000000ll;
+	}
+	if (reorder > 0 && chance(d) < reorder) {
+		latency += (jitter_ms > 0 ? 2 * jitter_ms : 1) * 1000000ll;
+	}
+	uint64_t due = departure + latency;
+	if (due < d->last_due) {
+		due = d->last_due;
+	}
+	d->last_due = due;
+	return due;
+}
+
+void *direction_loop(void *arg)
+{
+	struct direction *d = (struct direction *)arg;
+	int eof = 0;
+
+	while (!eof || d->count > 0) {
+		uint64_t now = monotonic_ns();
+		while (d->count > 0 && d->queue[d->head].due <= now) {
+			struct packet *p = &d->queue[d->head];
+			if (writen(d->dst, p->data, p->len) < 0) {
+				d->count = 0;
+				eof = 1;
+				break;
+			}
+			d->head = (d->head + 1) % QUEUE_PACKETS;
+			d->count--;
+		}
+		if (eof && d->count == 0) {
+			break;
+		}
+
+		struct pollfd pfd = { .fd = d->src, .events = POLLIN };
+		int timeout = -1;
+		if (d->count > 0) {
+			timeout = (d->queue[d->head].due - now) / 1000000 + 1;
+		}
+		int ret = poll(&pfd, !eof && d->count < QUEUE_PACKETS, timeout);
+		if (ret < 0 && errno != EINTR) {
+			break;
+		}
+		if (ret <= 0 || pfd.revents == 0) {
+			continue;
+		}
+		struct packet *p = &d->queue[(d->head + d->count) % QUEUE_PACKETS];
+		int n = read(d->src, p->data, PACKET_SIZE);
+		if (n <= 0) {
+			eof = 1;
+			continue;
+		}
+		p->len = n;
+		p->due = packet_due(d, monotonic_ns(), n);
+		d->count++;
+	}
+	shutdown(d->dst, SHUT_WR);
+	free(d->queue);
+	return NULL;
+}
+
+int target_connect()
+{
+	struct addrinfo hints, *res, *r;
+	int fd = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(target_host, target_port, &hints, &res) != 0) {
+		return -1;
+	}
+	for (r = res; r != NULL; r = r->ai_next) {
+		fd = socket(r->ai_family, r->ai_socktype, r->ai_protocol);
+		if (fd == -1) {
+			continue;
+		}
+		if (connect(fd, r->ai_addr, r->ai_addrlen) == 0) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+void *conn_process(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	int one = 1;
+	pthread_t down;
+	int target = target_connect();
+
+	if (target < 0) {
+		close(fd);
+		return NULL;
+	}
+	setsockopt(fd, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(target, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	unsigned int seed = time(NULL) ^ fd;
+	struct direction dir[2] = {
+		{ .src = fd, .dst = target, .seed = seed },
+		{ .src = target, .dst = fd, .seed = seed * 7 + 1 }
+	};
+	dir[0].queue = malloc(sizeof(struct packet) * QUEUE_PACKETS);
+	dir[1].queue = malloc(sizeof(struct packet) * QUEUE_PACKETS);
+	if (pthread_create(&down, NULL, &direction_loop, &dir[1]) != 0) {
+		free(dir[0].queue);
+		free(dir[1].queue);
+		close(target);
+		close(fd);
+		return NULL;
+	}
+	direction_loop(&dir[0]);
+	pthread_join(down, NULL);
+	close(target);
+	close(fd);
+	return NULL;
+}
+
+uint64_t parse_rate(const char *value)
+{
+	char *end;
+	uint64_t n = strtoull(value, &end, 10);
+	if (*end == 'k' || *end == 'K') {
+		n <<= 10;
+	} else if (*end == 'm' || *end == 'M') {
+		n <<= 20;
+	}
+	return n;
+}
+
+void usage(char *app)
+{
+	printf("USAGE: %s [-h][-l PORT] -t HOST:PORT [-d DELAY_MS][-j JITTER_MS][-b RATE]\n"
+	       "\t[-L LOSS%%][-o REORDER%%]\n", app);
+	printf("Forwards connections on 127.0.0.1:PORT to HOST:PORT, adding one-way DELAY\n");
+	printf("+- JITTER, a RATE cap in bytes per second (k/m suffix) and lost or reordered\n");
+	printf("packets, in both directions\n");
+	printf("By default: port 12100, no impairment\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+	signal(SIGPIPE, SIG_IGN);
+
+	while ((ret = getopt(argc, argv, "l:t:d:j:b:L:o:h")) != -1) {
+		switch (ret) {
+		case 'l':{
+				listen_port = optarg;
+				break;
+			}
+		case 't':{
+				char *colon = strrchr(optarg, ':');
+				if (colon == NULL) {
+					usage(argv[0]);
+				}
+				*colon = '\0';
+				target_host = optarg;
+				target_port = colon + 1;
+				break;
+			}
+		case 'd':{
+				delay_ms = atoi(optarg);
+				break;
+			}
+		case 'j':{
+				jitter_ms = atoi(optarg);
+				break;
+			}
+		case 'b':{
+				rate = parse_rate(optarg);
+				break;
+			}
+		case 'L':{
+				loss = atof(optarg);
+				break;
+			}
+		case 'o':{
+				reorder = atof(optarg);
+				break;
+			}
+		case 'h':
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (target_port == NULL || delay_ms < 0 || jitter_ms < 0) {
+		usage(argv[0]);
+	}
+
+	struct sockaddr_in local;
+	int one = 1;
+	int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	local.sin_port = htons(atoi(listen_port));
+	setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(sock_fd, (struct sockaddr *)&local, sizeof(local)) < 0
+	    || listen(sock_fd, 128) < 0) {
+		perror("listen");
+		return 1;
+	}
+
+	pthread_t worker;
+	while (1) {
+		int fd = accept(sock_fd, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+		if (pthread_create(&worker, NULL, &conn_process,
+				   (void *)(intptr_t)fd) == 0) {
+			pthread_detach(worker);
+		} else {
+			close(fd);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <stdint.h>
+
+#define WORKLOAD_MAGIC 0x4b4c5257 //负载记录文件标识 "WRLK"
+#define WORKLOAD_VERSION 1
+#define WORKLOAD_TURNS 24 //每条隧道记录的收发轮次数
+#define WORKLOAD_DOWN 0x80000000u //轮次中bytes的最高位，表示从目标到客户端
+#define WORKLOAD_METHODS 4 //记录的客户端认证方法数
+
+// 录制文件为这个头部加按隧道结束顺序排列的记录。名字替换为每次启动密钥不同的哈希，只保留长度，
+// 也不保存数据，文件中没有能识别用户或目的地的内容
+struct workload_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t turns;
+	uint64_t created_us;
+	uint8_t reserved[40];
+};
+
+// 一个轮次是一个方向上连续的数据，另一方发送时开始下一轮。gap_us为该轮开始前的空闲时间，第一轮从连接算起；
+// 轮次放不下时剩下的并入最后两轮并设置truncated
+struct workload_turn {
+	uint32_t bytes;
+	uint32_t gap_us;
+};
+
+struct workload_record {
+	uint64_t start_us;
+	uint64_t duration_us;
+	uint64_t bytes_up;
+	uint64_t bytes_down;
+	uint32_t user_id;
+	uint32_t dest_id;
+	uint16_t port;
+	uint8_t version;
+	uint8_t method_count;
+	uint8_t methods[WORKLOAD_METHODS];
+	uint8_t method;
+	uint8_t command;
+	uint8_t atyp;
+	uint8_t dest_len;
+	uint8_t user_len;
+	uint8_t pass_len;
+	uint8_t reason;
+	uint8_t turn_count;
+	uint8_t truncated;
+	uint8_t reserved[7];
+	struct workload_turn turns[WORKLOAD_TURNS];
+};
+
+_Static_assert(sizeof(struct workload_header) == 64, "workload header size");
+_Static_assert(sizeof(struct workload_record) == 256, "workload record size");
+
+#endif